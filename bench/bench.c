@@ -0,0 +1,39 @@
+#include <time.h>
+
+#include "bench.h"
+
+double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+FILE *bench_open_results(const char *path) {
+  FILE *results;
+
+  if(!path)
+    return NULL;
+
+  results = fopen(path, "a");
+  if(!results)
+    fprintf(stderr, "Couldn't open %s, results are only printed\n", path);
+
+  return results;
+}
+
+void bench_header(const char *bench) {
+  printf("\n%-16s %-18s %-10s %-12s %-12s %s\n", bench, "case", "bytes", "best (ms)", "mean (ms)", "MB/s");
+}
+
+void bench_record(FILE *results, const char *bench, const char *name, size_t bytes, double best, double mean) {
+  double rate = best > 0 ? bytes / best / 1e6 : 0;
+
+  printf("%-16s %-18s %-10lu %-12.4f %-12.4f %.1f\n", "", name, (unsigned long)bytes, best * 1e3, mean * 1e3, rate);
+
+  if(results) {
+    fprintf(results, "{\"bench\":\"%s\",\"case\":\"%s\",\"bytes\":%lu,\"runs\":%i,\"best_ms\":%.6f,\"mean_ms\":%.6f,\"mb_per_s\":%.3f}\n",
+      bench, name, (unsigned long)bytes, BENCH_RUNS, best * 1e3, mean * 1e3, rate);
+    fflush(results);
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Times each case is measured, of which the best and the mean are reported
+#define BENCH_RUNS 20
+
+double bench_now(void);
+
+/*
+  Opens the file results are appended to, one JSON object per line, so runs
+  before and after a change can be compared by tools. NULL without a path.
+*/
+FILE *bench_open_results(const char *path);
+
+// Prints the head of the table a bench's cases are printed in
+void bench_header(const char *bench);
+// Records how long processing bytes took, printing it as a row of the table too
+void bench_record(FILE *results, const char *bench, const char *name, size_t bytes, double best, double mean);
+
+#endif
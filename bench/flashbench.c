@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define IMAGE_LEN (64 * 1024)
+// Bytes inserted by the code shift, as if a function grew
+#define SHIFT_AT (16 * 1024)
+#define SHIFT_LEN 64
+
+/*
+  Each scenario flashes its image over what the one before it left on the
+  emulated robot, as a day of rebuilding the same program would.
+*/
+typedef struct {
+  const char *name;
+  uint8_t *image;
+  size_t len;
+  const char *extra;
+} scenario_t;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool writeImage(const char *path, const uint8_t *data, size_t len) {
+  FILE *out = fopen(path, "wb");
+  bool ok;
+
+  if(!out)
+    return false;
+
+  ok = fwrite(data, 1, len, out) == len;
+  return fclose(out) == 0 && ok;
+}
+
+static pid_t spawn(char *const argv[], const char *log) {
+  pid_t pid = fork();
+  int fd;
+
+  if(pid == 0) {
+    fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+
+    execv(argv[0], argv);
+    _exit(127);
+  }
+
+  return pid;
+}
+
+// The emulator appends a line of statistics every time the robot's program is restarted
+static bool readStats(const char *path, int line, unsigned long *rx, unsigned long *tx) {
+  char buffer[256];
+  FILE *in = fopen(path, "r");
+  bool ok = false;
+  int i;
+
+  if(!in)
+    return false;
+
+  for(i = 0; i <= line && fgets(buffer, sizeof(buffer), in); i++)
+    if(i == line)
+      ok = sscanf(buffer, "{\"wall\":%*f,\"rx\":%lu,\"tx\":%lu", rx, tx) == 2;
+
+  fclose(in);
+  return ok;
+}
+
+// The line may only be written just after the flasher exits
+static bool waitStats(const char *path, int line, unsigned long *rx, unsigned long *tx) {
+  int tries;
+
+  for(tries = 0; tries < 100; tries++) {
+    if(readStats(path, line, rx, tx))
+      return true;
+    usleep(20000);
+  }
+
+  return false;
+}
+
+/*
+  What the emulator dumped once the program was restarted has to be the
+  image, with flash past its end left erased, or a plan which skipped a
+  frame would only show up as a faster flash
+*/
+static bool checkFlash(const char *path, const uint8_t *image, size_t len, size_t *at) {
+  uint8_t buffer[4096];
+  FILE *in = fopen(path, "rb");
+  size_t got, i;
+  bool ok = true;
+
+  *at = 0;
+  if(!in)
+    return false;
+
+  while(ok && (got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    for(i = 0; i < got; i++, ++*at) {
+      if(buffer[i] != (*at < len ? image[*at] : 0xff)) {
+        ok = false;
+        break;
+      }
+    }
+  }
+
+  fclose(in);
+
+  // A dump shorter than the image is missing some of it
+  return ok && *at >= len;
+}
+
+int main(int argc, char *argv[]) {
+  const char *flasher = argc > 1 ? argv[1] : "./cortexflash";
+  const char *emulator = argc > 2 ? argv[2] : "./emu/cortexemu";
+  const char *root = argc > 3 ? argv[3] : "/tmp";
+  char dir[512], tty[1024], stats[1024], dump[1024], cache[1024], path[1024], log[1024];
+  uint8_t *base, *edited, *shifted;
+  scenario_t scenarios[4];
+  pid_t emu, flash;
+  struct stat info;
+  double start, wall;
+  unsigned long rx, tx;
+  size_t i, at;
+  int status, tries, failed = 0;
+
+  base = malloc(IMAGE_LEN);
+  edited = malloc(IMAGE_LEN);
+  shifted = malloc(IMAGE_LEN + SHIFT_LEN);
+  if(!base || !edited || !shifted)
+    return 1;
+
+  srand(IMAGE_LEN);
+  for(i = 0; i < IMAGE_LEN; i++)
+    base[i] = rand();
+
+  // A constant changed in the middle of the program
+  memcpy(edited, base, IMAGE_LEN);
+  edited[IMAGE_LEN / 2] ^= 0x5a;
+
+  // Code inserted early on, moving everything after it
+  memcpy(shifted, edited, SHIFT_AT);
+  for(i = 0; i < SHIFT_LEN; i++)
+    shifted[SHIFT_AT + i] = rand();
+  memcpy(shifted + SHIFT_AT + SHIFT_LEN, edited + SHIFT_AT, IMAGE_LEN - SHIFT_AT);
+
+  scenarios[0] = (scenario_t){"full", base, IMAGE_LEN, "-f"};
+  scenarios[1] = (scenario_t){"edit", edited, IMAGE_LEN, NULL};
+  scenarios[2] = (scenario_t){"shift", shifted, IMAGE_LEN + SHIFT_LEN, NULL};
+  scenarios[3] = (scenario_t){"unchanged", shifted, IMAGE_LEN + SHIFT_LEN, NULL};
+
+  // A directory of its own, so nothing cached by an earlier run makes the first flash anything but a full one
+  snprintf(dir, sizeof(dir), "%s/flashbench-XXXXXX", root);
+  if(!mkdtemp(dir)) {
+    fprintf(stderr, "Couldn't make a directory in %s\n", root);
+    return 1;
+  }
+
+  snprintf(tty, sizeof(tty), "%s/tty", dir);
+  snprintf(stats, sizeof(stats), "%s/stats.jsonl", dir);
+  snprintf(dump, sizeof(dump), "%s/flash.bin", dir);
+  snprintf(cache, sizeof(cache), "%s/cache", dir);
+
+  snprintf(log, sizeof(log), "%s/cortexemu.log", dir);
+  emu = spawn((char *[]){(char *)emulator, "-l", tty, "-s", stats, "-d", dump, NULL}, log);
+  if(emu < 0)
+    return 1;
+
+  for(tries = 0; tries < 100 && lstat(tty, &info) != 0; tries++)
+    usleep(20000);
+
+  if(tries == 100) {
+    fprintf(stderr, "The emulator didn't open %s\n", tty);
+    kill(emu, SIGTERM);
+    return 1;
+  }
+
+  printf("Flashing an emulated Cortex, logs in %s\n", dir);
+  printf("%-10s %-8s %-10s %-10s %s\n", "scenario", "image", "wall (s)", "wire rx", "wire tx");
+
+  for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, scenarios[i].name);
+    snprintf(log, sizeof(log), "%s/%s.log", dir, scenarios[i].name);
+
+    if(!writeImage(path, scenarios[i].image, scenarios[i].len)) {
+      fprintf(stderr, "Couldn't write %s\n", path);
+      failed = 1;
+      break;
+    }
+
+    start = now();
+    if(scenarios[i].extra)
+      flash = spawn((char *[]){(char *)flasher, "--cache-dir", cache, (char *)scenarios[i].extra, path, tty, NULL}, log);
+    else
+      flash = spawn((char *[]){(char *)flasher, "--cache-dir", cache, path, tty, NULL}, log);
+
+    if(flash < 0 || waitpid(flash, &status, 0) != flash || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Flashing %s failed, see %s\n", scenarios[i].name, log);
+      failed = 1;
+      break;
+    }
+    wall = now() - start;
+
+    if(!waitStats(stats, i, &rx, &tx)) {
+      fprintf(stderr, "No statistics for %s in %s\n", scenarios[i].name, stats);
+      failed = 1;
+      break;
+    }
+
+    if(!checkFlash(dump, scenarios[i].image, scenarios[i].len, &at)) {
+      fprintf(stderr, "Flash doesn't hold the %s image after flashing it, first difference %lu bytes in, see %s\n", scenarios[i].name,
+        (unsigned long)at, log);
+      failed = 1;
+      break;
+    }
+
+    printf("%-10s %-8lu %-10.3f %-10lu %lu\n", scenarios[i].name, (unsigned long)scenarios[i].len, wall, rx, tx);
+    fflush(stdout);
+  }
+
+  kill(emu, SIGTERM);
+  waitpid(emu, &status, 0);
+
+  free(base);
+  free(edited);
+  free(shifted);
+  return failed;
+}
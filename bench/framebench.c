@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../stm32.h"
+
+#define IMAGE_LEN (128 * 1024)
+
+// The most the bootloader takes in a frame, fewer, and a length padded to a whole word as the last of a run often is
+static const unsigned int frameLens[] = {256, 64, 254};
+
+int main(int argc, char *argv[]) {
+  FILE *results = bench_open_results(argc > 1 ? argv[1] : NULL);
+  stm32_frame_t frame;
+  uint8_t *image;
+  size_t i, offset, len, stride;
+  unsigned int check = 0;
+  char name[32];
+  double start, best, total;
+  int run;
+
+  image = malloc(IMAGE_LEN);
+  if(!image)
+    return 1;
+
+  srand(IMAGE_LEN);
+  for(i = 0; i < IMAGE_LEN; i++)
+    image[i] = rand();
+
+  // Copying each frame's data in and working out its checksum, as stm32_write_memory does before sending it
+  bench_header("prepare_write");
+
+  for(i = 0; i < sizeof(frameLens) / sizeof(frameLens[0]); i++) {
+    // Frames have to start on a word
+    stride = (frameLens[i] + 3) & ~3;
+    best = 1e9;
+    total = 0;
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+      start = bench_now();
+      for(offset = 0; offset < IMAGE_LEN; offset += stride) {
+        len = IMAGE_LEN - offset < frameLens[i] ? IMAGE_LEN - offset : frameLens[i];
+        stm32_prepare_write(&frame, 0x08000000 + offset, image + offset, len);
+        check += frame.body[frame.body_len - 1];
+      }
+      start = bench_now() - start;
+
+      best = start < best ? start : best;
+      total += start;
+    }
+
+    snprintf(name, sizeof(name), "%u byte frames", frameLens[i]);
+    bench_record(results, "prepare_write", name, IMAGE_LEN, best, total / BENCH_RUNS);
+  }
+
+  // Keeps the checksums from being optimised away
+  if(check == 1)
+    printf("\n");
+
+  free(image);
+
+  if(results)
+    fclose(results);
+
+  return 0;
+}
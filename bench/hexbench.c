@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../parser.h"
+
+static const size_t sizes[] = {16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+
+// Writes an Intel HEX file the way objcopy does: 16 byte records, a new block every 64K
+static size_t writeHex(const char *path, size_t len) {
+  FILE *out = fopen(path, "w");
+  size_t offset, i, written = 0;
+  unsigned int count, checksum;
+  uint8_t byte;
+
+  if(!out)
+    return 0;
+
+  srand(len);
+
+  for(offset = 0; offset < len; offset += count) {
+    if(offset % 0x10000 == 0) {
+      checksum = 2 + 4 + 0x08 + (offset >> 16);
+      written += fprintf(out, ":02000004%04X%02X\n", 0x0800 + (unsigned int)(offset >> 16), (-checksum) & 0xff);
+    }
+
+    count = len - offset < 16 ? len - offset : 16;
+    checksum = count + ((offset >> 8) & 0xff) + (offset & 0xff);
+    written += fprintf(out, ":%02X%04X00", count, (unsigned int)(offset & 0xffff));
+
+    for(i = 0; i < count; i++) {
+      byte = rand();
+      checksum += byte;
+      written += fprintf(out, "%02X", byte);
+    }
+
+    written += fprintf(out, "%02X\n", (-checksum) & 0xff);
+  }
+
+  written += fprintf(out, ":00000001FF\n");
+  fclose(out);
+
+  return written;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *results = bench_open_results(argc > 1 ? argv[1] : NULL);
+  const char *dir = argc > 2 ? argv[2] : "/tmp";
+  char path[1024], name[32];
+  parserPackage_t package;
+  size_t i, fileLen, imageLen;
+  const uint8_t *image;
+  double start, best, total;
+  int run;
+
+  bench_header("hex_open");
+
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    snprintf(path, sizeof(path), "%s/hexbench-%lu.hex", dir, (unsigned long)sizes[i]);
+    fileLen = writeHex(path, sizes[i]);
+    if(!fileLen) {
+      fprintf(stderr, "Couldn't write %s\n", path);
+      return 1;
+    }
+
+    best = 1e9;
+    total = 0;
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+      package = initParser(kStorageType_hex, path, NULL);
+
+      start = bench_now();
+      if(package.parser->open(package.storage, path) != kParserError_none) {
+        fprintf(stderr, "Couldn't parse %s\n", path);
+        return 1;
+      }
+      start = bench_now() - start;
+
+      package.parser->view(package.storage, &image, &imageLen);
+      if(imageLen != sizes[i]) {
+        fprintf(stderr, "Parsed %lu bytes out of %s, expected %lu\n", (unsigned long)imageLen, path, (unsigned long)sizes[i]);
+        return 1;
+      }
+      package.parser->close(package.storage);
+
+      best = start < best ? start : best;
+      total += start;
+    }
+
+    // Throughput is of the file read, which is what grows the parsing
+    snprintf(name, sizeof(name), "%luK image", (unsigned long)sizes[i] / 1024);
+    bench_record(results, "hex_open", name, fileLen, best, total / BENCH_RUNS);
+    remove(path);
+  }
+
+  if(results)
+    fclose(results);
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../diff.h"
+#include "../plan.h"
+
+#define IMAGE_LEN (128 * 1024)
+// New code linked onto the end of the program
+#define APPEND_LEN (4 * 1024)
+// Code inserted a quarter of the way in, moving everything after it
+#define SHIFT_LEN 64
+// Words changed across the program, as tuning a few constants would
+#define CONSTANTS 16
+
+// How the image being flashed differs from the one on the robot
+typedef struct {
+  const char *name;
+  uint8_t *target;
+  size_t len;
+} pattern_t;
+
+static uint8_t *copyOf(const uint8_t *data, size_t len, size_t allocate) {
+  uint8_t *copy = malloc(allocate);
+
+  if(copy)
+    memcpy(copy, data, len);
+
+  return copy;
+}
+
+static void fill(uint8_t *data, size_t len) {
+  size_t i;
+
+  for(i = 0; i < len; i++)
+    data[i] = rand();
+}
+
+int main(int argc, char *argv[]) {
+  FILE *results = bench_open_results(argc > 1 ? argv[1] : NULL);
+  const stm32_dev_t *dev = stm32_get_device(0x414);
+  pattern_t patterns[5];
+  uint8_t *baseline;
+  flashPlan_t plan;
+  size_t i, count = sizeof(patterns) / sizeof(patterns[0]), first, last;
+  double start, best, total;
+  int run;
+
+  baseline = malloc(IMAGE_LEN);
+  if(!baseline)
+    return 1;
+
+  srand(IMAGE_LEN);
+  fill(baseline, IMAGE_LEN);
+
+  patterns[0] = (pattern_t){"unchanged", copyOf(baseline, IMAGE_LEN, IMAGE_LEN), IMAGE_LEN};
+
+  patterns[1] = (pattern_t){"single byte", copyOf(baseline, IMAGE_LEN, IMAGE_LEN), IMAGE_LEN};
+  patterns[1].target[IMAGE_LEN / 2] ^= 0x5a;
+
+  patterns[2] = (pattern_t){"appended code", copyOf(baseline, IMAGE_LEN, IMAGE_LEN + APPEND_LEN), IMAGE_LEN + APPEND_LEN};
+  fill(patterns[2].target + IMAGE_LEN, APPEND_LEN);
+
+  patterns[3] = (pattern_t){"shifted code", copyOf(baseline, IMAGE_LEN / 4, IMAGE_LEN + SHIFT_LEN), IMAGE_LEN + SHIFT_LEN};
+  fill(patterns[3].target + IMAGE_LEN / 4, SHIFT_LEN);
+  memcpy(patterns[3].target + IMAGE_LEN / 4 + SHIFT_LEN, baseline + IMAGE_LEN / 4, IMAGE_LEN - IMAGE_LEN / 4);
+
+  patterns[4] = (pattern_t){"changed constants", copyOf(baseline, IMAGE_LEN, IMAGE_LEN), IMAGE_LEN};
+  for(i = 0; i < CONSTANTS; i++)
+    fill(patterns[4].target + (i * IMAGE_LEN / CONSTANTS + 100) / 4 * 4, 4);
+
+  // The comparison every page of a plan goes through, on pages which don't differ
+  bench_header("diff_range");
+  best = 1e9;
+  total = 0;
+
+  for(run = 0; run < BENCH_RUNS; run++) {
+    start = bench_now();
+    if(diff_range(baseline, patterns[0].target, IMAGE_LEN, &first, &last))
+      return 1;
+    start = bench_now() - start;
+
+    best = start < best ? start : best;
+    total += start;
+  }
+
+  bench_record(results, "diff_range", diff_kernel(), IMAGE_LEN, best, total / BENCH_RUNS);
+
+  bench_header("plan_build");
+
+  for(i = 0; i < count; i++) {
+    if(!patterns[i].target)
+      return 1;
+
+    best = 1e9;
+    total = 0;
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+      start = bench_now();
+      if(!plan_build(&plan, dev, patterns[i].target, patterns[i].len, baseline, IMAGE_LEN)) {
+        fprintf(stderr, "Couldn't plan %s\n", patterns[i].name);
+        return 1;
+      }
+      start = bench_now() - start;
+
+      if(run < BENCH_RUNS - 1)
+        plan_free(&plan);
+
+      best = start < best ? start : best;
+      total += start;
+    }
+
+    bench_record(results, "plan_build", patterns[i].name, patterns[i].len, best, total / BENCH_RUNS);
+    printf("%-16s %-18s %lu pages erased, %lu frames of %lu bytes\n", "", "", (unsigned long)plan.eraseCount,
+      (unsigned long)plan.stats.frames, (unsigned long)plan.stats.bytes);
+
+    plan_free(&plan);
+    free(patterns[i].target);
+  }
+
+  free(baseline);
+
+  if(results)
+    fclose(results);
+
+  return 0;
+}
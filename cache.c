@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+#define LAST_DEVICE_FILE "last"
+#define TEMP_IMAGE_FILE "image.tmp"
+
+static bool makeDir(const char *path) {
+#ifdef __WIN32__
+  if(mkdir(path) == 0 || errno == EEXIST)
+#else
+  if(mkdir(path, 0777) == 0 || errno == EEXIST)
+#endif
+    return true;
+
+  return false;
+}
+
+// Creates path along with any missing parents
+static bool makeDirs(const char *path) {
+  char buffer[CACHE_PATH_MAX];
+  size_t i;
+
+  if(strlen(path) >= sizeof(buffer))
+    return false;
+  strcpy(buffer, path);
+
+  for(i = 1; buffer[i]; i++) {
+    if(buffer[i] != '/' && buffer[i] != '\\')
+      continue;
+
+    buffer[i] = 0;
+    if(buffer[i - 1] != ':' && !makeDir(buffer))
+      return false;
+    buffer[i] = '/';
+  }
+
+  return makeDir(buffer);
+}
+
+static bool imagePath(const cacheStore_t *store, unsigned int index, char *path, size_t len) {
+  return snprintf(path, len, "%s/image%u.bin", store->dir, index) < len;
+}
+
+static bool writeFile(const char *path, const void *data, size_t len) {
+  FILE *out = fopen(path, "wb");
+  bool ok;
+
+  if(!out)
+    return false;
+
+  ok = fwrite(data, 1, len, out) == len;
+  return fclose(out) == 0 && ok;
+}
+
+static bool readFile(const char *path, uint8_t **data, size_t *len) {
+  FILE *in = fopen(path, "rb");
+  long size;
+
+  *data = NULL;
+  *len = 0;
+
+  if(!in)
+    return false;
+
+  if(fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) != 0)
+    goto eFail;
+
+  // An empty image still needs a buffer to tell it apart from no image
+  *data = malloc(size ? size : 1);
+  if(!*data || fread(*data, 1, size, in) != size)
+    goto eFail;
+
+  fclose(in);
+  *len = size;
+  return true;
+
+eFail:
+  fclose(in);
+  free(*data);
+  *data = NULL;
+  return false;
+}
+
+bool cache_default_root(char *root, size_t len) {
+  const char *base;
+
+#ifdef __WIN32__
+  if((base = getenv("LOCALAPPDATA")))
+    return snprintf(root, len, "%s/cortexflash", base) < len;
+#else
+  if((base = getenv("XDG_CACHE_HOME")) && base[0])
+    return snprintf(root, len, "%s/cortexflash", base) < len;
+
+  if((base = getenv("HOME")))
+    return snprintf(root, len, "%s/.cache/cortexflash", base) < len;
+#endif
+
+  // Without a home directory keep the cache next to the working directory
+  return snprintf(root, len, "cortexflash.cache") < len;
+}
+
+bool cache_root_file(const char *root, const char *name, char *path, size_t len) {
+  return snprintf(path, len, "%s/%s", root, name) < len;
+}
+
+static bool openStore(cacheStore_t *store, const char *root, const char *uid) {
+  memset(store, 0, sizeof(cacheStore_t));
+
+  if(strlen(uid) != sizeof(store->uid) - 1 || strspn(uid, "0123456789abcdef") != sizeof(store->uid) - 1)
+    return false;
+
+  if(snprintf(store->root, sizeof(store->root), "%s", root) >= sizeof(store->root) ||
+     snprintf(store->dir, sizeof(store->dir), "%s/%s", root, uid) >= sizeof(store->dir))
+    return false;
+
+  strcpy(store->uid, uid);
+  return true;
+}
+
+bool cache_open(cacheStore_t *store, const char *root, const uint8_t uid[STM32_UID_LEN]) {
+  char name[STM32_UID_LEN * 2 + 1], path[CACHE_PATH_MAX];
+  int i;
+
+  for(i = 0; i < STM32_UID_LEN; i++)
+    sprintf(name + i * 2, "%02x", uid[i]);
+
+  if(!openStore(store, root, name) || !makeDirs(store->dir))
+    return false;
+
+  // Not being able to remember the device only costs dry runs their baseline
+  if(cache_root_file(root, LAST_DEVICE_FILE, path, sizeof(path)))
+    writeFile(path, store->uid, strlen(store->uid));
+
+  return true;
+}
+
+bool cache_open_last(cacheStore_t *store, const char *root) {
+  char path[CACHE_PATH_MAX], uid[STM32_UID_LEN * 2 + 1] = {0};
+  FILE *in;
+  size_t read;
+
+  if(!cache_root_file(root, LAST_DEVICE_FILE, path, sizeof(path)) || !(in = fopen(path, "rb")))
+    return false;
+
+  read = fread(uid, 1, sizeof(uid) - 1, in);
+  fclose(in);
+  uid[read] = 0;
+
+  return openStore(store, root, uid);
+}
+
+bool cache_load(const cacheStore_t *store, unsigned int index, uint8_t **data, size_t *len) {
+  char path[CACHE_PATH_MAX];
+
+  *data = NULL;
+  *len = 0;
+
+  if(index >= CACHE_HISTORY || !imagePath(store, index, path, sizeof(path)))
+    return false;
+
+  return readFile(path, data, len);
+}
+
+bool cache_save(const cacheStore_t *store, const uint8_t *data, size_t len) {
+  char from[CACHE_PATH_MAX], to[CACHE_PATH_MAX], temp[CACHE_PATH_MAX];
+  uint8_t *kept;
+  size_t keptLen;
+  unsigned int i, found = CACHE_HISTORY;
+
+  if(snprintf(temp, sizeof(temp), "%s/%s", store->dir, TEMP_IMAGE_FILE) >= sizeof(temp))
+    return false;
+
+  // Flashing a kept image again (a rollback) moves it rather than duplicating it
+  for(i = 0; i < CACHE_HISTORY && found == CACHE_HISTORY; i++) {
+    if(!cache_load(store, i, &kept, &keptLen))
+      continue;
+
+    if(keptLen == len && memcmp(kept, data, len) == 0)
+      found = i;
+    free(kept);
+  }
+
+  if(found == 0)
+    return true;
+
+  // Stage the new front image first so a failure leaves the history as it was
+  if(found < CACHE_HISTORY) {
+    if(!imagePath(store, found, from, sizeof(from)) || rename(from, temp) != 0)
+      return false;
+  } else {
+    if(!writeFile(temp, data, len))
+      return false;
+
+    found = CACHE_HISTORY - 1;
+    if(imagePath(store, found, from, sizeof(from)))
+      remove(from);
+  }
+
+  for(i = found; i > 0; i--) {
+    if(!imagePath(store, i - 1, from, sizeof(from)) || !imagePath(store, i, to, sizeof(to)))
+      return false;
+
+    if(rename(from, to) != 0 && errno != ENOENT)
+      return false;
+  }
+
+  return imagePath(store, 0, to, sizeof(to)) && rename(temp, to) == 0;
+}
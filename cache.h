@@ -0,0 +1,38 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+
+#define CACHE_PATH_MAX 1024
+
+// Images kept per device, most recently flashed first
+#define CACHE_HISTORY 4
+
+typedef struct {
+  char root[CACHE_PATH_MAX], dir[CACHE_PATH_MAX];
+  char uid[STM32_UID_LEN * 2 + 1];
+} cacheStore_t;
+
+// The per-user cache directory shared by every device this station flashes
+bool cache_default_root(char *root, size_t len);
+// Path of a station-wide file (such as the calibration) inside root
+bool cache_root_file(const char *root, const char *name, char *path, size_t len);
+
+/*
+  Opens the store of the device with the given unique ID, creating it if
+  needed and remembering it as the most recently connected device
+*/
+bool cache_open(cacheStore_t *store, const char *root, const uint8_t uid[STM32_UID_LEN]);
+// Opens the store of whichever device was connected last
+bool cache_open_last(cacheStore_t *store, const char *root);
+
+// Loads the image flashed index runs ago, 0 being what's on the device now
+bool cache_load(const cacheStore_t *store, unsigned int index, uint8_t **data, size_t *len);
+// Records data as the image now on the device, moving it to the front if it's already kept
+bool cache_save(const cacheStore_t *store, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,66 @@
+#include "chunk.h"
+
+#define WORDS_PER_FRAME (CHUNK_MAX_LEN / CHUNK_ALIGN)
+
+// A word is blank if every byte of it (that exists) is still erased
+static bool blank(const chunkPlanner_t *planner, size_t word) {
+  size_t i = word * CHUNK_ALIGN;
+  size_t end = i + CHUNK_ALIGN > planner->len ? planner->len : i + CHUNK_ALIGN;
+
+  for(; i < end; i++)
+    if(planner->data[i] != 0xff)
+      return false;
+
+  return true;
+}
+
+void chunk_begin(chunkPlanner_t *planner, const uint8_t *data, size_t len, size_t overhead) {
+  planner->data = data;
+  planner->len = len;
+  planner->pos = 0;
+  planner->overhead = overhead;
+}
+
+bool chunk_next(chunkPlanner_t *planner, chunk_t *chunk) {
+  size_t words = (planner->len + CHUNK_ALIGN - 1) / CHUNK_ALIGN;
+  size_t start, end, i, gap;
+
+  // Skip leading blank words
+  for(start = planner->pos; start < words && blank(planner, start); start++);
+  if(start >= words) {
+    planner->pos = words;
+    return false;
+  }
+
+  end = start + 1;
+  i = end;
+
+  while(i < words && i - start < WORDS_PER_FRAME) {
+    if(!blank(planner, i)) {
+      end = ++i;
+      continue;
+    }
+
+    // Measure the gap, and only bridge it if that's cheaper than a new frame
+    for(gap = i; gap < words && blank(planner, gap); gap++);
+    if(gap >= words || (gap - i) * CHUNK_ALIGN > planner->overhead)
+      break;
+
+    i = gap;
+  }
+
+  chunk->offset = start * CHUNK_ALIGN;
+  chunk->len = (end - start) * CHUNK_ALIGN;
+  planner->pos = end;
+
+  return true;
+}
+
+void chunk_count(chunkStats_t *stats, const chunk_t *chunk) {
+  stats->frames++;
+  stats->bytes += chunk->len;
+}
+
+size_t chunk_wire_bytes(const chunkStats_t *stats) {
+  return stats->bytes + stats->frames * CHUNK_FRAME_OVERHEAD;
+}
@@ -0,0 +1,43 @@
+#ifndef _CHUNK_H
+#define _CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest write memory frame the bootloader accepts
+#define CHUNK_MAX_LEN 256
+// Write addresses and lengths must be 32bit aligned
+#define CHUNK_ALIGN 4
+// Bytes on the wire for each write memory frame besides its data: command and
+// complement, ACK, address and checksum, ACK, length, data checksum and ACK
+#define CHUNK_FRAME_OVERHEAD 12
+
+typedef struct {
+  size_t offset;
+  size_t len;
+} chunk_t;
+
+typedef struct {
+  const uint8_t *data;
+  size_t len, pos, overhead;
+} chunkPlanner_t;
+
+typedef struct {
+  size_t frames, bytes;
+} chunkStats_t;
+
+/*
+  Splits data into write frames, treating it as one stream of bytes which have
+  all been erased to 0xff. Runs of 0xff longer than overhead bytes are skipped,
+  shorter ones are sent inside a frame because that is cheaper than starting a
+  new one. Frames never exceed CHUNK_MAX_LEN and start and end on CHUNK_ALIGN
+  boundaries, so the last frame may run up to 3 bytes past len.
+*/
+void chunk_begin(chunkPlanner_t *planner, const uint8_t *data, size_t len, size_t overhead);
+bool chunk_next(chunkPlanner_t *planner, chunk_t *chunk);
+
+void chunk_count(chunkStats_t *stats, const chunk_t *chunk);
+size_t chunk_wire_bytes(const chunkStats_t *stats);
+
+#endif
@@ -0,0 +1,1330 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+..Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+/*
+  Also based on jpearman's cortexflash project at
+  https://github.com/jpearman/stm32flashCortex
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "cortexflash.h"
+#include "serial.h"
+#include "stm32.h"
+#include "plan.h"
+#include "cache.h"
+#include "journal.h"
+#include "flash.h"
+#include "fingerprint.h"
+#include "slot.h"
+#include "stream.h"
+
+// Measured timings of this station for the cost model, kept in the cache directory
+#define CALIBRATION_FILE "calibration"
+
+// Times bad pages are flashed again before giving up
+#define VERIFY_RETRIES 2
+
+struct cortexflash {
+  cortexflashOptions_t options;
+  serial_baud_t baud;
+  char root[CACHE_PATH_MAX], calibration[CACHE_PATH_MAX];
+  planCost_t cost;
+
+  serial_t *serial;
+  stm32_t *stm;
+  bool cached;
+  cacheStore_t store;
+
+  // Images kept for the robot connected last, loaded in case it's the one connected again
+  cacheStore_t lastStore;
+  uint8_t *history[CACHE_HISTORY];
+  size_t historyLen[CACHE_HISTORY], historyCount;
+
+  // The flash being planned or carried out, which is left to finish until it's verified or the robot restarted
+  bool planned, written, calibrated, partial;
+  flashPlan_t plan;
+  const uint8_t *target;
+  size_t targetLen;
+  journal_t journal;
+  bool journaled;
+
+  // What the target was built into, laid over the baseline, and the baseline grown to match
+  uint8_t *image, *baseline;
+  // The slot being flashed, recorded once the image is cached, and whether the slots were all erased
+  unsigned int slotCount, slot;
+  bool fresh;
+
+  char error[512];
+};
+
+typedef struct {
+  cortexflash_t *session;
+  cortexflashProgress_t progress;
+  void *context;
+  size_t done;
+} writeProgress_t;
+
+// Bytes read back so far of a stage which only reads
+typedef struct {
+  cortexflashProgress_t progress;
+  void *context;
+  cortexflashStage_t stage;
+  size_t done, total;
+} readProgress_t;
+
+// Drops the plan and anything left unfinished of it, without caching the image
+static void session_drop(cortexflash_t *session);
+// Caches the image written, once nothing more is going to be done to it
+static void session_finish(cortexflash_t *session);
+
+static void sleepUs(long us) {
+  struct timespec time = {us / 1000000, (us % 1000000) * 1000};
+
+  nanosleep(&time, NULL);
+}
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void session_log(cortexflash_t *session, cortexflashLog_t level, const char *format, ...) {
+  char message[512];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  if(level == kCortexflashLog_error)
+    snprintf(session->error, sizeof(session->error), "%s", message);
+
+  if(session->options.log)
+    session->options.log(session->options.logContext, level, message);
+}
+
+// Passes on why a call into flash.c failed, unless it was only stopped by its progress
+static void logFlashError(cortexflash_t *session, const flashError_t *error) {
+  if(error->text[0])
+    session_log(session, kCortexflashLog_error, "%s", error->text);
+}
+
+static bool onFrameRead(void *context, const planExtent_t *frame) {
+  readProgress_t *read = context;
+
+  read->done += frame->len;
+  return !read->progress || read->progress(read->context, read->stage, read->done, read->total);
+}
+
+static void freeHistory(cortexflash_t *session) {
+  while(session->historyCount > 0) {
+    session->historyCount--;
+    free(session->history[session->historyCount]);
+    session->history[session->historyCount] = NULL;
+  }
+}
+
+// Keeps the image just cached in front of the others, as the cache itself does
+static void remember(cortexflash_t *session) {
+  uint8_t *copy;
+  size_t i;
+
+  if(session->historyCount > 0 && strcmp(session->lastStore.dir, session->store.dir) != 0)
+    freeHistory(session);
+
+  copy = malloc(session->targetLen ? session->targetLen : 1);
+  if(!copy) {
+    freeHistory(session);
+    return;
+  }
+
+  memcpy(copy, session->target, session->targetLen);
+
+  for(i = 0; i < session->historyCount; i++)
+    if(session->historyLen[i] == session->targetLen && memcmp(session->history[i], copy, session->targetLen) == 0)
+      break;
+
+  if(i == session->historyCount && session->historyCount == CACHE_HISTORY)
+    i--;
+  if(i == session->historyCount)
+    session->historyCount++;
+  else
+    free(session->history[i]);
+
+  memmove(&session->history[1], &session->history[0], i * sizeof(session->history[0]));
+  memmove(&session->historyLen[1], &session->historyLen[0], i * sizeof(session->historyLen[0]));
+  session->history[0] = copy;
+  session->historyLen[0] = session->targetLen;
+  session->lastStore = session->store;
+}
+
+void cortexflash_default_options(cortexflashOptions_t *options) {
+  memset(options, 0, sizeof(cortexflashOptions_t));
+  options->baud = 115200;
+}
+
+cortexflash_t *cortexflash_open(const cortexflashOptions_t *options) {
+  cortexflash_t *session = calloc(1, sizeof(cortexflash_t));
+
+  if(!session)
+    return NULL;
+
+  if(options)
+    session->options = *options;
+  else
+    cortexflash_default_options(&session->options);
+
+  session->baud = serial_get_baud(session->options.baud);
+  if(session->baud == SERIAL_BAUD_INVALID) {
+    free(session);
+    return NULL;
+  }
+
+  if(session->options.cacheRoot)
+    snprintf(session->root, sizeof(session->root), "%s", session->options.cacheRoot);
+  else
+    cache_default_root(session->root, sizeof(session->root));
+  session->options.cacheRoot = session->root;
+
+  // Start from the figures measured at this station, if there are any
+  plan_default_cost(&session->cost);
+  cache_root_file(session->root, CALIBRATION_FILE, session->calibration, sizeof(session->calibration));
+  plan_load_cost(&session->cost, session->calibration);
+
+  session->journal.fd = -1;
+
+  return session;
+}
+
+void cortexflash_close(cortexflash_t *session) {
+  if(!session)
+    return;
+
+  sleepUs(20000);
+
+  session_finish(session);
+  session_drop(session);
+  freeHistory(session);
+
+  if(session->stm)
+    stm32_close(session->stm);
+
+  if(session->serial)
+    serial_close(session->serial);
+
+  free(session);
+}
+
+const char *cortexflash_error(const cortexflash_t *session) {
+  return session->error;
+}
+
+bool cortexflash_preload(cortexflash_t *session) {
+  // Whatever was loaded before may have been flashed over since
+  freeHistory(session);
+
+  if(!cache_open_last(&session->lastStore, session->root))
+    return false;
+
+  for(session->historyCount = 0; session->historyCount < CACHE_HISTORY &&
+    cache_load(&session->lastStore, session->historyCount, &session->history[session->historyCount], &session->historyLen[session->historyCount]);
+    session->historyCount++);
+
+  return session->historyCount > 0;
+}
+
+bool cortexflash_last_image(const cortexflash_t *session, const uint8_t **image, size_t *len) {
+  // An interrupted flash has to be finished whatever the image
+  if(session->historyCount == 0 || journal_pending(&session->lastStore))
+    return false;
+
+  *image = session->history[0];
+  *len = session->historyLen[0];
+  return true;
+}
+
+const char *cortexflash_last_uid(const cortexflash_t *session) {
+  return session->historyCount > 0 ? session->lastStore.uid : "";
+}
+
+// Past its end the baseline stands for erased flash
+static bool matchesBaseline(const uint8_t *baseline, size_t baselineLen, const uint8_t *image, size_t start, size_t end) {
+  size_t have = end < baselineLen ? end : baselineLen;
+
+  if(start < have && memcmp(image + start, baseline + start, have - start) != 0)
+    return false;
+
+  for(start = start > have ? start : have; start < end; start++)
+    if(image[start] != 0xff)
+      return false;
+
+  return true;
+}
+
+/*
+  Builds the image the device ends up holding when only the pages the
+  target's segments differ in are flashed over baseline. Image is left NULL
+  when that's the target's image as it is.
+*/
+static bool overlaySegments(const stm32_dev_t *dev, const uint8_t *baseline, size_t baselineLen, const cortexflashTarget_t *target,
+  uint8_t **image, size_t *imageLen) {
+  const cortexflashSegment_t *segment;
+  size_t pages = (target->len + dev->fl_ps - 1) / dev->fl_ps, i, page, start, end, next, touched = 0;
+  uint8_t *touches, *list;
+  bool ok;
+
+  *image = NULL;
+
+  if(!target->segments)
+    return true;
+
+  touches = calloc(pages + 1, 1);
+  list = malloc(pages + 1);
+  if(!touches || !list) {
+    free(touches);
+    free(list);
+    return false;
+  }
+
+  // Bytes outside the segments are don't care, so a page only needs flashing if a segment differs in it
+  for(i = 0; i < target->segmentCount; i++) {
+    segment = &target->segments[i];
+    end = segment->address + segment->len - dev->fl_start;
+
+    for(start = segment->address - dev->fl_start; start < end; start = next) {
+      page = start / dev->fl_ps;
+      next = (page + 1) * dev->fl_ps < end ? (page + 1) * dev->fl_ps : end;
+
+      if(!touches[page] && !matchesBaseline(baseline, baselineLen, target->image, start, next))
+        touches[page] = 1;
+    }
+  }
+
+  for(page = 0; page < pages; page++)
+    if(touches[page])
+      list[touched++] = page;
+
+  // With every page touched and nothing of the baseline past the image, the image is its own overlay
+  ok = true;
+  if(touched < pages || baselineLen > target->len)
+    ok = plan_overlay_pages(image, imageLen, dev, baseline, baselineLen, target->image, target->len, list, touched);
+
+  free(touches);
+  free(list);
+  return ok;
+}
+
+bool cortexflash_unchanged(const cortexflash_t *session, const cortexflashTarget_t *target) {
+  // Another thread may be connecting, so this goes by the Cortex's geometry rather than the device's
+  const stm32_dev_t *dev = stm32_get_device(CORTEXFLASH_PID);
+  const uint8_t *last;
+  uint8_t *image;
+  size_t lastLen, imageLen;
+  bool same;
+
+  // What a region or slot leaves on the robot depends on more than the last image
+  if(target->regionLen || target->slotCount || !cortexflash_last_image(session, &last, &lastLen))
+    return false;
+
+  // The image is on the device if flashing it wouldn't change anything the cache holds
+  if(!overlaySegments(dev, last, lastLen, target, &image, &imageLen))
+    return false;
+
+  if(image) {
+    same = imageLen == lastLen && memcmp(last, image, imageLen) == 0;
+    free(image);
+  } else {
+    same = lastLen == target->len && memcmp(last, target->image, target->len) == 0;
+  }
+
+  return same;
+}
+
+// Whether the robot is already in the bootloader, such as when the program button was pushed
+static bool inBootloader(cortexflash_t *session) {
+  uint8_t buf[2] = {0x7f}, rep[16] = {0};
+  int retry;
+
+  sleepUs(100000);
+
+  if(serial_setup(session->serial, session->baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK)
+    return false;
+
+  sleepUs(100000);
+
+  // A port kept open since the last flash can still hold the ACK to GO, which is never read, and would pass for the bootloader's
+  serial_flush(session->serial);
+
+  for(retry = 0; retry < 5; retry++) {
+    serial_write(session->serial, buf, 1);
+    if(serial_read(session->serial, rep, 1) == SERIAL_ERR_OK) {
+      if(rep[0] == 0x79)
+        return true;
+
+      // Already initialized, which a get status command confirms
+      if(rep[0] == 0x1f) {
+        buf[0] = 0x00;
+        buf[1] = 0xff;
+        serial_write(session->serial, buf, 2);
+        if(serial_read(session->serial, rep, 15) == SERIAL_ERR_OK && rep[0] == 0x79)
+          return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static bool getSystemStatus(cortexflash_t *session) {
+  uint8_t buf[5] = {0xc9, 0x36, 0xb8, 0x47, 0x21};
+  uint8_t rep[16];
+  char hex[64];
+  const char *connection;
+  int i;
+
+  session_log(session, kCortexflashLog_debug, "Send system status request");
+
+  // Stop the cortex from sending any data
+  serial_flush(session->serial);
+
+  if(serial_write(session->serial, buf, 5) != SERIAL_ERR_OK || serial_read(session->serial, rep, 14) != SERIAL_ERR_OK)
+    return false;
+
+  if(!(rep[0] == 0xaa && rep[1] == 0x55 && rep[2] == 0x21 && rep[3] == 0x0a))
+    return false;
+
+  for(i = 0; i < 14; i++)
+    sprintf(hex + i * 3, "%02X ", rep[i]);
+  session_log(session, kCortexflashLog_debug, "Status %s", hex);
+
+  switch(rep[11] & 0x34) {
+    case 0x10:
+    case 0x14:
+      connection = "USB Tether";
+      break;
+
+    case 0x20:
+    case 0x24:
+      connection = "USB Direct Connection";
+      break;
+
+    case 0x00:
+      connection = "WiFi (VEXnet 1.0)";
+      break;
+
+    case 0x04:
+    case 0x34:
+      connection = "WiFi (VEXnet 2.0)";
+      break;
+
+    default:
+      connection = NULL;
+      break;
+  }
+
+  if(connection)
+    session_log(session, kCortexflashLog_detail, "Connection Type  : %s", connection);
+  else
+    session_log(session, kCortexflashLog_detail, "Connection Type  : Unknown (%02X)", rep[11]);
+
+  if((rep[11] & 0x30) != 0x20)
+    session_log(session, kCortexflashLog_detail, "Joystick Firmware: %d.%02d", rep[4], rep[5]);
+  else
+    session_log(session, kCortexflashLog_detail, "Joystick Firmware: NA");
+
+  session_log(session, kCortexflashLog_detail, "Master firmware  : %d.%02d", rep[6], rep[7]);
+  session_log(session, kCortexflashLog_detail, "Joystick battery : %.2fV", (double)rep[8] * 0.059);
+  session_log(session, kCortexflashLog_detail, "Cortex battery   : %.2fV", (double)rep[9] * 0.059);
+  session_log(session, kCortexflashLog_detail, "Backup battery   : %.2fV", (double)rep[10] * 0.059);
+  session_log(session, kCortexflashLog_detail, "");
+
+  return true;
+}
+
+// Asks the VEX master processor to put the user processor into its bootloader
+static bool enterBootloader(cortexflash_t *session, const char *port) {
+  const uint8_t zero[4] = {0, 0, 0, 0};
+  uint8_t start[5] = {0xc9, 0x36, 0xb8, 0x47, 0x25};
+  int i;
+
+  sleepUs(100000);
+
+  if(serial_setup(session->serial, session->baud, SERIAL_BITS_8, SERIAL_PARITY_NONE, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+    session_log(session, kCortexflashLog_error, "Error: Could not configure serial port %s", port);
+    return false;
+  }
+
+  sleepUs(100000);
+
+  // send some zeros, there are bugs in the serial driver
+  serial_write(session->serial, zero, 4);
+
+  sleepUs(100000);
+
+  // Didn't work, so try again
+  if(!getSystemStatus(session)) {
+    sleepUs(100000);
+
+    if(!getSystemStatus(session)) {
+      session_log(session, kCortexflashLog_error, "Error: No VEX system detected");
+      return false;
+    }
+  }
+
+  session_log(session, kCortexflashLog_debug, "Send bootloader start command");
+
+  for(i = 0; i < 5; i++)
+    serial_write(session->serial, start, 5);
+
+  sleepUs(250000);
+
+  return true;
+}
+
+bool cortexflash_connect(cortexflash_t *session, const char *port) {
+  uint8_t uid[STM32_UID_LEN];
+  const stm32_dev_t *dev;
+  bool init;
+
+  // Whatever was flashed before is as done as it's going to get
+  session_finish(session);
+  session_drop(session);
+
+  if(session->stm) {
+    stm32_close(session->stm);
+    session->stm = NULL;
+  }
+  session->cached = false;
+
+  if(!session->serial) {
+    session->serial = serial_open(port);
+    if(!session->serial) {
+      session_log(session, kCortexflashLog_error, "Error: Could not open serial port %s", port);
+      return false;
+    }
+  }
+
+  // Make sure we are in boot load mode
+  init = !inBootloader(session);
+  if(init && !enterBootloader(session, port))
+    return false;
+
+  // Setup serial port for bootloader
+  if(serial_setup(session->serial, session->baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+    session_log(session, kCortexflashLog_error, "Error: Could not configure serial port %s", port);
+    return false;
+  }
+
+  // 100ms delay before comms start
+  sleepUs(100000);
+
+  // RTS needs to be low for user program to be reset - no idea why
+  // May need to do something with the DIR line for the USB, not sure yet
+  serial_set_rts(session->serial, 0);
+
+  // 100ms delay before comms start
+  sleepUs(100000);
+
+  // Initialize the STM32 communications (we may already be in bootload mode)
+  session->stm = stm32_init(session->serial, init);
+  if(!session->stm) {
+    session_log(session, kCortexflashLog_error, "Error: No STM32 device connected on serial port %s", port);
+    return false;
+  }
+
+  dev = session->stm->dev;
+  session_log(session, kCortexflashLog_detail, "Version      : 0x%02x", session->stm->bl_version);
+  session_log(session, kCortexflashLog_detail, "Option 1     : 0x%02x", session->stm->option1);
+  session_log(session, kCortexflashLog_detail, "Option 2     : 0x%02x", session->stm->option2);
+  session_log(session, kCortexflashLog_detail, "Device ID    : 0x%04x (%s)", session->stm->pid, dev->name);
+  session_log(session, kCortexflashLog_detail, "RAM          : %dKiB  (%db reserved by bootloader)", (dev->ram_end - 0x20000000) / 1024, dev->ram_start - 0x20000000);
+  session_log(session, kCortexflashLog_detail, "Flash        : %dKiB (sector size: %dx%d)", (dev->fl_end - dev->fl_start) / 1024, dev->fl_pps, dev->fl_ps);
+  session_log(session, kCortexflashLog_detail, "Option RAM   : %db", dev->opt_end - dev->opt_start);
+  session_log(session, kCortexflashLog_detail, "System RAM   : %dKiB", (dev->mem_end - dev->mem_start) / 1024);
+
+  // Every device keeps its own cache, so a different Cortex never gets diffed against another's image
+  session->cached = stm32_read_uid(session->stm, uid) && cache_open(&session->store, session->root, uid);
+  if(session->cached)
+    session_log(session, kCortexflashLog_detail, "Unique ID    : %s", session->store.uid);
+
+  return true;
+}
+
+bool cortexflash_info(const cortexflash_t *session, cortexflashInfo_t *info) {
+  const stm32_dev_t *dev;
+
+  memset(info, 0, sizeof(cortexflashInfo_t));
+  if(!session->stm)
+    return false;
+
+  dev = session->stm->dev;
+  info->bootloader = session->stm->bl_version;
+  info->option1 = session->stm->option1;
+  info->option2 = session->stm->option2;
+  info->pid = session->stm->pid;
+  info->name = dev->name;
+  info->flashStart = dev->fl_start;
+  info->flashEnd = dev->fl_end;
+  info->ramStart = dev->ram_start;
+  info->ramEnd = dev->ram_end;
+  info->pageSize = dev->fl_ps;
+
+  if(session->cached)
+    snprintf(info->uid, sizeof(info->uid), "%s", session->store.uid);
+
+  return true;
+}
+
+bool cortexflash_baseline(cortexflash_t *session, uint8_t **baseline, size_t *len) {
+  uint8_t *loaded[CACHE_HISTORY] = {NULL};
+  const uint8_t *image[CACHE_HISTORY];
+  size_t imageLen[CACHE_HISTORY], index[CACHE_HISTORY], flashLen, count, candidates = 0, which, i;
+  fingerprint_t fp;
+  bool kept;
+  double start = now();
+
+  *baseline = NULL;
+  *len = 0;
+
+  if(!session->stm || !session->cached)
+    return false;
+
+  flashLen = session->stm->dev->fl_end - session->stm->dev->fl_start;
+
+  // The images are already loaded if this is the device connected last time
+  kept = session->historyCount > 0 && strcmp(session->store.dir, session->lastStore.dir) == 0;
+  if(kept) {
+    for(count = 0; count < session->historyCount; count++)
+      if(session->historyLen[count] <= flashLen) {
+        image[candidates] = session->history[count];
+        imageLen[candidates] = session->historyLen[count];
+        index[candidates++] = count;
+      }
+  } else {
+    for(count = 0; count < CACHE_HISTORY && cache_load(&session->store, count, &loaded[count], &imageLen[candidates]); count++)
+      if(imageLen[candidates] <= flashLen) {
+        image[candidates] = loaded[count];
+        index[candidates++] = count;
+      }
+  }
+
+  // The newest image is normally the one on the device, older ones catch it having been rolled back elsewhere
+  fingerprint_build(&fp, image, imageLen, candidates, flashLen);
+  if(!fingerprint_match(session->stm, &fp, image, imageLen, candidates, &which)) {
+    session_log(session, kCortexflashLog_error, "Could not read back the fingerprint");
+    which = candidates;
+  }
+
+  if(which < candidates) {
+    session_log(session, kCortexflashLog_detail, "Fingerprint  : matches cached image %li (read back in %.0fms)", index[which],
+      (now() - start) * 1000);
+
+    if(kept) {
+      *baseline = malloc(imageLen[which] ? imageLen[which] : 1);
+      if(*baseline)
+        memcpy(*baseline, image[which], imageLen[which]);
+    } else {
+      *baseline = loaded[index[which]];
+      loaded[index[which]] = NULL;
+    }
+
+    *len = imageLen[which];
+  }
+
+  for(i = 0; i < count; i++)
+    free(loaded[i]);
+
+  if(which < candidates)
+    return *baseline != NULL;
+
+  if(count > 0)
+    session_log(session, kCortexflashLog_info, "Device doesn't match any cached image");
+  else
+    session_log(session, kCortexflashLog_info, "No cached image for this device");
+
+  return false;
+}
+
+bool cortexflash_resume(cortexflash_t *session, const uint8_t *image, size_t len, uint8_t **baseline, size_t *baselineLen) {
+  size_t left;
+
+  *baseline = NULL;
+  *baselineLen = 0;
+
+  if(!session->stm || !session->cached || !journal_resume(&session->store, session->stm->dev, image, len, baseline, baselineLen, &left))
+    return false;
+
+  session_log(session, kCortexflashLog_info, "Resuming an interrupted flash, %li pages left", left);
+  return true;
+}
+
+bool cortexflash_read_baseline(cortexflash_t *session, const uint8_t *image, size_t len, cortexflashStrategy_t strategy,
+  uint8_t **baseline, size_t *baselineLen, cortexflashProgress_t progress, void *context) {
+  readProgress_t read = {progress, context, kCortexflashStage_read, 0, 0};
+  flashError_t error = {""};
+  const stm32_dev_t *dev;
+  flashPlan_t full;
+  double fullTime, readTime, start;
+  unsigned int baud = serial_get_baud_int(session->baud);
+  size_t readLen = (len + 3) & ~3;
+
+  *baseline = NULL;
+  *baselineLen = 0;
+
+  if(!session->stm || (strategy != kCortexflashStrategy_auto && strategy != kCortexflashStrategy_readback))
+    return false;
+
+  dev = session->stm->dev;
+  if(readLen == 0 || readLen > dev->fl_end - dev->fl_start)
+    return false;
+
+  readTime = plan_readback_estimate(&session->cost, readLen, baud);
+
+  // Reading back is only worth it if it beats erasing and writing everything
+  if(strategy == kCortexflashStrategy_auto) {
+    if(!plan_build(&full, dev, image, len, NULL, 0))
+      return false;
+
+    fullTime = plan_estimate(&full, &session->cost, baud);
+    plan_free(&full);
+
+    if(readTime >= fullTime) {
+      session_log(session, kCortexflashLog_detail, "Not reading back the device, estimated %.3fs against %.3fs for a full flash", readTime, fullTime);
+      return false;
+    }
+  }
+
+  *baseline = malloc(readLen);
+  if(!*baseline)
+    return false;
+
+  session_log(session, kCortexflashLog_detail, "Reading back 0x%08x-0x%08lx to rebuild the cache, estimated %.3fs", dev->fl_start, dev->fl_start + readLen, readTime);
+
+  read.total = readLen;
+  if(progress && !progress(context, kCortexflashStage_read, 0, readLen)) {
+    free(*baseline);
+    *baseline = NULL;
+    return false;
+  }
+
+  start = now();
+  if(!flash_read(session->stm, dev->fl_start, *baseline, readLen, onFrameRead, &read, &error)) {
+    logFlashError(session, &error);
+    free(*baseline);
+    *baseline = NULL;
+    return false;
+  }
+  readTime = now() - start;
+
+  session_log(session, kCortexflashLog_detail, "Read back %li bytes in %.3fs", readLen, readTime);
+
+  plan_calibrate_readback(&session->cost, readLen, readTime, baud);
+  *baselineLen = readLen;
+
+  return true;
+}
+
+// Pages the segments don't touch keep what the baseline says they hold
+static bool applySegments(cortexflash_t *session, const stm32_dev_t *dev, const cortexflashTarget_t *target, const uint8_t **image, size_t *len,
+  const uint8_t **baseline, size_t *baselineLen) {
+  uint8_t *overlay;
+  size_t overlayLen;
+
+  if(!*baseline || !target->segments)
+    return true;
+
+  if(!overlaySegments(dev, *baseline, *baselineLen, target, &overlay, &overlayLen))
+    return false;
+
+  if(!overlay)
+    return true;
+
+  // Past its end the baseline stands for erased flash, so untouched pages out there compare equal too
+  if(overlayLen > *baselineLen) {
+    session->baseline = malloc(overlayLen);
+    if(!session->baseline) {
+      free(overlay);
+      return false;
+    }
+
+    memcpy(session->baseline, *baseline, *baselineLen);
+    memset(session->baseline + *baselineLen, 0xff, overlayLen - *baselineLen);
+    *baseline = session->baseline;
+    *baselineLen = overlayLen;
+  }
+
+  session->image = overlay;
+  *image = overlay;
+  *len = overlayLen;
+
+  session_log(session, kCortexflashLog_detail, "Segments     : %li, flash outside of their pages is left as cached", target->segmentCount);
+
+  return true;
+}
+
+static bool applyRegion(cortexflash_t *session, const stm32_dev_t *dev, const cortexflashTarget_t *target, const uint8_t **image, size_t *len,
+  const uint8_t **baseline, size_t *baselineLen) {
+  size_t start = target->regionAddress - dev->fl_start, end = start + target->regionLen;
+  size_t first = start / dev->fl_ps, last = (end + dev->fl_ps - 1) / dev->fl_ps;
+  flashError_t error = {""};
+
+  if(target->regionAddress < dev->fl_start || target->regionLen > dev->fl_end - target->regionAddress) {
+    session_log(session, kCortexflashLog_error, "Region 0x%08x-0x%08lx is outside of flash", target->regionAddress, target->regionAddress + target->regionLen);
+    return false;
+  }
+
+  // Without a baseline, the rest of the region's pages is read back so it can be written again as it was
+  if(!*baseline) {
+    *baselineLen = last * dev->fl_ps;
+    session->baseline = malloc(*baselineLen);
+    if(!session->baseline)
+      return false;
+
+    memset(session->baseline, 0xff, *baselineLen);
+    *baseline = session->baseline;
+
+    if(session->stm && !flash_read(session->stm, dev->fl_start + first * dev->fl_ps, session->baseline + first * dev->fl_ps, (last - first) * dev->fl_ps, NULL, NULL,
+      &error)) {
+      logFlashError(session, &error);
+      return false;
+    }
+  }
+
+  if(!plan_overlay(&session->image, len, *baseline, *baselineLen, *image, *len, start, end))
+    return false;
+
+  *image = session->image;
+
+  session_log(session, kCortexflashLog_detail, "Region       : 0x%08x-0x%08lx (pages %li-%li)", target->regionAddress, target->regionAddress + target->regionLen,
+    first, last - 1);
+
+  return true;
+}
+
+static bool applySlot(cortexflash_t *session, const stm32_dev_t *dev, const cortexflashTarget_t *target, const uint8_t **image, size_t *len,
+  const uint8_t *baseline, size_t baselineLen) {
+  // Without a connection the plan is for the robot connected last
+  const cacheStore_t *store = session->stm ? (session->cached ? &session->store : NULL) : (session->historyCount > 0 ? &session->lastStore : NULL);
+  unsigned int slot = target->slot, count = target->slotCount;
+  size_t start, end, used;
+  slotMap_t map;
+  uint32_t hash;
+
+  if(slot >= count) {
+    session_log(session, kCortexflashLog_error, "There are only %u slots", count);
+    return false;
+  }
+
+  slot_range(dev, count, slot, &start, &end);
+
+  memset(&map, 0, sizeof(slotMap_t));
+  if(store && slot_load_map(&map, store) && map.count != count) {
+    session_log(session, kCortexflashLog_info, "Slot layout changed from %u to %u slots, forgetting what the old slots held", map.count, count);
+    memset(&map, 0, sizeof(slotMap_t));
+  }
+
+  if(*image) {
+    if(!slot_check(dev, count, slot, *image, *len)) {
+      session_log(session, kCortexflashLog_error, "Provided file isn't linked for slot %i (0x%08lx-0x%08lx)", slot, dev->fl_start + start, dev->fl_start + end);
+      return false;
+    }
+
+    hash = slot_hash(dev, count, slot, *image, *len, &used);
+  } else {
+    // Switching needs the cache to vouch for what the slot holds
+    if(!baseline || !map.len[slot] || slot_hash(dev, count, slot, baseline, baselineLen, &used) != map.hash[slot]) {
+      session_log(session, kCortexflashLog_error, "What slot %i holds isn't known, flash it with --slot first", slot);
+      return false;
+    }
+
+    hash = map.hash[slot];
+  }
+
+  if(!slot_compose(&session->image, len, dev, count, slot, baseline, baselineLen, *image, *len))
+    return false;
+
+  *image = session->image;
+
+  session_log(session, kCortexflashLog_detail, "Slot         : %i of %u (0x%08lx-0x%08lx)%s", slot, count, dev->fl_start + start, dev->fl_start + end,
+    map.len[slot] && map.hash[slot] == hash ? ", already holds this image" : "");
+
+  return true;
+}
+
+// Records what the slot flashed now holds, once the image is cached
+static void updateSlots(cortexflash_t *session) {
+  slotMap_t map;
+  size_t used;
+
+  // Anything else flashed over the slots leaves them meaningless
+  if(!session->slotCount) {
+    slot_clear_map(&session->store);
+    return;
+  }
+
+  if(!slot_load_map(&map, &session->store) || map.count != session->slotCount || session->fresh) {
+    memset(&map, 0, sizeof(slotMap_t));
+    map.count = session->slotCount;
+  }
+
+  map.active = session->slot;
+  map.hash[session->slot] = slot_hash(session->stm ? session->stm->dev : stm32_get_device(CORTEXFLASH_PID), session->slotCount, session->slot,
+    session->target, session->targetLen, &used);
+  map.len[session->slot] = used;
+
+  if(!slot_save_map(&map, &session->store))
+    session_log(session, kCortexflashLog_info, "Could not save the slot map in %s", session->store.dir);
+}
+
+bool cortexflash_plan(cortexflash_t *session, const cortexflashTarget_t *target) {
+  const stm32_dev_t *dev = session->stm ? session->stm->dev : stm32_get_device(CORTEXFLASH_PID);
+  const uint8_t *image = target->image, *baseline = target->baseline;
+  size_t len = target->len, baselineLen = target->baselineLen;
+  cortexflashStrategy_t strategy = target->strategy;
+  flashPlan_t full, diff;
+  double fullTime, diffTime = 0, start, planTime;
+  unsigned int baud = serial_get_baud_int(session->baud);
+
+  session_finish(session);
+  session_drop(session);
+
+  if(len > dev->fl_end - dev->fl_start) {
+    session_log(session, kCortexflashLog_error, "Provided file is larger than available flash space");
+    return false;
+  }
+
+  if(baseline && baselineLen > dev->fl_end - dev->fl_start) {
+    session_log(session, kCortexflashLog_info, "Cached file is larger than available flash space - defaulting to complete re-flash");
+    baseline = NULL;
+    baselineLen = 0;
+  }
+
+  if(target->regionLen && target->slotCount) {
+    session_log(session, kCortexflashLog_error, "A region can't be flashed into a slot");
+    return false;
+  }
+
+  session->fresh = !baseline;
+  session->slotCount = target->slotCount;
+  session->slot = target->slot;
+
+  // From here on the image being flashed is the segments, region or slot laid over the baseline
+  if(!target->regionLen && !target->slotCount && !applySegments(session, dev, target, &image, &len, &baseline, &baselineLen))
+    goto eFail;
+
+  if(target->regionLen) {
+    // Only the region's pages are known after flashing it without a baseline, and nothing outside it differs from one
+    session->partial = !baseline;
+    strategy = kCortexflashStrategy_diff;
+
+    if(!applyRegion(session, dev, target, &image, &len, &baseline, &baselineLen))
+      goto eFail;
+  }
+
+  if(target->slotCount) {
+    // Nothing outside the boot page and the slot differs from the baseline. Without one, the
+    // whole chip is erased, which leaves every other slot known to be empty.
+    if(baseline)
+      strategy = kCortexflashStrategy_diff;
+
+    if(!applySlot(session, dev, target, &image, &len, baseline, baselineLen))
+      goto eFail;
+  }
+
+  // Plan both ways and keep whichever the cost model says is cheaper
+  start = now();
+
+  if(!plan_build(&full, dev, image, len, NULL, 0)) {
+    session_log(session, kCortexflashLog_error, "Could not build a flash plan");
+    goto eFail;
+  }
+
+  if(baseline && strategy != kCortexflashStrategy_full) {
+    if(!plan_build(&diff, dev, image, len, baseline, baselineLen)) {
+      session_log(session, kCortexflashLog_error, "Could not build a flash plan");
+      plan_free(&full);
+      goto eFail;
+    }
+
+    diffTime = plan_estimate(&diff, &session->cost, baud);
+  }
+
+  planTime = now() - start;
+  fullTime = plan_estimate(&full, &session->cost, baud);
+
+  if(!baseline || strategy == kCortexflashStrategy_full) {
+    session_log(session, kCortexflashLog_detail, "\nStrategy: full flash (%s), estimated %.3fs", baseline ? "forced" : "no cache", fullTime);
+
+    session->plan = full;
+  } else if(strategy != kCortexflashStrategy_diff && fullTime < diffTime) {
+    session_log(session, kCortexflashLog_detail, "\nStrategy: full flash, estimated %.3fs against %.3fs to erase %li pages one by one",
+      fullTime, diffTime, diff.eraseCount);
+
+    plan_free(&diff);
+    session->plan = full;
+  } else {
+    session_log(session, kCortexflashLog_detail, "\nStrategy: differential flash of %li pages (%s), estimated %.3fs against %.3fs for a full flash",
+      diff.eraseCount, strategy == kCortexflashStrategy_diff ? "forced" : "cheapest", diffTime, fullTime);
+
+    plan_free(&full);
+    session->plan = diff;
+  }
+
+  session_log(session, kCortexflashLog_debug, "Planned in %.0fus", planTime * 1000000);
+
+  session->planned = true;
+  session->target = image;
+  session->targetLen = len;
+
+  return true;
+
+eFail:
+  session_drop(session);
+  return false;
+}
+
+bool cortexflash_plan_info(const cortexflash_t *session, cortexflashPlanInfo_t *info) {
+  const flashPlan_t *plan = &session->plan;
+
+  memset(info, 0, sizeof(cortexflashPlanInfo_t));
+  if(!session->planned)
+    return false;
+
+  info->massErase = plan->massErase;
+  info->erasePages = plan->massErase ? (plan->dev->fl_end - plan->dev->fl_start) / plan->dev->fl_ps : plan->eraseCount;
+  info->frames = plan->stats.frames;
+  info->bytes = plan->stats.bytes;
+  info->wireBytes = plan_wire_bytes(plan);
+  info->estimate = plan_estimate(plan, &session->cost, serial_get_baud_int(session->baud));
+  info->journaled = session->journaled;
+
+  return true;
+}
+
+void cortexflash_plan_print(const cortexflash_t *session, FILE *out) {
+  if(session->planned)
+    plan_print(&session->plan, out);
+}
+
+static bool session_journal(cortexflash_t *session, const uint8_t *target, size_t targetLen) {
+  if(!session->cached || session->partial)
+    return false;
+
+  session->journaled = journal_begin(&session->journal, &session->store, &session->plan, target, targetLen);
+  return session->journaled;
+}
+
+static bool onFrameWritten(void *context, const planExtent_t *frame) {
+  writeProgress_t *write = context;
+  cortexflash_t *session = write->session;
+
+  if(session->journaled)
+    journal_written(&session->journal, frame->offset + frame->len);
+
+  write->done += frame->len;
+  if(write->done > session->plan.stats.bytes)
+    write->done = session->plan.stats.bytes;
+
+  return !write->progress || write->progress(write->context, kCortexflashStage_write, write->done, session->plan.stats.bytes);
+}
+
+bool cortexflash_flash(cortexflash_t *session, cortexflashProgress_t progress, void *context) {
+  writeProgress_t write = {session, progress, context, 0};
+  flashError_t error = {""};
+  const flashPlan_t *plan = &session->plan;
+  size_t pages;
+  double eraseTime, writeTime, start;
+
+  if(!session->stm || !session->planned || session->written) {
+    session_log(session, kCortexflashLog_error, "Nothing planned to flash");
+    return false;
+  }
+
+  // Journal every finished page, so a dropped cable or ^C can be resumed from
+  if(session->cached && !session->partial && !session_journal(session, session->target, session->targetLen))
+    session_log(session, kCortexflashLog_info, "Could not start a journal in %s - an interrupted flash will start over", session->store.dir);
+
+  pages = plan->massErase ? (plan->dev->fl_end - plan->dev->fl_start) / plan->dev->fl_ps : plan->eraseCount;
+  if(progress && !progress(context, kCortexflashStage_erase, 0, pages))
+    return false;
+
+  start = now();
+  if(!flash_erase(session->stm, plan, &error)) {
+    logFlashError(session, &error);
+    return false;
+  }
+  eraseTime = now() - start;
+
+  if(session->journaled)
+    journal_erased(&session->journal);
+
+  if(progress && !progress(context, kCortexflashStage_erase, pages, pages))
+    return false;
+
+  start = now();
+  if(!flash_write(session->stm, plan, session->target, session->targetLen, onFrameWritten, &write, &error)) {
+    logFlashError(session, &error);
+    return false;
+  }
+  writeTime = now() - start;
+
+  if(session->journaled)
+    journal_written(&session->journal, session->targetLen);
+
+  session_log(session, kCortexflashLog_info, "Wrote %li bytes in %li frames (%li bytes on the wire) in %.3fs", plan->stats.bytes, plan->stats.frames,
+    plan_wire_bytes(plan), eraseTime + writeTime);
+
+  session_log(session, kCortexflashLog_debug, "Erased in %.3fs, wrote in %.3fs", eraseTime, writeTime);
+
+  // Teach the cost model how long this station really took
+  plan_calibrate(&session->cost, plan, eraseTime, writeTime, serial_get_baud_int(session->baud));
+
+  session->written = session->calibrated = true;
+  return true;
+}
+
+static bool onFrameStreamed(void *context, const planExtent_t *frame) {
+  writeProgress_t *write = context;
+
+  write->done += frame->len;
+  return !write->progress || write->progress(write->context, kCortexflashStage_write, write->done, write->done);
+}
+
+bool cortexflash_stream(cortexflash_t *session, cortexflashProgress_t progress, void *context) {
+  writeProgress_t write = {session, progress, context, 0};
+  flashError_t error = {""};
+  chunkStats_t stats;
+  size_t pages, len;
+  double start, writeTime;
+
+  session_finish(session);
+  session_drop(session);
+
+  if(!session->stm) {
+    session_log(session, kCortexflashLog_error, "Nothing connected to flash");
+    return false;
+  }
+
+  if(!plan_build(&session->plan, session->stm->dev, NULL, 0, NULL, 0)) {
+    session_log(session, kCortexflashLog_error, "Could not build a flash plan");
+    return false;
+  }
+  session->planned = true;
+
+  session_log(session, kCortexflashLog_detail, "\nStrategy: full flash (forced), written as it's piped in");
+
+  // What ends up on the device isn't known until the pipe closes, so the journal only says all of it is unfinished
+  if(session->cached && !session_journal(session, NULL, 0))
+    session_log(session, kCortexflashLog_info, "Could not start a journal in %s - an interrupted flash may not be noticed", session->store.dir);
+
+  pages = (session->stm->dev->fl_end - session->stm->dev->fl_start) / session->stm->dev->fl_ps;
+  if(progress && !progress(context, kCortexflashStage_erase, 0, pages))
+    return false;
+
+  start = now();
+  if(!flash_erase(session->stm, &session->plan, &error)) {
+    logFlashError(session, &error);
+    return false;
+  }
+
+  if(progress && !progress(context, kCortexflashStage_erase, pages, pages))
+    return false;
+
+  if(!stream_flash(session->stm, &session->image, &len, &stats, onFrameStreamed, &write, &error)) {
+    logFlashError(session, &error);
+    return false;
+  }
+  writeTime = now() - start;
+
+  // Waiting on the pipe is part of the time, so it's no use for calibrating
+  session_log(session, kCortexflashLog_info, "Wrote %li bytes in %li frames (%li bytes on the wire) in %.3fs", stats.bytes, stats.frames,
+    chunk_wire_bytes(&stats), writeTime);
+
+  // From here it's like any other flash of the image, which is cached once it's verified
+  session->target = session->image;
+  session->targetLen = len;
+  session->fresh = true;
+  session->written = true;
+
+  return true;
+}
+
+bool cortexflash_verify(cortexflash_t *session, cortexflashProgress_t progress, void *context) {
+  readProgress_t read = {progress, context, kCortexflashStage_verify, 0, 0};
+  flashError_t error = {""};
+  const stm32_dev_t *dev;
+  size_t pages, badCount, verified, total = 0, i, at;
+  uint8_t *bad;
+  char list[1024];
+  flashPlan_t repair;
+  const flashPlan_t *check = &session->plan;
+  double start;
+  int retry;
+  bool ok = false;
+
+  if(!session->stm || !session->written) {
+    session_log(session, kCortexflashLog_error, "Nothing flashed to verify");
+    return false;
+  }
+
+  dev = session->stm->dev;
+  pages = (dev->fl_end - dev->fl_start) / dev->fl_ps;
+
+  bad = malloc(pages);
+  if(!bad)
+    goto eDone;
+
+  start = now();
+
+  // Only what this run erased and wrote is read back, and only bad pages are flashed again
+  for(retry = 0; retry <= VERIFY_RETRIES; retry++) {
+    read.done = 0;
+    read.total = (check->massErase ? (session->targetLen + dev->fl_ps - 1) / dev->fl_ps : check->eraseCount) * dev->fl_ps;
+    if(progress && !progress(context, kCortexflashStage_verify, 0, read.total))
+      goto eDone;
+
+    if(!flash_verify(session->stm, check, session->target, session->targetLen, bad, &badCount, &verified, onFrameRead, &read, &error)) {
+      logFlashError(session, &error);
+      goto eDone;
+    }
+
+    total += verified;
+
+    if(badCount == 0) {
+      ok = !progress || progress(context, kCortexflashStage_verify, verified, verified);
+      goto eDone;
+    }
+
+    for(i = 0, at = 0; i < badCount && at < sizeof(list); i++)
+      at += snprintf(list + at, sizeof(list) - at, "%s%i", i == 0 ? "" : ", ", bad[i]);
+    session_log(session, kCortexflashLog_info, "Verify: %li pages differ (%s)%s", badCount, list, retry < VERIFY_RETRIES ? " - flashing them again" : "");
+
+    // Until they're fixed, the next run has to flash them again
+    if(session->journaled)
+      journal_dirty(&session->journal, bad, badCount);
+
+    if(retry == VERIFY_RETRIES)
+      goto eDone;
+
+    // The last repair is done with once its pages have been read back
+    if(check == &repair)
+      plan_free(&repair);
+    check = &session->plan;
+
+    if(!plan_build_pages(&repair, dev, session->target, session->targetLen, bad, badCount))
+      goto eDone;
+    check = &repair;
+
+    if(!flash_erase(session->stm, &repair, &error) || !flash_write(session->stm, &repair, session->target, session->targetLen, NULL, NULL, &error)) {
+      logFlashError(session, &error);
+      goto eDone;
+    }
+  }
+
+eDone:
+  if(check == &repair)
+    plan_free(&repair);
+  free(bad);
+
+  if(!ok) {
+    session_log(session, kCortexflashLog_error, "Verify failed");
+    session_drop(session);
+    return false;
+  }
+
+  session_log(session, kCortexflashLog_detail, "Verified %li bytes in %.3fs", total, now() - start);
+
+  session_finish(session);
+  return true;
+}
+
+bool cortexflash_go(cortexflash_t *session) {
+  bool ok;
+
+  session_finish(session);
+  session_drop(session);
+
+  if(!session->stm)
+    return false;
+
+  session_log(session, kCortexflashLog_detail, "\nStarting execution at address 0x%08x... ", session->stm->dev->fl_start);
+
+  ok = stm32_go(session->stm, session->stm->dev->fl_start);
+  session_log(session, kCortexflashLog_detail, ok ? "done." : "failed.");
+
+  // The bootloader is gone, so the next flash has to connect again
+  stm32_close(session->stm);
+  session->stm = NULL;
+
+  return ok;
+}
+
+static void session_drop(cortexflash_t *session) {
+  if(session->journaled) {
+    journal_end(&session->journal, &session->store, false);
+    session->journaled = false;
+  }
+
+  if(session->planned)
+    plan_free(&session->plan);
+
+  free(session->image);
+  free(session->baseline);
+  session->image = session->baseline = NULL;
+
+  session->planned = session->written = session->calibrated = session->partial = false;
+  session->slotCount = 0;
+  session->target = NULL;
+  session->targetLen = 0;
+}
+
+static void session_finish(cortexflash_t *session) {
+  if(!session->written)
+    return;
+
+  if(session->calibrated && !plan_save_cost(&session->cost, session->calibration))
+    session_log(session, kCortexflashLog_info, "Could not save calibration to %s", session->calibration);
+
+  // Only the region's pages are known after flashing it without a cache
+  if(session->cached && !session->partial) {
+    if(cache_save(&session->store, session->target, session->targetLen))
+      remember(session);
+    else
+      session_log(session, kCortexflashLog_info, "Could not cache the flashed image in %s", session->store.dir);
+  }
+
+  if(session->cached)
+    updateSlots(session);
+
+  if(session->journaled) {
+    journal_end(&session->journal, &session->store, true);
+    session->journaled = false;
+  }
+
+  session->written = false;
+  session_drop(session);
+}
@@ -0,0 +1,166 @@
+#ifndef _CORTEXFLASH_H
+#define _CORTEXFLASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+  libcortexflash: flashing a VEX Cortex through a session which keeps
+  everything it knows about the robot, so nothing is shared between
+  sessions and each can be used from its own thread. A session stays open
+  across flashes, keeping its port, its calibration and the image on the
+  robot in memory, so the next flash only has to go through the bootloader
+  handshake again.
+
+  A flash goes connect, baseline (or resume, or read_baseline), plan, flash,
+  verify and go. Images always start at the beginning of flash.
+*/
+typedef struct cortexflash cortexflash_t;
+
+// Device ID of the VEX Cortex, which plans are made for without a connection
+#define CORTEXFLASH_PID 0x414
+
+typedef enum {
+  kCortexflashLog_error,
+  // What's always worth knowing, such as a flash falling back to a full one
+  kCortexflashLog_info,
+  kCortexflashLog_detail,
+  // Each step of the handshake and how long the stages took
+  kCortexflashLog_debug,
+} cortexflashLog_t;
+
+typedef enum {
+  kCortexflashStrategy_auto,
+  kCortexflashStrategy_full,
+  kCortexflashStrategy_diff,
+  kCortexflashStrategy_readback,
+} cortexflashStrategy_t;
+
+typedef enum {
+  kCortexflashStage_erase,
+  kCortexflashStage_write,
+  kCortexflashStage_verify,
+  // Reading the robot back for a baseline
+  kCortexflashStage_read,
+} cortexflashStage_t;
+
+typedef void (*cortexflashLogger_t)(void *context, cortexflashLog_t level, const char *message);
+// Called as a stage gets through done of total bytes (pages when erasing), returning false stops the flash
+typedef bool (*cortexflashProgress_t)(void *context, cortexflashStage_t stage, size_t done, size_t total);
+
+typedef struct {
+  // Baud rate of the bootloader, such as 115200
+  unsigned int baud;
+  // Where each robot's images and this station's calibration are kept, NULL for the per-user default
+  const char *cacheRoot;
+  cortexflashLogger_t log;
+  void *logContext;
+} cortexflashOptions_t;
+
+typedef struct {
+  uint8_t bootloader, option1, option2;
+  uint16_t pid;
+  const char *name;
+  uint32_t flashStart, flashEnd, ramStart, ramEnd;
+  unsigned int pageSize;
+  // Empty if the robot's unique ID couldn't be read, in which case nothing is cached
+  char uid[25];
+} cortexflashInfo_t;
+
+// A run of the image which the file being flashed gives, at an absolute address
+typedef struct {
+  uint32_t address;
+  size_t len;
+} cortexflashSegment_t;
+
+// What's flashed and what the robot holds beforehand
+typedef struct {
+  const uint8_t *image;
+  size_t len;
+  // NULL if it isn't known, which means a full flash
+  const uint8_t *baseline;
+  size_t baselineLen;
+  cortexflashStrategy_t strategy;
+  // Sorted by address, with the rest of the image don't care: pages none of them differs in are left as the baseline has them
+  const cortexflashSegment_t *segments;
+  size_t segmentCount;
+  // If regionLen isn't 0, only the pages of this range are flashed, the rest of them read back first without a baseline
+  uint32_t regionAddress;
+  size_t regionLen;
+  // With flash split into slotCount slots, image goes into slot and makes it the one that boots (without an image, only the latter)
+  unsigned int slotCount, slot;
+} cortexflashTarget_t;
+
+typedef struct {
+  bool massErase;
+  size_t erasePages, frames, bytes, wireBytes;
+  double estimate;
+  // An interrupted flash of the plan is picked up by the next one
+  bool journaled;
+} cortexflashPlanInfo_t;
+
+void cortexflash_default_options(cortexflashOptions_t *options);
+cortexflash_t *cortexflash_open(const cortexflashOptions_t *options);
+// Finishes whatever flash is under way and closes the port
+void cortexflash_close(cortexflash_t *session);
+// What went wrong last
+const char *cortexflash_error(const cortexflash_t *session);
+
+/*
+  Loads the images kept for the robot connected last, as it's most likely
+  the one about to be flashed. This and the three calls after it, which only
+  read what it loads, are the only ones which can be made while another
+  thread connects.
+*/
+bool cortexflash_preload(cortexflash_t *session);
+// The image preloaded as being on the last robot, unless a flash of it was interrupted
+bool cortexflash_last_image(const cortexflash_t *session, const uint8_t **image, size_t *len);
+// Unique ID of the robot the preloaded images were flashed to, empty if nothing's preloaded
+const char *cortexflash_last_uid(const cortexflash_t *session);
+// Whether flashing target over the preloaded image would leave it as it is
+bool cortexflash_unchanged(const cortexflash_t *session, const cortexflashTarget_t *target);
+
+// Opens the port the first time, puts the robot in the bootloader and opens its cache
+bool cortexflash_connect(cortexflash_t *session, const char *port);
+bool cortexflash_info(const cortexflash_t *session, cortexflashInfo_t *info);
+
+/*
+  Each of these finds what the robot holds in a different way, returning
+  an image allocated with malloc: the cached image the robot's fingerprint
+  matches, an interrupted flash of image (with every page it didn't finish
+  made to differ from image), or the robot read back if strategy says so.
+*/
+bool cortexflash_baseline(cortexflash_t *session, uint8_t **baseline, size_t *len);
+bool cortexflash_resume(cortexflash_t *session, const uint8_t *image, size_t len, uint8_t **baseline, size_t *baselineLen);
+bool cortexflash_read_baseline(cortexflash_t *session, const uint8_t *image, size_t len, cortexflashStrategy_t strategy,
+  uint8_t **baseline, size_t *baselineLen, cortexflashProgress_t progress, void *context);
+
+/*
+  Plans the flash, picking between a full and a differential one by the
+  calibrated cost. The target's image has to stay as it is until the flash
+  is finished. Without a connection the plan is made for a Cortex.
+*/
+bool cortexflash_plan(cortexflash_t *session, const cortexflashTarget_t *target);
+bool cortexflash_plan_info(const cortexflash_t *session, cortexflashPlanInfo_t *info);
+void cortexflash_plan_print(const cortexflash_t *session, FILE *out);
+
+/*
+  Carries out the plan. The image is cached once it's been verified, or if
+  it isn't, once the robot is restarted, flashed again or closed.
+*/
+bool cortexflash_flash(cortexflash_t *session, cortexflashProgress_t progress, void *context);
+/*
+  Erases the whole chip and writes the Intel HEX piped into stdin as it
+  arrives, instead of planning and flashing. How much there is to write
+  isn't known until it's all arrived, so progress is given the bytes
+  written so far as the total.
+*/
+bool cortexflash_stream(cortexflash_t *session, cortexflashProgress_t progress, void *context);
+// Reads back the pages flashed, flashing any bad ones again
+bool cortexflash_verify(cortexflash_t *session, cortexflashProgress_t progress, void *context);
+// Restarts the robot's program, after which it has to be connected again to flash it
+bool cortexflash_go(cortexflash_t *session);
+
+#endif
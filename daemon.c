@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "daemon.h"
+
+void daemon_default_socket(char *path, size_t len) {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+  if(runtime && *runtime)
+    snprintf(path, len, "%s/cortexflash.sock", runtime);
+  else
+    snprintf(path, len, "/tmp/cortexflash-%i.sock", (int)getuid());
+}
+
+#ifdef __linux__
+
+bool daemon_open(daemon_t *daemon, const char *file, const char *socketPath) {
+  struct sockaddr_un address;
+  char dir[1024];
+  const char *slash = strrchr(file, '/');
+
+  memset(daemon, 0, sizeof(daemon_t));
+  daemon->listener = daemon->asking = -1;
+
+  // Linkers and objcopy often write a new file and rename it over the old one, so it's the directory that's watched
+  if(slash)
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - file == 0 ? 1 : slash - file), file);
+  else
+    snprintf(dir, sizeof(dir), ".");
+  snprintf(daemon->name, sizeof(daemon->name), "%s", slash ? slash + 1 : file);
+
+  daemon->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(daemon->notify < 0 || inotify_add_watch(daemon->notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fprintf(stderr, "Could not watch %s: %s\n", dir, strerror(errno));
+    goto eFail;
+  }
+
+  if(strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socketPath);
+    goto eFail;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath);
+  strcpy(daemon->socket, socketPath);
+
+  // A socket left behind by a daemon which didn't get to close it is only in the way
+  daemon->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(daemon->listener >= 0 && connect(daemon->listener, (struct sockaddr *)&address, sizeof(address)) == 0) {
+    fprintf(stderr, "Another daemon is listening on %s\n", socketPath);
+    goto eFail;
+  }
+
+  close(daemon->listener);
+  unlink(socketPath);
+
+  daemon->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(daemon->listener < 0 || bind(daemon->listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+     listen(daemon->listener, DAEMON_CLIENTS) != 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", socketPath, strerror(errno));
+    goto eFail;
+  }
+
+  return true;
+
+eFail:
+  // The socket isn't this daemon's to remove
+  daemon->socket[0] = 0;
+  daemon_close(daemon);
+  return false;
+}
+
+// Whether any of the events read are about the watched file
+static bool readChanges(daemon_t *daemon) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t len;
+  char *at;
+  bool changed = false;
+
+  while((len = read(daemon->notify, buffer, sizeof(buffer))) > 0) {
+    for(at = buffer; at < buffer + len; at += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)at;
+      if(event->len && strcmp(event->name, daemon->name) == 0)
+        changed = true;
+    }
+  }
+
+  return changed;
+}
+
+static long long nowMs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// A client which has given up and gone is no reason for the daemon to be killed by SIGPIPE
+static void reply(int client, const char *line) {
+  char buffer[DAEMON_LINE + 1];
+  int len = snprintf(buffer, sizeof(buffer), "%s\n", line);
+
+  send(client, buffer, len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1, MSG_NOSIGNAL);
+  close(client);
+}
+
+static void dropReading(daemon_t *daemon, size_t i) {
+  daemon->reading[i] = daemon->reading[--daemon->readingCount];
+}
+
+// Takes a client whose request has all arrived off the ones being read, and works out what it asks for
+static daemonEvent_t takeRequest(daemon_t *daemon, size_t i) {
+  daemonClient_t *client = &daemon->reading[i];
+  int fd = client->fd;
+
+  client->line[client->len] = 0;
+  client->line[strcspn(client->line, "\r\n")] = 0;
+
+  if(strcmp(client->line, "flash") == 0) {
+    dropReading(daemon, i);
+
+    if(daemon->waitingCount == DAEMON_CLIENTS) {
+      reply(fd, "{\"error\":\"busy\"}");
+      return kDaemonEvent_none;
+    }
+
+    daemon->waiting[daemon->waitingCount++] = fd;
+    return kDaemonEvent_flash;
+  }
+
+  if(strcmp(client->line, "status") == 0) {
+    dropReading(daemon, i);
+
+    if(daemon->asking >= 0) {
+      reply(fd, "{\"error\":\"busy\"}");
+      return kDaemonEvent_none;
+    }
+
+    daemon->asking = fd;
+    return kDaemonEvent_status;
+  }
+
+  dropReading(daemon, i);
+  reply(fd, "{\"error\":\"unknown request\"}");
+  return kDaemonEvent_none;
+}
+
+// Reads what a client has sent so far, a request being all one line
+static daemonEvent_t readRequest(daemon_t *daemon, size_t i) {
+  daemonClient_t *client = &daemon->reading[i];
+  ssize_t got;
+
+  got = read(client->fd, client->line + client->len, sizeof(client->line) - 1 - client->len);
+  if(got < 0 && (errno == EAGAIN || errno == EINTR))
+    return kDaemonEvent_none;
+
+  if(got <= 0 && client->len == 0) {
+    close(client->fd);
+    dropReading(daemon, i);
+    return kDaemonEvent_none;
+  }
+
+  // A client which hangs up has sent all it's going to
+  if(got > 0) {
+    client->len += got;
+    if(!memchr(client->line, '\n', client->len) && client->len < sizeof(client->line) - 1)
+      return kDaemonEvent_none;
+  }
+
+  return takeRequest(daemon, i);
+}
+
+static void acceptClient(daemon_t *daemon) {
+  daemonClient_t *client;
+  int fd;
+
+  fd = accept(daemon->listener, NULL, NULL);
+  if(fd < 0)
+    return;
+
+  // Its request is read as it arrives, never waited on
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if(daemon->readingCount == DAEMON_CLIENTS) {
+    reply(fd, "{\"error\":\"busy\"}");
+    return;
+  }
+
+  client = &daemon->reading[daemon->readingCount++];
+  client->fd = fd;
+  client->len = 0;
+  client->connected = nowMs();
+}
+
+daemonEvent_t daemon_wait(daemon_t *daemon, int timeout) {
+  struct pollfd polls[2 + DAEMON_CLIENTS];
+  long long now = nowMs(), deadline = timeout < 0 ? -1 : now + timeout, expires;
+  daemonEvent_t event;
+  size_t count, i;
+  int wait;
+
+  for(;;) {
+    // Clients which haven't sent a request in time are given up on
+    for(i = 0; i < daemon->readingCount;) {
+      if(now - daemon->reading[i].connected >= DAEMON_REQUEST_MS) {
+        close(daemon->reading[i].fd);
+        dropReading(daemon, i);
+      } else {
+        i++;
+      }
+    }
+
+    if(deadline >= 0 && now >= deadline)
+      return kDaemonEvent_none;
+
+    wait = deadline < 0 ? -1 : (int)(deadline - now);
+    for(i = 0; i < daemon->readingCount; i++) {
+      expires = daemon->reading[i].connected + DAEMON_REQUEST_MS - now;
+      if(wait < 0 || expires < wait)
+        wait = (int)expires;
+    }
+
+    polls[0] = (struct pollfd){daemon->notify, POLLIN, 0};
+    polls[1] = (struct pollfd){daemon->listener, POLLIN, 0};
+    for(i = 0; i < daemon->readingCount; i++)
+      polls[2 + i] = (struct pollfd){daemon->reading[i].fd, POLLIN, 0};
+    count = 2 + daemon->readingCount;
+
+    // A signal ends the wait, so whoever's waiting can see what it was for
+    if(poll(polls, count, wait) < 0)
+      return kDaemonEvent_none;
+
+    if((polls[0].revents & POLLIN) && readChanges(daemon))
+      return kDaemonEvent_changed;
+
+    // Backwards, as taking a client's request moves the last one into its place
+    for(i = count - 2; i > 0; i--) {
+      if(polls[1 + i].revents && (event = readRequest(daemon, i - 1)) != kDaemonEvent_none)
+        return event;
+    }
+
+    if(polls[1].revents & POLLIN)
+      acceptClient(daemon);
+
+    now = nowMs();
+  }
+}
+
+void daemon_answer(daemon_t *daemon, const char *line) {
+  if(daemon->asking < 0)
+    return;
+
+  reply(daemon->asking, line);
+  daemon->asking = -1;
+}
+
+void daemon_finish(daemon_t *daemon, const char *line) {
+  size_t i;
+
+  for(i = 0; i < daemon->waitingCount; i++)
+    reply(daemon->waiting[i], line);
+
+  daemon->waitingCount = 0;
+}
+
+void daemon_close(daemon_t *daemon) {
+  size_t i;
+
+  if(daemon->notify >= 0)
+    close(daemon->notify);
+  if(daemon->listener >= 0)
+    close(daemon->listener);
+  if(daemon->asking >= 0)
+    close(daemon->asking);
+  for(i = 0; i < daemon->readingCount; i++)
+    close(daemon->reading[i].fd);
+  for(i = 0; i < daemon->waitingCount; i++)
+    close(daemon->waiting[i]);
+
+  daemon->notify = daemon->listener = daemon->asking = -1;
+  daemon->readingCount = daemon->waitingCount = 0;
+
+  if(daemon->socket[0])
+    unlink(daemon->socket);
+}
+
+#else
+
+bool daemon_open(daemon_t *daemon, const char *file, const char *socket) {
+  fprintf(stderr, "The daemon needs inotify, which only Linux has\n");
+  return false;
+}
+
+daemonEvent_t daemon_wait(daemon_t *daemon, int timeout) {
+  return kDaemonEvent_none;
+}
+
+void daemon_answer(daemon_t *daemon, const char *line) {
+}
+
+void daemon_finish(daemon_t *daemon, const char *line) {
+}
+
+void daemon_close(daemon_t *daemon) {
+}
+
+#endif
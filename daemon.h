@@ -0,0 +1,61 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Quiet time after the file last changed before it's taken as finished
+#define DAEMON_SETTLE_MS 100
+// Clients waiting on a flash at once
+#define DAEMON_CLIENTS 16
+// Longest request or reply line
+#define DAEMON_LINE 512
+// How long a client has to send its request once it's connected
+#define DAEMON_REQUEST_MS 1000
+
+typedef enum {
+  kDaemonEvent_none,
+  kDaemonEvent_changed,
+  // A client asked for a flash, and waits for its result
+  kDaemonEvent_flash,
+  // A client asked how the last flash went
+  kDaemonEvent_status,
+} daemonEvent_t;
+
+// A client connected whose request hasn't all arrived yet
+typedef struct {
+  int fd;
+  char line[DAEMON_LINE];
+  size_t len;
+  long long connected;
+} daemonClient_t;
+
+/*
+  Watches a file for being written or replaced (with inotify, so only on
+  Linux) and listens on a Unix socket for clients, each of which sends one
+  request line and gets one reply line back. Clients are read as their
+  requests arrive, alongside everything else, so one which is slow to send
+  or never does holds nothing up.
+*/
+typedef struct {
+  int notify, listener;
+  char name[256], socket[108];
+  daemonClient_t reading[DAEMON_CLIENTS];
+  size_t readingCount;
+  int waiting[DAEMON_CLIENTS];
+  size_t waitingCount;
+  int asking;
+} daemon_t;
+
+// Where the socket goes unless told otherwise
+void daemon_default_socket(char *path, size_t len);
+bool daemon_open(daemon_t *daemon, const char *file, const char *socket);
+// Waits up to timeout milliseconds, or forever if it's negative, for something to do
+daemonEvent_t daemon_wait(daemon_t *daemon, int timeout);
+// Replies to the client which asked for the status
+void daemon_answer(daemon_t *daemon, const char *line);
+// Replies to every client waiting on a flash
+void daemon_finish(daemon_t *daemon, const char *line);
+void daemon_close(daemon_t *daemon);
+
+#endif
@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <string.h>
+#include "diff.h"
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define DIFF_AVX2
+#endif
+
+#if defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+/*
+  Each kernel comes in two halves: first() returns the offset of the first
+  differing byte (or len if there is none), last() returns one past the offset
+  of the last differing byte (or 0 if there is none). Vector kernels hand their
+  unaligned tails and heads to the scalar versions.
+*/
+typedef size_t (*scan_t)(const uint8_t *a, const uint8_t *b, size_t len);
+
+typedef struct {
+  const char *name;
+  scan_t first, last;
+} kernel_t;
+
+static size_t scalar_first(const uint8_t *a, const uint8_t *b, size_t len) {
+  uint64_t x, y;
+  size_t i = 0;
+
+  for(; i + 8 <= len; i += 8) {
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if(x != y)
+      break;
+  }
+
+  for(; i < len; i++)
+    if(a[i] != b[i])
+      return i;
+
+  return len;
+}
+
+static size_t scalar_last(const uint8_t *a, const uint8_t *b, size_t len) {
+  uint64_t x, y;
+  size_t i = len;
+
+  for(; i >= 8; i -= 8) {
+    memcpy(&x, a + i - 8, 8);
+    memcpy(&y, b + i - 8, 8);
+    if(x != y)
+      break;
+  }
+
+  for(; i > 0; i--)
+    if(a[i - 1] != b[i - 1])
+      return i;
+
+  return 0;
+}
+
+#if defined(__SSE2__)
+static size_t sse2_first(const uint8_t *a, const uint8_t *b, size_t len) {
+  unsigned int mask;
+  size_t i;
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*)(a + i)),
+      _mm_loadu_si128((const __m128i*)(b + i))));
+
+    if(mask != 0xffff)
+      return i + __builtin_ctz(~mask & 0xffff);
+  }
+
+  return i + scalar_first(a + i, b + i, len - i);
+}
+
+static size_t sse2_last(const uint8_t *a, const uint8_t *b, size_t len) {
+  unsigned int mask;
+  size_t i;
+
+  for(i = len; i >= 16; i -= 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*)(a + i - 16)),
+      _mm_loadu_si128((const __m128i*)(b + i - 16))));
+
+    if(mask != 0xffff)
+      return i - 16 + 32 - __builtin_clz(~mask & 0xffff);
+  }
+
+  return scalar_last(a, b, i);
+}
+#endif
+
+#if defined(DIFF_AVX2)
+__attribute__((target("avx2")))
+static size_t avx2_first(const uint8_t *a, const uint8_t *b, size_t len) {
+  unsigned int mask;
+  size_t i;
+
+  for(i = 0; i + 32 <= len; i += 32) {
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i*)(a + i)),
+      _mm256_loadu_si256((const __m256i*)(b + i))));
+
+    if(mask != 0xffffffff)
+      return i + __builtin_ctz(~mask);
+  }
+
+  return i + scalar_first(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_last(const uint8_t *a, const uint8_t *b, size_t len) {
+  unsigned int mask;
+  size_t i;
+
+  for(i = len; i >= 32; i -= 32) {
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i*)(a + i - 32)),
+      _mm256_loadu_si256((const __m256i*)(b + i - 32))));
+
+    if(mask != 0xffffffff)
+      return i - 32 + 32 - __builtin_clz(~mask);
+  }
+
+  return scalar_last(a, b, i);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static bool neon_equal(const uint8_t *a, const uint8_t *b) {
+  uint64x2_t eq = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)));
+  return (vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) == ~(uint64_t)0;
+}
+
+static size_t neon_first(const uint8_t *a, const uint8_t *b, size_t len) {
+  size_t i;
+
+  for(i = 0; i + 16 <= len; i += 16)
+    if(!neon_equal(a + i, b + i))
+      break;
+
+  return i + scalar_first(a + i, b + i, len - i);
+}
+
+static size_t neon_last(const uint8_t *a, const uint8_t *b, size_t len) {
+  size_t i;
+
+  for(i = len; i >= 16; i -= 16)
+    if(!neon_equal(a + i - 16, b + i - 16))
+      return i - 16 + scalar_last(a + i - 16, b + i - 16, 16);
+
+  return scalar_last(a, b, i);
+}
+#endif
+
+static const kernel_t *kernel = NULL;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+static void chooseKernel() {
+#if defined(DIFF_AVX2)
+  static const kernel_t avx2 = {"avx2", avx2_first, avx2_last};
+#endif
+#if defined(__SSE2__)
+  static const kernel_t sse2 = {"sse2", sse2_first, sse2_last};
+#endif
+#if defined(__ARM_NEON)
+  static const kernel_t neon = {"neon", neon_first, neon_last};
+#endif
+  static const kernel_t scalar = {"scalar", scalar_first, scalar_last};
+
+  kernel = &scalar;
+#if defined(__SSE2__)
+  kernel = &sse2;
+#elif defined(__ARM_NEON)
+  kernel = &neon;
+#endif
+#if defined(DIFF_AVX2)
+  if(__builtin_cpu_supports("avx2"))
+    kernel = &avx2;
+#endif
+}
+
+// Chosen once, whichever thread diffs first
+static const kernel_t *pickKernel() {
+  pthread_once(&kernelOnce, chooseKernel);
+  return kernel;
+}
+
+bool diff_range(const uint8_t *a, const uint8_t *b, size_t len, size_t *first, size_t *last) {
+  const kernel_t *k = pickKernel();
+  size_t f;
+
+  f = k->first(a, b, len);
+  if(f == len)
+    return false;
+
+  if(first)
+    *first = f;
+
+  // Everything before f is known to match, so only scan the rest backwards
+  if(last)
+    *last = f + k->last(a + f, b + f, len - f) - 1;
+
+  return true;
+}
+
+const char *diff_kernel() {
+  return pickKernel()->name;
+}
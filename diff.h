@@ -0,0 +1,15 @@
+#ifndef _DIFF_H
+#define _DIFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Find the first and last differing byte offsets of two equally sized buffers,
+// returns false (and leaves first/last untouched) if they are identical
+bool diff_range(const uint8_t *a, const uint8_t *b, size_t len, size_t *first, size_t *last);
+
+// Name of the comparison kernel picked for this CPU
+const char *diff_kernel();
+
+#endif
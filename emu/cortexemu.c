@@ -0,0 +1,597 @@
+/*
+  Opens a pseudo-terminal and answers on it like a Cortex would: the VEX C9
+  status and user-program commands while the user program runs, then the
+  STM32 ROM bootloader protocol (sync, GET, GV, GID, RM, WM, ER, GO). Flash
+  is modelled with real erase and program semantics using the geometry in
+  stm32.c's devices[] table, and the wire is paced by baud, ACK latency and
+  per-page erase time so wall times are comparable with real hardware.
+*/
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "../stm32.h"
+
+#define UID_ADDRESS 0x1FFFF7E8
+
+typedef enum {
+  kEmuState_user,
+  kEmuState_sync,
+  kEmuState_boot,
+} emuState_t;
+
+typedef struct {
+  unsigned long rx, tx, frames, erasedPages, programErrors;
+  struct timeval start;
+} emuStats_t;
+
+extern const stm32_dev_t devices[];
+
+static int master = -1, slave = -1;
+static const stm32_dev_t *dev;
+static uint8_t *flash, *ram, uid[12];
+static unsigned long flashWrites, failWrite;
+static size_t flashSize, ramSize;
+static emuState_t state = kEmuState_user;
+static emuStats_t stats;
+static volatile sig_atomic_t quit = 0;
+
+// Settings
+static unsigned int baud = 115200, ackLatency = 1000, pageErase = 20000,
+  massErase = 40000, halfwordProgram = 52;
+static uint16_t pid = 0x414;
+static bool startInBootloader = false;
+static char *linkPath = NULL, *imageFile = NULL, *dumpFile = NULL,
+  *statsFile = NULL;
+
+static bool dumpImage(const char *filename);
+
+static void usSleep(unsigned long us) {
+  struct timespec t;
+
+  if(us == 0)
+    return;
+
+  t.tv_sec = us / 1000000;
+  t.tv_nsec = (us % 1000000) * 1000;
+  while(nanosleep(&t, &t) != 0 && errno == EINTR && !quit);
+}
+
+// 8 data bits, even parity and a stop bit
+static unsigned long wireTime(size_t bytes) {
+  return (unsigned long)((uint64_t)bytes * 11 * 1000000 / baud);
+}
+
+static bool rx(uint8_t *data, size_t len, int timeout) {
+  struct pollfd pfd = {master, POLLIN, 0};
+  ssize_t r;
+
+  while(len > 0) {
+    if(poll(&pfd, 1, timeout) <= 0)
+      return false;
+
+    r = read(master, data, len);
+    if(r <= 0)
+      return false;
+
+    // Bytes can't arrive faster than the line carries them
+    usSleep(wireTime(r));
+    stats.rx += r;
+    data += r;
+    len -= r;
+  }
+
+  return true;
+}
+
+static void tx(const uint8_t *data, size_t len) {
+  ssize_t r;
+
+  usSleep(wireTime(len));
+  stats.tx += len;
+
+  while(len > 0) {
+    r = write(master, data, len);
+    if(r <= 0)
+      return;
+
+    data += r;
+    len -= r;
+  }
+}
+
+static void txByte(uint8_t byte) {
+  tx(&byte, 1);
+}
+
+static void ack() {
+  usSleep(ackLatency);
+  txByte(STM32_ACK);
+}
+
+static void nack() {
+  usSleep(ackLatency);
+  txByte(STM32_NACK);
+}
+
+static void printStats(FILE *out) {
+  struct timeval now;
+  double elapsed;
+
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - stats.start.tv_sec) +
+    (now.tv_usec - stats.start.tv_usec) / 1000000.0;
+
+  fprintf(out, "{\"wall\":%.6f,\"rx\":%lu,\"tx\":%lu,\"frames\":%lu,"
+    "\"erased_pages\":%lu,\"program_errors\":%lu}\n",
+    elapsed, stats.rx, stats.tx, stats.frames, stats.erasedPages,
+    stats.programErrors);
+  fflush(out);
+}
+
+static void endSession() {
+  FILE *out;
+
+  if(statsFile) {
+    out = fopen(statsFile, "a");
+    if(out) {
+      printStats(out);
+      fclose(out);
+    }
+  } else {
+    printStats(stderr);
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  gettimeofday(&stats.start, NULL);
+}
+
+static uint8_t *memoryAt(uint32_t address, size_t len, bool write) {
+  if(address >= dev->fl_start && address + len <= dev->fl_end)
+    return &flash[address - dev->fl_start];
+
+  if(address >= 0x20000000 && address + len <= dev->ram_end)
+    return &ram[address - 0x20000000];
+
+  if(!write && address >= UID_ADDRESS && address + len <= UID_ADDRESS + sizeof(uid))
+    return &uid[address - UID_ADDRESS];
+
+  return NULL;
+}
+
+static bool rxAddress(uint32_t *address) {
+  uint8_t buf[5];
+
+  if(!rx(buf, 5, 1000))
+    return false;
+
+  if((buf[0] ^ buf[1] ^ buf[2] ^ buf[3]) != buf[4]) {
+    nack();
+    return false;
+  }
+
+  *address = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+  return true;
+}
+
+static void cmdGet() {
+  uint8_t reply[] = {11, 0x22, 0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x43,
+    0x63, 0x73, 0x82, 0x92};
+
+  ack();
+  tx(reply, sizeof(reply));
+  txByte(STM32_ACK);
+}
+
+static void cmdGetVersion() {
+  uint8_t reply[] = {0x22, 0x00, 0x00};
+
+  ack();
+  tx(reply, sizeof(reply));
+  txByte(STM32_ACK);
+}
+
+static void cmdGetId() {
+  uint8_t reply[] = {1, pid >> 8, pid & 0xff};
+
+  ack();
+  tx(reply, sizeof(reply));
+  txByte(STM32_ACK);
+}
+
+static void cmdReadMemory() {
+  uint32_t address;
+  uint8_t n[2], *mem;
+
+  ack();
+  if(!rxAddress(&address))
+    return;
+  ack();
+
+  if(!rx(n, 2, 1000) || (n[0] ^ n[1]) != 0xff) {
+    nack();
+    return;
+  }
+
+  mem = memoryAt(address, n[0] + 1, false);
+  if(!mem) {
+    nack();
+    return;
+  }
+
+  ack();
+  tx(mem, n[0] + 1);
+  stats.frames++;
+}
+
+static void cmdWriteMemory() {
+  uint32_t address;
+  uint8_t n, data[257], cs, *mem;
+  int i;
+
+  ack();
+  if(!rxAddress(&address))
+    return;
+  ack();
+
+  if(!rx(&n, 1, 1000) || !rx(data, n + 1, 1000) || !rx(&cs, 1, 1000))
+    return;
+
+  stats.frames++;
+
+  cs ^= n;
+  for(i = 0; i <= n; i++)
+    cs ^= data[i];
+
+  mem = memoryAt(address, n + 1, true);
+  if(cs != 0 || !mem || address % 4 != 0) {
+    nack();
+    return;
+  }
+
+  if(mem >= flash && mem < flash + flashSize) {
+    // Flash is programmed a halfword at a time and only onto erased cells
+    usSleep(halfwordProgram * ((n + 2) / 2));
+
+    for(i = 0; i <= n; i += 2) {
+      uint16_t old = mem[i] | (mem[i + 1] << 8),
+        new = data[i] | (data[i + 1] << 8);
+
+      if(old != 0xffff && new != 0x0000) {
+        stats.programErrors++;
+        continue;
+      }
+
+      mem[i] = new & 0xff;
+      mem[i + 1] = new >> 8;
+    }
+
+    // A weakly programmed cell which reads back as erased
+    if(++flashWrites == failWrite)
+      mem[0] = 0xff;
+  } else {
+    memcpy(mem, data, n + 1);
+  }
+
+  ack();
+}
+
+static void cmdErase() {
+  uint8_t n, pages[257], cs;
+  int i;
+
+  ack();
+
+  if(!rx(&n, 1, 1000))
+    return;
+
+  if(n == 0xff) {
+    if(!rx(&cs, 1, 1000) || cs != 0x00) {
+      nack();
+      return;
+    }
+
+    usSleep(massErase);
+    memset(flash, 0xff, flashSize);
+    stats.erasedPages += flashSize / dev->fl_ps;
+    ack();
+    return;
+  }
+
+  if(!rx(pages, n + 1, 1000) || !rx(&cs, 1, 1000))
+    return;
+
+  cs ^= n;
+  for(i = 0; i <= n; i++)
+    cs ^= pages[i];
+
+  if(cs != 0) {
+    nack();
+    return;
+  }
+
+  for(i = 0; i <= n; i++) {
+    if((size_t)pages[i] * dev->fl_ps >= flashSize)
+      continue;
+
+    usSleep(pageErase);
+    memset(&flash[pages[i] * dev->fl_ps], 0xff, dev->fl_ps);
+    stats.erasedPages++;
+  }
+
+  ack();
+}
+
+static void cmdGo() {
+  uint32_t address;
+
+  ack();
+  if(!rxAddress(&address))
+    return;
+  ack();
+
+  state = kEmuState_user;
+
+  // Dumped before the statistics, so whoever sees a session's line can read what it left in flash
+  if(dumpFile && !dumpImage(dumpFile))
+    fprintf(stderr, "Could not dump image to %s\n", dumpFile);
+
+  endSession();
+}
+
+static void bootloader(uint8_t cmd) {
+  uint8_t check;
+
+  if(cmd == STM32_CMD_INIT) {
+    // Autobaud is already done, so the sync byte is an unknown command
+    nack();
+    return;
+  }
+
+  if(!rx(&check, 1, 1000))
+    return;
+
+  if((cmd ^ check) != 0xff) {
+    nack();
+    return;
+  }
+
+  switch(cmd) {
+    case 0x00: cmdGet(); break;
+    case 0x01: cmdGetVersion(); break;
+    case 0x02: cmdGetId(); break;
+    case 0x11: cmdReadMemory(); break;
+    case 0x21: cmdGo(); break;
+    case 0x31: cmdWriteMemory(); break;
+    case 0x43: cmdErase(); break;
+    default: nack(); break;
+  }
+}
+
+static void userProgram(uint8_t byte) {
+  uint8_t buf[4], status[14] = {0xaa, 0x55, 0x21, 0x0a, 0x00, 0x00, 4, 12,
+    0, 135, 150, 0x20, 0x00, 0x00};
+
+  if(byte != 0xc9)
+    return;
+
+  if(!rx(buf, 4, 100) || buf[0] != 0x36 || buf[1] != 0xb8 || buf[2] != 0x47)
+    return;
+
+  switch(buf[3]) {
+    case 0x21:
+      tx(status, sizeof(status));
+      break;
+
+    case 0x25:
+      // The master processor resets the user processor into its bootloader
+      state = kEmuState_sync;
+      break;
+  }
+}
+
+static void onSignal(int sig) {
+  quit = 1;
+}
+
+static bool loadImage(const char *filename) {
+  FILE *in = fopen(filename, "rb");
+  size_t len;
+
+  if(!in)
+    return false;
+
+  len = fread(flash, 1, flashSize, in);
+  fclose(in);
+  return len > 0;
+}
+
+// Written alongside and renamed into place, so the dump is never seen half written
+static bool dumpImage(const char *filename) {
+  char temp[1024];
+  FILE *out;
+  bool ok;
+
+  snprintf(temp, sizeof(temp), "%s.tmp", filename);
+  out = fopen(temp, "wb");
+  if(!out)
+    return false;
+
+  ok = fwrite(flash, 1, flashSize, out) == flashSize;
+  ok = fclose(out) == 0 && ok;
+
+  return ok && rename(temp, filename) == 0;
+}
+
+static void showHelp(char *programName) {
+  fprintf(stderr,
+    "Usage:\n"
+    "  %s [options]\n"
+    "\n"
+    "    -l path   Symlink the pseudo-terminal to path\n"
+    "    -p pid    Device ID to report (default 0x414)\n"
+    "    -b baud   Baud rate used for byte timing (default 115200)\n"
+    "    -a us     ACK latency in microseconds (default 1000)\n"
+    "    -e us     Page erase time in microseconds (default 20000)\n"
+    "    -m us     Mass erase time in microseconds (default 40000)\n"
+    "    -w us     Halfword program time in microseconds (default 52)\n"
+    "    -u hex    96-bit unique ID (24 hex digits)\n"
+    "    -i file   Load initial flash contents from a raw image\n"
+    "    -d file   Dump flash contents to a raw image on GO and on exit\n"
+    "    -s file   Append per-session statistics (JSON lines) to file\n"
+    "    -F n      Leave the first byte of the nth flash write unprogrammed\n"
+    "    -B        Start in the bootloader (program button held)\n"
+    "    -h        Show this help\n",
+    programName
+  );
+}
+
+static bool parseOptions(int argc, char *argv[]) {
+  int opt, i;
+  unsigned int byte;
+
+  while((opt = getopt(argc, argv, "l:p:b:a:e:m:w:u:i:d:s:F:Bh")) != -1) {
+    switch(opt) {
+      case 'l': linkPath = optarg; break;
+      case 'p': pid = strtoul(optarg, NULL, 0); break;
+      case 'b': baud = strtoul(optarg, NULL, 0); break;
+      case 'a': ackLatency = strtoul(optarg, NULL, 0); break;
+      case 'e': pageErase = strtoul(optarg, NULL, 0); break;
+      case 'm': massErase = strtoul(optarg, NULL, 0); break;
+      case 'w': halfwordProgram = strtoul(optarg, NULL, 0); break;
+      case 'i': imageFile = optarg; break;
+      case 'd': dumpFile = optarg; break;
+      case 's': statsFile = optarg; break;
+      case 'B': startInBootloader = true; break;
+      case 'F': failWrite = strtoul(optarg, NULL, 0); break;
+
+      case 'u':
+        if(strlen(optarg) != 24)
+          return false;
+        for(i = 0; i < 12; i++) {
+          if(sscanf(&optarg[i * 2], "%2x", &byte) != 1)
+            return false;
+          uid[i] = byte;
+        }
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  return baud > 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct termios tio;
+  struct sigaction sa = {0};
+  uint8_t byte;
+  int i;
+
+  for(i = 0; i < 12; i++)
+    uid[i] = 0x30 + i;
+
+  if(!parseOptions(argc, argv)) {
+    showHelp(argv[0]);
+    return 1;
+  }
+
+  for(dev = devices; dev->id != 0x00 && dev->id != pid; dev++);
+  if(dev->id == 0x00) {
+    fprintf(stderr, "Unknown device ID 0x%04x\n", pid);
+    return 1;
+  }
+
+  flashSize = dev->fl_end - dev->fl_start;
+  ramSize = dev->ram_end - 0x20000000;
+  flash = malloc(flashSize);
+  ram = calloc(ramSize, 1);
+  memset(flash, 0xff, flashSize);
+
+  if(imageFile && !loadImage(imageFile)) {
+    fprintf(stderr, "Could not load image %s\n", imageFile);
+    return 1;
+  }
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("posix_openpt");
+    return 1;
+  }
+
+  // Hold the slave open so the master never sees a hangup between clients
+  slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if(slave < 0) {
+    perror(ptsname(master));
+    return 1;
+  }
+
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if(linkPath) {
+    unlink(linkPath);
+    if(symlink(ptsname(master), linkPath) != 0) {
+      perror(linkPath);
+      return 1;
+    }
+  }
+
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  sa.sa_handler = onSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if(startInBootloader)
+    state = kEmuState_sync;
+
+  gettimeofday(&stats.start, NULL);
+
+  while(!quit) {
+    if(!rx(&byte, 1, 200))
+      continue;
+
+    switch(state) {
+      case kEmuState_user:
+        userProgram(byte);
+        break;
+
+      case kEmuState_sync:
+        if(byte == STM32_CMD_INIT) {
+          ack();
+          state = kEmuState_boot;
+        }
+        break;
+
+      case kEmuState_boot:
+        bootloader(byte);
+        break;
+    }
+  }
+
+  if(dumpFile && !dumpImage(dumpFile))
+    fprintf(stderr, "Could not dump image to %s\n", dumpFile);
+
+  if(linkPath)
+    unlink(linkPath);
+
+  return 0;
+}
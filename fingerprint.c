@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "fingerprint.h"
+#include "utils.h"
+#include "diff.h"
+
+#define ALIGN_DOWN(x) ((x) & ~(uint32_t)3)
+#define SPAN_MAX (sizeof(((fingerprint_t *)0)->span) / sizeof(fingerprintSpan_t))
+
+// Adds a span unless it's already read back, clipped to the end of flash
+static void addSpan(fingerprint_t *fp, uint32_t offset, uint32_t len, size_t flashLen) {
+  size_t i;
+
+  if(fp->count == SPAN_MAX || offset >= flashLen)
+    return;
+
+  for(i = 0; i < fp->count; i++)
+    if(offset >= fp->span[i].offset && offset + len <= fp->span[i].offset + fp->span[i].len)
+      return;
+
+  fp->span[fp->count].offset = offset;
+  fp->span[fp->count].len = len < flashLen - offset ? len : flashLen - offset;
+  fp->total += fp->span[fp->count].len;
+  fp->count++;
+}
+
+// What the device reads back across every span with image on it, erased past its end
+static void expect(const fingerprint_t *fp, const uint8_t *image, size_t len, uint8_t *out) {
+  const fingerprintSpan_t *span;
+  size_t i, have;
+
+  for(i = 0; i < fp->count; i++) {
+    span = &fp->span[i];
+
+    if(span->offset >= len)
+      have = 0;
+    else
+      have = span->offset + span->len > len ? len - span->offset : span->len;
+
+    memcpy(out, image + span->offset, have);
+    memset(out + have, 0xff, span->len - have);
+    out += span->len;
+  }
+}
+
+// Whether images i and j read back the same across every span
+static bool ambiguous(const fingerprint_t *fp, const uint8_t *const *image, const size_t *len, size_t i, size_t j) {
+  uint8_t first[SPAN_MAX * FINGERPRINT_LEN], second[SPAN_MAX * FINGERPRINT_LEN];
+
+  expect(fp, image[i], len[i], first);
+  expect(fp, image[j], len[j], second);
+
+  return memcmp(first, second, fp->total) == 0;
+}
+
+void fingerprint_build(fingerprint_t *fp, const uint8_t *const *image, const size_t *len, size_t count, size_t flashLen) {
+  size_t i, j, first, minLen, longest = 0;
+  uint32_t seed = 0, part, offset;
+
+  memset(fp, 0, sizeof(fingerprint_t));
+
+  for(i = 0; i < count; i++) {
+    longest = len[i] > longest ? len[i] : longest;
+    seed = crc32(seed, image[i], len[i]);
+  }
+
+  for(offset = 0; offset < FINGERPRINT_HEAD; offset += FINGERPRINT_LEN)
+    addSpan(fp, offset, FINGERPRINT_LEN, flashLen);
+
+  // Seeding from the images keeps the samples stable for them but different for other builds
+  if(longest > FINGERPRINT_HEAD + FINGERPRINT_SAMPLES * FINGERPRINT_SAMPLE_LEN) {
+    part = (longest - FINGERPRINT_HEAD) / FINGERPRINT_SAMPLES;
+
+    for(i = 0; i < FINGERPRINT_SAMPLES; i++) {
+      seed = seed * 1103515245 + 12345;
+      offset = FINGERPRINT_HEAD + i * part + (seed >> 8) % (part - FINGERPRINT_SAMPLE_LEN + 1);
+      addSpan(fp, ALIGN_DOWN(offset), FINGERPRINT_SAMPLE_LEN, flashLen);
+    }
+  }
+
+  // Kept images are often near identical, so read where any pair still alike first differs
+  for(i = 0; i < count; i++) {
+    for(j = i + 1; j < count; j++) {
+      if(!ambiguous(fp, image, len, i, j))
+        continue;
+
+      minLen = len[i] < len[j] ? len[i] : len[j];
+      if(diff_range(image[i], image[j], minLen, &first, NULL))
+        offset = ALIGN_DOWN(first);
+      else if(len[i] != len[j])
+        offset = ALIGN_DOWN(minLen);
+      else
+        continue;
+
+      addSpan(fp, offset, 4, flashLen);
+    }
+  }
+}
+
+bool fingerprint_match(const stm32_t *stm, const fingerprint_t *fp, const uint8_t *const *image, const size_t *len, size_t count,
+  size_t *which) {
+  uint8_t buffer[SPAN_MAX * FINGERPRINT_LEN], expected[SPAN_MAX * FINGERPRINT_LEN];
+  size_t i, at = 0;
+
+  *which = count;
+
+  if(count == 0)
+    return true;
+
+  for(i = 0; i < fp->count; i++) {
+    if(!stm32_read_memory(stm, stm->dev->fl_start + fp->span[i].offset, buffer + at, fp->span[i].len))
+      return false;
+    at += fp->span[i].len;
+  }
+
+  for(i = 0; i < count && *which == count; i++) {
+    expect(fp, image[i], len[i], expected);
+    if(memcmp(buffer, expected, fp->total) == 0)
+      *which = i;
+  }
+
+  return true;
+}
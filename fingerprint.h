@@ -0,0 +1,46 @@
+#ifndef _FINGERPRINT_H
+#define _FINGERPRINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "slot.h"
+
+// The most the bootloader reads back in a single frame
+#define FINGERPRINT_LEN 256
+// The whole vector table, read back a frame at a time
+#define FINGERPRINT_HEAD SLOT_VECTOR_LEN
+// Words sampled from the rest of the images, spread evenly across them
+#define FINGERPRINT_SAMPLES 4
+#define FINGERPRINT_SAMPLE_LEN 16
+// Spans added where images which still can't be told apart first differ
+#define FINGERPRINT_DISTINCT 4
+
+typedef struct {
+  uint32_t offset, len;
+} fingerprintSpan_t;
+
+typedef struct {
+  fingerprintSpan_t span[FINGERPRINT_HEAD / FINGERPRINT_LEN + FINGERPRINT_SAMPLES + FINGERPRINT_DISTINCT];
+  size_t count, total;
+} fingerprint_t;
+
+/*
+  Picks the spans of flash read back to tell which image the device holds:
+  the vector table, which changes with nearly every build, words sampled from
+  the rest so builds differing only further in don't pass for one another,
+  and where any images those leave ambiguous first differ.
+*/
+void fingerprint_build(fingerprint_t *fp, const uint8_t *const *image, const size_t *len, size_t count, size_t flashLen);
+
+/*
+  Reads every span back from the device once and compares each image with
+  all of them in turn. Returns false if the device couldn't be read,
+  otherwise which is set to the first image matching, or to count if none do.
+*/
+bool fingerprint_match(const stm32_t *stm, const fingerprint_t *fp, const uint8_t *const *image, const size_t *len, size_t count,
+  size_t *which);
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "flash.h"
+#include "diff.h"
+
+/*
+  Frames waiting to be sent, prepared by their own thread while the serial
+  I/O waits on ACKs. With one thread moving head and the other tail the ring
+  needs no lock, each slot being handed over by the store which moves past it.
+*/
+typedef struct {
+  stm32_frame_t frame[FLASH_RING_SLOTS];
+  atomic_size_t head, tail;
+  atomic_bool stop;
+  const flashPlan_t *plan;
+  const uint8_t *target;
+  size_t targetLen;
+} frameRing_t;
+
+void flash_error(flashError_t *error, const char *format, ...) {
+  va_list args;
+
+  if(!error)
+    return;
+
+  va_start(args, format);
+  vsnprintf(error->text, sizeof(error->text), format, args);
+  va_end(args);
+}
+
+bool flash_erase(const stm32_t *stm, const flashPlan_t *plan, flashError_t *error) {
+  size_t i, count;
+
+  if(plan->massErase) {
+    if(!stm32_erase_memory(stm, 0xff)) {
+      flash_error(error, "Failed to erase memory");
+      return false;
+    }
+
+    return true;
+  }
+
+  // An empty page list can't be sent, its count byte would mean mass erase
+  if(plan->eraseCount == 0)
+    return true;
+
+  for(i = 0; i < plan->eraseCount; i += count) {
+    count = plan->eraseCount - i > PLAN_ERASE_BATCH ? PLAN_ERASE_BATCH : plan->eraseCount - i;
+
+    if(!stm32_erase_pages(stm, plan->erase + i, count)) {
+      flash_error(error, "Failed to erase memory pages");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Waits on the other end of the ring, spinning briefly before sleeping through the length of a frame on the wire
+static void backoff(unsigned int *spins) {
+  struct timespec wait = {0, 100000};
+
+  if(++*spins < 64)
+    sched_yield();
+  else
+    nanosleep(&wait, NULL);
+}
+
+static void prepareFrame(frameRing_t *ring, size_t i) {
+  const planExtent_t *frame = &ring->plan->frame[i];
+  uint8_t buffer[CHUNK_MAX_LEN];
+  const uint8_t *data = ring->target + frame->offset;
+
+  // The last frame may run past the end of the image to a word boundary
+  if(frame->offset + frame->len > ring->targetLen) {
+    memset(buffer, 0xff, frame->len);
+    memcpy(buffer, data, ring->targetLen - frame->offset);
+    data = buffer;
+  }
+
+  stm32_prepare_write(&ring->frame[i % FLASH_RING_SLOTS], frame->address, data, frame->len);
+}
+
+static void *prepareFrames(void *context) {
+  frameRing_t *ring = context;
+  size_t head;
+  unsigned int spins;
+
+  for(head = 0; head < ring->plan->frameCount; head++) {
+    for(spins = 0; head - atomic_load_explicit(&ring->tail, memory_order_acquire) == FLASH_RING_SLOTS; backoff(&spins))
+      if(atomic_load_explicit(&ring->stop, memory_order_relaxed))
+        return NULL;
+
+    prepareFrame(ring, head);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  }
+
+  return NULL;
+}
+
+bool flash_write(const stm32_t *stm, const flashPlan_t *plan, const uint8_t *target, size_t targetLen, flashProgress_t progress, void *context,
+  flashError_t *error) {
+  frameRing_t *ring;
+  pthread_t thread;
+  size_t tail;
+  unsigned int spins;
+  bool threaded, ok = true;
+
+  if(plan->frameCount == 0)
+    return true;
+
+  ring = malloc(sizeof(frameRing_t));
+  if(!ring) {
+    flash_error(error, "Out of memory");
+    return false;
+  }
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->stop, false);
+  ring->plan = plan;
+  ring->target = target;
+  ring->targetLen = targetLen;
+
+  // Without a thread each frame is prepared just before it's sent
+  threaded = pthread_create(&thread, NULL, prepareFrames, ring) == 0;
+
+  for(tail = 0; tail < plan->frameCount; tail++) {
+    if(threaded)
+      for(spins = 0; atomic_load_explicit(&ring->head, memory_order_acquire) == tail; backoff(&spins));
+    else
+      prepareFrame(ring, tail);
+
+    if(!stm32_send_write(stm, &ring->frame[tail % FLASH_RING_SLOTS])) {
+      flash_error(error, "Failed to write memory at address 0x%08x", plan->frame[tail].address);
+      ok = false;
+      break;
+    }
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    if(progress && !progress(context, &plan->frame[tail])) {
+      ok = false;
+      break;
+    }
+  }
+
+  atomic_store_explicit(&ring->stop, true, memory_order_relaxed);
+  if(threaded)
+    pthread_join(thread, NULL);
+
+  free(ring);
+  return ok;
+}
+
+bool flash_read(const stm32_t *stm, uint32_t address, uint8_t *data, size_t len, flashProgress_t progress, void *context, flashError_t *error) {
+  planExtent_t extent;
+  size_t offset, frame;
+
+  for(offset = 0; offset < len; offset += frame) {
+    frame = len - offset > CHUNK_MAX_LEN ? CHUNK_MAX_LEN : len - offset;
+
+    if(!stm32_read_memory(stm, address + offset, data + offset, frame)) {
+      flash_error(error, "Failed to read memory at address 0x%08lx", (unsigned long)address + offset);
+      return false;
+    }
+
+    extent.address = address + offset;
+    extent.offset = offset;
+    extent.len = frame;
+    if(progress && !progress(context, &extent))
+      return false;
+  }
+
+  return true;
+}
+
+static bool verifyPage(const stm32_t *stm, unsigned int page, const uint8_t *target, size_t targetLen, uint8_t *actual, uint8_t *expected, bool *match,
+  flashProgress_t progress, void *context, flashError_t *error) {
+  size_t ps = stm->dev->fl_ps, offset = page * ps, have;
+  planExtent_t extent;
+
+  if(!flash_read(stm, stm->dev->fl_start + offset, actual, ps, NULL, NULL, error))
+    return false;
+
+  have = offset >= targetLen ? 0 : targetLen - offset > ps ? ps : targetLen - offset;
+  memcpy(expected, target + offset, have);
+  memset(expected + have, 0xff, ps - have);
+
+  *match = !diff_range(actual, expected, ps, NULL, NULL);
+
+  extent.address = stm->dev->fl_start + offset;
+  extent.offset = offset;
+  extent.len = ps;
+  return !progress || progress(context, &extent);
+}
+
+bool flash_verify(const stm32_t *stm, const flashPlan_t *plan, const uint8_t *target, size_t targetLen, uint8_t *bad, size_t *badCount, size_t *verified,
+  flashProgress_t progress, void *context, flashError_t *error) {
+  size_t ps = stm->dev->fl_ps, i, pages;
+  uint8_t *actual, *expected;
+  bool match, ok = true;
+
+  *badCount = 0;
+  *verified = 0;
+
+  actual = malloc(ps * 2);
+  if(!actual) {
+    flash_error(error, "Out of memory");
+    return false;
+  }
+  expected = actual + ps;
+
+  // A mass erase touched every page, but only the ones under the image are worth reading
+  if(plan->massErase) {
+    pages = (targetLen + ps - 1) / ps;
+
+    for(i = 0; i < pages && ok; i++) {
+      if((ok = verifyPage(stm, i, target, targetLen, actual, expected, &match, progress, context, error)) && !match)
+        bad[(*badCount)++] = i;
+    }
+  } else {
+    for(i = 0; i < plan->eraseCount && ok; i++) {
+      if((ok = verifyPage(stm, plan->erase[i], target, targetLen, actual, expected, &match, progress, context, error)) && !match)
+        bad[(*badCount)++] = plan->erase[i];
+    }
+
+    pages = plan->eraseCount;
+  }
+
+  *verified = ok ? pages * ps : 0;
+
+  free(actual);
+  return ok;
+}
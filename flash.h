@@ -0,0 +1,46 @@
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "plan.h"
+
+// Frames prepared ahead of the one being sent, a power of two
+#define FLASH_RING_SLOTS 32
+
+// Called after each frame is written or read, returning false stops the write or read
+typedef bool (*flashProgress_t)(void *context, const planExtent_t *frame);
+
+/*
+  Why a call failed, left for the caller to report. Nothing is printed here,
+  and text stays as the caller set it when a call is only stopped by its
+  progress. Any of the calls below take NULL instead.
+*/
+typedef struct {
+  char text[160];
+} flashError_t;
+
+// Fills in error, if there is one, as printf would
+void flash_error(flashError_t *error, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Carry out a plan built against target, erasing first and then writing
+bool flash_erase(const stm32_t *stm, const flashPlan_t *plan, flashError_t *error);
+// Frames are prepared on a thread of their own, so the serial I/O only ever waits on the device
+bool flash_write(const stm32_t *stm, const flashPlan_t *plan, const uint8_t *target, size_t targetLen, flashProgress_t progress, void *context,
+  flashError_t *error);
+
+/*
+  Reads back every page plan erased and compares it with target (or erased
+  flash past its end), collecting the pages which differ into bad. Returns
+  false if the device couldn't be read. Progress is called for each page.
+*/
+bool flash_verify(const stm32_t *stm, const flashPlan_t *plan, const uint8_t *target, size_t targetLen, uint8_t *bad, size_t *badCount, size_t *verified,
+  flashProgress_t progress, void *context, flashError_t *error);
+
+// Read len bytes of flash at address back in as few frames as the bootloader allows
+bool flash_read(const stm32_t *stm, uint32_t address, uint8_t *data, size_t len, flashProgress_t progress, void *context, flashError_t *error);
+
+#endif
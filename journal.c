@@ -0,0 +1,298 @@
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __WIN32__
+#include <io.h>
+#define fsync _commit
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "journal.h"
+#include "utils.h"
+
+#define JOURNAL_FILE "journal"
+#define JOURNAL_IMAGE_FILE "journal.bin"
+#define JOURNAL_MAGIC "cortexflash journal 1"
+
+static bool storePath(const cacheStore_t *store, const char *name, char *path, size_t len) {
+  return snprintf(path, len, "%s/%s", store->dir, name) < len;
+}
+
+static bool append(journal_t *journal, const char *format, ...) {
+  char line[128];
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  return len > 0 && len < sizeof(line) && write(journal->fd, line, len) == len;
+}
+
+static void flush(journal_t *journal) {
+  if(journal->unsynced == 0)
+    return;
+
+  fsync(journal->fd);
+  journal->unsynced = 0;
+}
+
+static void done(journal_t *journal, unsigned int page) {
+  append(journal, "done %u\n", page);
+
+  if(++journal->unsynced >= JOURNAL_SYNC_PAGES)
+    flush(journal);
+}
+
+static bool writeImage(const char *path, const uint8_t *data, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  bool ok;
+
+  if(fd < 0)
+    return false;
+
+  ok = write(fd, data, len) == len && fsync(fd) == 0;
+  return close(fd) == 0 && ok;
+}
+
+bool journal_begin(journal_t *journal, const cacheStore_t *store, const flashPlan_t *plan, const uint8_t *target, size_t targetLen) {
+  char path[CACHE_PATH_MAX], temp[CACHE_PATH_MAX];
+  size_t i, pages = (plan->dev->fl_end - plan->dev->fl_start) / plan->dev->fl_ps;
+
+  memset(journal, 0, sizeof(journal_t));
+  journal->fd = -1;
+  journal->plan = plan;
+  journal->targetLen = targetLen;
+
+  // A mass erase leaves every page of the device unfinished until it's done
+  journal->count = plan->massErase ? pages : plan->eraseCount;
+  journal->pages = malloc(journal->count + 1);
+  if(!journal->pages)
+    return false;
+
+  for(i = 0; i < journal->count; i++)
+    journal->pages[i] = plan->massErase ? i : plan->erase[i];
+
+  // The image goes first, so a journal never names an image that isn't there
+  if(!storePath(store, JOURNAL_IMAGE_FILE, path, sizeof(path)) || !writeImage(path, target, targetLen))
+    goto eFail;
+
+  if(!storePath(store, JOURNAL_FILE ".tmp", temp, sizeof(temp)) || !storePath(store, JOURNAL_FILE, path, sizeof(path)))
+    goto eFail;
+
+  journal->fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if(journal->fd < 0)
+    goto eFail;
+
+  if(!append(journal, JOURNAL_MAGIC "\nimage %08x %lu\npages %lu\n", crc32(0, target, targetLen), (unsigned long)targetLen, (unsigned long)journal->count))
+    goto eFail;
+
+  for(i = 0; i < journal->count; i++)
+    if(!append(journal, "%u\n", journal->pages[i]))
+      goto eFail;
+
+  if(fsync(journal->fd) != 0)
+    goto eFail;
+
+#ifdef __WIN32__
+  remove(path);
+#endif
+  if(rename(temp, path) != 0)
+    goto eFail;
+
+  return true;
+
+eFail:
+  if(journal->fd >= 0)
+    close(journal->fd);
+  free(journal->pages);
+  memset(journal, 0, sizeof(journal_t));
+  journal->fd = -1;
+  return false;
+}
+
+void journal_erased(journal_t *journal) {
+  size_t i, ps;
+
+  if(journal->fd < 0)
+    return;
+
+  ps = journal->plan->dev->fl_ps;
+
+  for(i = 0; i < journal->count; i++)
+    if(journal->pages[i] * ps >= journal->targetLen)
+      done(journal, journal->pages[i]);
+
+  flush(journal);
+}
+
+void journal_written(journal_t *journal, size_t offset) {
+  size_t ps, start, end;
+
+  if(journal->fd < 0)
+    return;
+
+  ps = journal->plan->dev->fl_ps;
+
+  // Pages are finished in order, once no later frame can touch them
+  for(; journal->next < journal->count; journal->next++) {
+    start = journal->pages[journal->next] * ps;
+    end = start + ps > journal->targetLen ? journal->targetLen : start + ps;
+
+    if(start >= journal->targetLen)
+      continue;
+    if(end > offset)
+      break;
+
+    done(journal, journal->pages[journal->next]);
+  }
+}
+
+void journal_dirty(journal_t *journal, const uint8_t *pages, size_t count) {
+  size_t i;
+
+  if(journal->fd < 0)
+    return;
+
+  for(i = 0; i < count; i++)
+    append(journal, "dirty %u\n", pages[i]);
+
+  journal->unsynced++;
+  flush(journal);
+}
+
+void journal_end(journal_t *journal, const cacheStore_t *store, bool complete) {
+  char path[CACHE_PATH_MAX];
+
+  if(journal->fd >= 0) {
+    flush(journal);
+    close(journal->fd);
+  }
+
+  if(complete) {
+    if(storePath(store, JOURNAL_FILE, path, sizeof(path)))
+      remove(path);
+    if(storePath(store, JOURNAL_IMAGE_FILE, path, sizeof(path)))
+      remove(path);
+  }
+
+  free(journal->pages);
+  memset(journal, 0, sizeof(journal_t));
+  journal->fd = -1;
+}
+
+bool journal_pending(const cacheStore_t *store) {
+  char path[CACHE_PATH_MAX];
+  FILE *in;
+
+  if(!storePath(store, JOURNAL_FILE, path, sizeof(path)) || !(in = fopen(path, "r")))
+    return false;
+
+  fclose(in);
+  return true;
+}
+
+static bool readImage(const char *path, uint8_t **data, size_t len, size_t allocate) {
+  FILE *in = fopen(path, "rb");
+  bool ok;
+
+  *data = NULL;
+  if(!in)
+    return false;
+
+  *data = malloc(allocate ? allocate : 1);
+  ok = *data && fread(*data, 1, len, in) == len && fgetc(in) == EOF;
+  fclose(in);
+
+  if(!ok) {
+    free(*data);
+    *data = NULL;
+  }
+
+  return ok;
+}
+
+bool journal_resume(const cacheStore_t *store, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen,
+  uint8_t **baseline, size_t *baselineLen, size_t *left) {
+  char path[CACHE_PATH_MAX], line[64];
+  size_t pages = (dev->fl_end - dev->fl_start) / dev->fl_ps, ps = dev->fl_ps;
+  size_t i, len, end;
+  unsigned long imageLen, listed;
+  unsigned int crc, page;
+  uint8_t *unfinished, *image = NULL;
+  FILE *in;
+  bool ok = false;
+
+  *baseline = NULL;
+  *baselineLen = 0;
+  *left = 0;
+
+  if(!storePath(store, JOURNAL_FILE, path, sizeof(path)) || !(in = fopen(path, "r")))
+    return false;
+
+  unfinished = calloc(pages, 1);
+  if(!unfinished)
+    goto eDone;
+
+  if(!fgets(line, sizeof(line), in) || strcmp(line, JOURNAL_MAGIC "\n") != 0)
+    goto eDone;
+
+  if(fscanf(in, "image %x %lu\npages %lu\n", &crc, &imageLen, &listed) != 3 || imageLen > dev->fl_end - dev->fl_start || listed > pages)
+    goto eDone;
+
+  for(i = 0; i < listed; i++) {
+    if(fscanf(in, "%u\n", &page) != 1 || page >= pages)
+      goto eDone;
+    unfinished[page] = 1;
+  }
+
+  // A torn last line just leaves its page unfinished
+  while(fgets(line, sizeof(line), in)) {
+    if(sscanf(line, "done %u", &page) == 1 && page < pages && strchr(line, '\n'))
+      unfinished[page] = 0;
+    else if(sscanf(line, "dirty %u", &page) == 1 && page < pages)
+      unfinished[page] = 1;
+  }
+
+  if(!storePath(store, JOURNAL_IMAGE_FILE, path, sizeof(path)))
+    goto eDone;
+
+  // Unfinished pages past the image still have to be covered to be erased
+  for(len = imageLen, i = 0; i < pages; i++)
+    if(unfinished[i] && (i + 1) * ps > len)
+      len = (i + 1) * ps;
+
+  if(!readImage(path, &image, imageLen, len) || crc32(0, image, imageLen) != crc)
+    goto eDone;
+
+  memset(image + imageLen, 0xff, len - imageLen);
+
+  for(page = 0; page < pages; page++) {
+    if(!unfinished[page])
+      continue;
+
+    (*left)++;
+    end = (page + 1) * ps > len ? len : (page + 1) * ps;
+    for(i = page * ps; i < end; i++)
+      image[i] = i < targetLen ? ~target[i] : 0x00;
+  }
+
+  *baseline = image;
+  *baselineLen = len;
+  image = NULL;
+  ok = true;
+
+eDone:
+  fclose(in);
+  free(unfinished);
+  free(image);
+  return ok;
+}
@@ -0,0 +1,50 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "plan.h"
+#include "cache.h"
+
+// Completed pages are only flushed to disk this often, and when the journal ends
+#define JOURNAL_SYNC_PAGES 8
+
+/*
+  Records a flash in progress in the device's cache directory: the image
+  being flashed, the pages the plan touches and each page as it's finished.
+  An interrupted flash leaves the journal behind for the next run to resume.
+*/
+typedef struct {
+  int fd;
+  const flashPlan_t *plan;
+  size_t targetLen;
+  uint8_t *pages;
+  size_t count, next;
+  unsigned int unsynced;
+} journal_t;
+
+bool journal_begin(journal_t *journal, const cacheStore_t *store, const flashPlan_t *plan, const uint8_t *target, size_t targetLen);
+// The plan's erase has finished, which completes the pages it only erases
+void journal_erased(journal_t *journal);
+// Every frame up to offset in the target has been written
+void journal_written(journal_t *journal, size_t offset);
+// Pages which turned out bad after all, such as on a failed verify
+void journal_dirty(journal_t *journal, const uint8_t *pages, size_t count);
+// Flushes and closes the journal, removing it if the flash completed
+void journal_end(journal_t *journal, const cacheStore_t *store, bool complete);
+
+// Whether the device has an interrupted flash waiting to be resumed
+bool journal_pending(const cacheStore_t *store);
+
+/*
+  Loads an interrupted flash's journal as a baseline for target. Pages
+  the journal doesn't have finished are made to differ from target, so any
+  plan built against the baseline erases and rewrites them.
+*/
+bool journal_resume(const cacheStore_t *store, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen,
+  uint8_t **baseline, size_t *baselineLen, size_t *left);
+
+#endif
@@ -25,96 +25,115 @@
 #include "main.h"
 
 // Global variables
-serial_t *serial = NULL;
-stm32_t *stm = NULL;
-parserPackage_t cacheParser, fileParser;
+cortexflash_t *session = NULL;
+parserPackage_t fileParser;
+uint8_t *cacheData = NULL, *placedData = NULL;
+cortexflashSegment_t *segmentList = NULL;
+prepare_t prepare;
 
-// Constants
-const char zero[4] = {0, 0, 0, 0};
+// Every robot flashed by this run, each of which gets its own process when there's more than one
+multiTarget_t targets[MULTI_MAX];
+size_t targetCount = 0;
+multiResult_t flashed;
+
+volatile sig_atomic_t interrupted = 0;
 
 // Settings
 serial_baud_t baudRate = SERIAL_BAUD_115200;
-char *file = NULL, *port = NULL;
+char *file = NULL, *port = NULL, *cacheRoot = NULL, *section = NULL, *manifest = NULL, *socketPath = NULL;
+uint32_t regionAddress = 0;
+size_t regionLen = 0;
+int slot = -1;
+unsigned int slotCount = SLOT_DEFAULT_COUNT;
+parserOptions_t parserOptions;
+bool baseGiven = false;
 
 
 enum {
-  flag_quiet = 0x01,
-  flag_force = 0x02,
   flag_help = 0x04,
   flag_execute = 0x08,
+  flag_dryRun = 0x10,
+  flag_noVerify = 0x20,
+  flag_switch = 0x40,
+  flag_noRestart = 0x80,
+  flag_daemon = 0x100,
 };
 
 int flags = 0;
-bool fInit = true;
-
-void beginTimer () {
+cortexflashStrategy_t strategy = kCortexflashStrategy_auto;
+cortexflashLog_t verbosity = kCortexflashLog_detail;
+progressMode_t progressMode = kProgressMode_auto;
 
+void onInterrupt(int signal) {
+  interrupted = 1;
 }
 
-int cp(const char *to, const char *from)
-{
-    int fd_to, fd_from;
-    char buf[4096];
-    ssize_t nread;
-    int saved_errno;
+bool onProgress(void *context, cortexflashStage_t stage, size_t done, size_t total) {
+  progress_update(stage, done, total);
+  return !interrupted;
+}
 
-    fd_from = open(from, O_RDONLY);
-    if (fd_from < 0)
-        return -1;
+void onLog(void *context, cortexflashLog_t level, const char *message) {
+  progress_log(level, "%s", message);
+}
 
-    fd_to = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd_to < 0)
-        goto out_error;
+// The plan goes out a line at a time like any other message, so it can be rendered as JSON too
+void logPlan(cortexflashLog_t level) {
+  char line[PROGRESS_LINE];
+  FILE *out = tmpfile();
+  size_t len;
 
-    while (nread = read(fd_from, buf, sizeof buf), nread > 0)
-    {
-        char *out_ptr = buf;
-        ssize_t nwritten;
+  if(!out)
+    return;
 
-        do {
-            nwritten = write(fd_to, out_ptr, nread);
+  cortexflash_plan_print(session, out);
+  rewind(out);
 
-            if (nwritten >= 0)
-            {
-                nread -= nwritten;
-                out_ptr += nwritten;
-            }
-            else if (errno != EINTR)
-            {
-                goto out_error;
-            }
-        } while (nread > 0);
-    }
-
-    if (nread == 0)
-    {
-        if (close(fd_to) < 0)
-        {
-            fd_to = -1;
-            goto out_error;
-        }
-        close(fd_from);
+  while(fgets(line, sizeof(line), out)) {
+    len = strlen(line);
+    if(len > 0 && line[len - 1] == '\n')
+      line[len - 1] = 0;
+    progress_log(level, "%s", line);
+  }
 
-        /* Success! */
-        return 0;
-    }
+  fclose(out);
+}
 
-  out_error:
-    saved_errno = errno;
+void beginTimer () {
+  gettimeofday(&startTime, NULL);
+}
 
-    close(fd_from);
-    if (fd_to >= 0)
-        close(fd_to);
+double endTimer() {
+  gettimeofday(&endTime, NULL);
 
-    errno = saved_errno;
-    return -1;
+  return (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_usec - startTime.tv_usec) / 1000000.0;
 }
 
 int main(int argc, char* argv[]) {
   int result = 0;
+  const uint8_t *fileData = NULL, *last;
+  size_t fileSize = 0, lastSize;
+  cortexflashPlanInfo_t planInfo;
+  cortexflashTarget_t target;
+  double handshakeTime, waitTime;
+  bool fromStdin = false;
 
+  parser_default_options(&parserOptions);
 
-  parseOptions(argc, argv);
+  if(!parseOptions(argc, argv)) {
+    showHelp(argv[0]);
+    return 1;
+  }
+
+  progress_init(progressMode, verbosity);
+
+  if(manifest && !multi_load_manifest(manifest, targets, &targetCount)) {
+    fprintf(stderr, "Could not read the manifest %s\n", manifest);
+    return 1;
+  }
+
+  if(!port && targetCount > 0)
+    port = targets[0].port;
 
   if(flags & flag_execute) {
     if(port == NULL) {
@@ -127,13 +146,20 @@ int main(int argc, char* argv[]) {
     showHelp(argv[0]);
 
     return 1;
+  } else if(flags & flag_switch) {
+    if(port == NULL && !(flags & flag_dryRun)) {
+      printf("Not enough arguments (port is undefined)\n");
+
+      showHelp(argv[0]);
+      return 1;
+    }
   } else {
-    if(file == NULL) {
+    if(file == NULL && !manifest) {
       printf("Not enough arguments (filename is undefined)\n");
 
       showHelp(argv[0]);
       return 1;
-    } else if(port == NULL) {
+    } else if(port == NULL && !(flags & flag_dryRun)) {
       printf("Not enough arguments (port is undefined)\n");
 
       showHelp(argv[0]);
@@ -141,438 +167,656 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  if((!(flags & flag_execute) && (file == NULL || port == NULL)) || (flags & flag_execute && port == NULL)) {
-    printf("Not enough arguments\n");
-
-    showHelp(argv[0]);
+  if(regionLen && slot >= 0) {
+    printf("A region can't be flashed into a slot\n");
     return 1;
   }
 
-  // Show help?
-  if(flags & flag_help) {
-    showHelp(argv[0]);
+  progress_log(kCortexflashLog_detail, "Sabumnim's VEX cortex binary flasher");
+  progress_log(kCortexflashLog_detail, "Working directory %s\n", getcwd(NULL, 0));
+
+  if(!openSession())
     return 1;
+
+  if(!(flags & (flag_execute | flag_switch))) {
+    // Binary files go to the start of flash unless told otherwise
+    if(!baseGiven)
+      parserOptions.base = stm32_get_device(CORTEXFLASH_PID)->fl_start;
+
+    fromStdin = file && parser_is_stdin(file) && !(flags & flag_dryRun);
   }
 
-  // Show debug info?
-  if(!(flags & flag_quiet)) {
-    printf("Sabumnim's VEX cortex binary flasher\n");
-    printf("Working directory %s\n\n", getcwd(NULL, 0));
+  // The daemon keeps the session open, flashing the file itself for as long as it runs
+  if(flags & flag_daemon)
+    return runDaemon();
+
+  // Every robot gets a process of its own, which carries on from here with its file already parsed
+  if(targetCount > 1 || manifest) {
+    if(flashMany(&fileData, &fileSize, &result))
+      return result;
+  } else if(!(flags & (flag_execute | flag_switch)) && !fromStdin) {
+    // A piped file is only read once the robot is in the bootloader, so entering it overlaps with building the file
+    startPrepare();
   }
 
-  // Open serial device
-  serial = serial_open(port);
-  if(!serial) {
-    fprintf(stderr, "Error: Could not open serial port %s\n", port);
-    cleanup();
-    return -1;
+  // Without a handshake to overlap there's nothing to gain from waiting, and --no-restart has to know before touching the robot
+  if(prepare.running && (flags & (flag_dryRun | flag_noRestart))) {
+    if(!finishPrepare(&fileData, &fileSize)) {
+      cleanup();
+      return -1;
+    }
+
+    // Build systems often flash again without any change, which needs no bootloader at all
+    if(prepare.unchanged) {
+      progress_log(kCortexflashLog_info, "Image unchanged since the last flash of %s - nothing to do", cortexflash_last_uid(session));
+      cleanup();
+      return 0;
+    }
   }
 
-  // Make sure we are in boot load mode
-  if(testBootloader()) {
-    result = init();
-    if(result != 1) {
+  // Plan against the Cortex's geometry without touching the port
+  if(flags & flag_dryRun) {
+    buildTarget(&target, fileData, fileSize);
+
+    // Without a device to ask, assume the last one connected is flashed next
+    if(strategy != kCortexflashStrategy_full && cortexflash_preload(session) && cortexflash_last_image(session, &last, &lastSize)) {
+      progress_log(kCortexflashLog_detail, "Planning against the cache of the last device connected (%s)", cortexflash_last_uid(session));
+
+      target.baseline = last;
+      target.baselineLen = lastSize;
+    }
+
+    if(!cortexflash_plan(session, &target)) {
       cleanup();
       return -1;
     }
+
+    logPlan(kCortexflashLog_info);
+    cortexflash_plan_info(session, &planInfo);
+    progress_log(kCortexflashLog_info, "Estimate: %li bytes on the wire, %.3fs at %i baud", planInfo.wireBytes, planInfo.estimate, serial_get_baud_int(baudRate));
+
+    cleanup();
+    return 0;
   }
 
-  // Setup serial port for bootloader
-  result = serial_setup(serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1);
-  if(result != SERIAL_ERR_OK) {
-    fprintf(stderr, "Error: Could not configure serial port %s\n", port);
+  // Open the port and put the robot in the bootloader
+  beginTimer();
+  if(!cortexflash_connect(session, port)) {
     cleanup();
     return -1;
   }
 
-  // 100ms delay before comms start
-  uSleep(100000);
+  handshakeTime = endTimer();
 
-  // RTS needs to be low for user program to be reset - no idea why
-  // May need to do something with the DIR line for the USB, not sure yet
-  serial_set_rts(serial, 0);
+  if(prepare.running) {
+    beginTimer();
+    if(!finishPrepare(&fileData, &fileSize)) {
+      // The robot was only put in the bootloader for this file, so it's left running its program
+      cortexflash_go(session);
+      cleanup();
+      return -1;
+    }
+    waitTime = endTimer();
 
-  // 100ms delay before comms start
-  uSleep(100000);
+    progress_log(kCortexflashLog_detail, "Prepared     : %.1fms parsing and loading the cache, %.1fms of it alongside the %.0fms handshake",
+        prepare.time * 1000, (prepare.time > waitTime ? prepare.time - waitTime : 0) * 1000, handshakeTime * 1000);
+  }
 
-  // Initialize the STM32 communications (we may already be in bootload mode)
-  stm = stm32_init(serial, fInit);
-  if(!stm) {
-    fprintf(stderr, "Error: No STM32 device connected on serial port %s\n", port);
+  // From here on the robot is being flashed, which only hands what it has to say to the renderer
+  progress_start();
+
+  if(fromStdin) {
+    // Nothing can be planned against a file which hasn't all arrived, but a full flash can be written as it does
+    if(strategy == kCortexflashStrategy_full && !regionLen && !section && slot < 0 && parser_detect(file) == kStorageType_hex) {
+      if(!streamFile()) {
+        cleanup();
+        return -1;
+      }
+
+      flags |= flag_execute;
+    } else if(!openFile(&fileData, &fileSize)) {
+      cleanup();
+      return -1;
+    }
+  }
+
+  if(!flashConnected(fileData, fileSize, prepare.unchanged)) {
     cleanup();
     return -1;
   }
 
-  if(!(flags & flag_quiet)) {
-    // Print some info about the cortex
-    printf("Version      : 0x%02x\n", stm->bl_version);
-    printf("Option 1     : 0x%02x\n", stm->option1);
-    printf("Option 2     : 0x%02x\n", stm->option2);
-    printf("Device ID    : 0x%04x (%s)\n", stm->pid, stm->dev->name);
-    printf("RAM          : %dKiB  (%db reserved by bootloader)\n", (stm->dev->ram_end - 0x20000000) / 1024, stm->dev->ram_start - 0x20000000);
-    printf("Flash        : %dKiB (sector size: %dx%d)\n", (stm->dev->fl_end - stm->dev->fl_start ) / 1024, stm->dev->fl_pps, stm->dev->fl_ps);
-    printf("Option RAM   : %db\n", stm->dev->opt_end - stm->dev->opt_start);
-    printf("System RAM   : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
-  }
-
-  if(!(flags & flag_execute)) {
-    uint8_t cacheBuffer[2048], fileBuffer[2048], cs;
-    uint32_t addr = stm->dev->fl_start;
-    size_t len, cacheSize, fileSize, offset = 0, skip, bytesFlashed, flen,
-      maxSize, minSize;
-    int i = 0, diffLen;
-    short c;
-    diff_t *difference;
-    bool different;
-
-
-    // TODO: try multiple parsers
-
-    // Load cached file if used
-    if(!(flags & flag_force)) {
-      cacheParser = initParser(kStorageType_hex);
-
-      result = cacheParser.parser->open(cacheParser.storage, "cortex.cache");
-      if(result != kParserError_none) {
-        cacheParser.parser->close(cacheParser.storage);
-        printf("Cached file is either nonexistant or corrupt - defaulting to complete re-flash\n");
-        flags |= flag_force;
-      }
+  cleanup();
 
-      if(!(flags & flag_force)) {
-        cacheSize = cacheParser.parser->size(cacheParser.storage);
+  progress_log(kCortexflashLog_info, "");
 
-        if(cacheSize > stm->dev->fl_end - stm->dev->fl_start) {
-          printf("Cached file is larger than available flash space - defaulting to complete re-flash\n");
-        }
-      }
-    }
+  return 0;
+}
 
+// Everything to do with the robot goes through a session, which starts from the figures measured at this station
+bool openSession() {
+  cortexflashOptions_t options;
+  char root[CACHE_PATH_MAX];
+
+  if(cacheRoot)
+    snprintf(root, sizeof(root), "%s", cacheRoot);
+  else
+    cache_default_root(root, sizeof(root));
+
+  cortexflash_default_options(&options);
+  options.baud = serial_get_baud_int(baudRate);
+  options.cacheRoot = root;
+  options.log = onLog;
+
+  session = cortexflash_open(&options);
+  if(!session) {
+    progress_log(kCortexflashLog_error, "Could not start a session");
+    return false;
+  }
 
-    fileParser = initParser(kStorageType_hex);
+  return true;
+}
 
-    result = fileParser.parser->open(fileParser.storage, file);
-    if(result != kParserError_none) {
-      cleanup();
-      fprintf(stderr, "Provided file is either nonexistant or corrupt (%i)\n", result);
-      return -1;
+// Flashes the file to the robot just connected, or only restarts it if the image last flashed to it is the same
+bool flashConnected(const uint8_t *fileData, size_t fileSize, bool unchanged) {
+  cortexflashPlanInfo_t planInfo;
+  cortexflashInfo_t info;
+  cortexflashTarget_t target;
+  size_t cacheSize = 0;
+  bool resumed = false, restartOnly = flags & flag_execute;
+
+  cortexflash_info(session, &info);
+
+  // The image last flashed is only on this robot if it's the one that was flashed last
+  if(unchanged && (!info.uid[0] || strcmp(info.uid, cortexflash_last_uid(session)) != 0)) {
+    progress_log(kCortexflashLog_detail, "Image was last flashed to %s, not to this device", cortexflash_last_uid(session));
+    unchanged = false;
+  }
+
+  if(unchanged) {
+    progress_log(kCortexflashLog_info, "Image unchanged since the last flash of %s - only restarting it", info.uid);
+    restartOnly = true;
+  }
+
+  // Whatever the last flash was planned against is done with
+  free(cacheData);
+  cacheData = NULL;
+
+  if(!restartOnly) {
+    if(!info.uid[0])
+      progress_log(kCortexflashLog_info, "Could not open a cache for this device - defaulting to complete re-flash");
+    // An interrupted flash is picked up where it stopped, whatever the device's fingerprint says
+    else if(strategy != kCortexflashStrategy_full && !regionLen && cortexflash_resume(session, fileData, fileSize, &cacheData, &cacheSize))
+      resumed = true;
+    else if(strategy != kCortexflashStrategy_full && strategy != kCortexflashStrategy_readback)
+      cortexflash_baseline(session, &cacheData, &cacheSize);
+
+    // Without a baseline the device can still be asked what it holds
+    if(!cacheData && !regionLen && slot < 0)
+      cortexflash_read_baseline(session, fileData, fileSize, strategy, &cacheData, &cacheSize, onProgress, NULL);
+
+    if(!buildTarget(&target, fileData, fileSize))
+      return false;
+
+    target.baseline = cacheData;
+    target.baselineLen = cacheSize;
+
+    // Pages the file doesn't touch keep what the baseline says they hold, but a journal's baseline can't be trusted for them
+    if(resumed) {
+      target.segments = NULL;
+      target.segmentCount = 0;
     }
 
-    fileSize = fileParser.parser->size(fileParser.storage);
+    if(!cortexflash_plan(session, &target))
+      return false;
 
-    if(fileSize > stm->dev->fl_end - stm->dev->fl_start) {
-      cleanup();
-      fprintf(stderr, "Provided file is larger than available flash space\n");
-      return -1;
+    logPlan(kCortexflashLog_detail);
+
+    signal(SIGINT, onInterrupt);
+
+    if(!cortexflash_flash(session, onProgress, NULL) || interrupted) {
+      // Whatever was written is left for the journal to finish
+      if(interrupted && cortexflash_plan_info(session, &planInfo))
+        progress_log(kCortexflashLog_error, "\nInterrupted%s", planInfo.journaled ? " - run again to resume" : "");
+
+      return false;
     }
 
-    if(flags & flag_force) {
-      printf("\nFlashing Everything\n");
-      // Old flashing method
-      stm32_erase_memory(stm, 0xff);
+    signal(SIGINT, SIG_DFL);
 
-      // TODO: show progress
-      // TODO: time download
+    cortexflash_plan_info(session, &planInfo);
+    flashed.flashed = true;
+    flashed.bytes = planInfo.bytes;
+    flashed.frames = planInfo.frames;
+    flashed.pages = planInfo.erasePages;
 
-      while(addr < stm->dev->fl_end && offset < fileSize) {
-        len = stm->dev->fl_end - addr;
-        len = sizeof(fileBuffer) > len ? len : sizeof(fileBuffer);
-        len = len > fileSize - offset ? fileSize - offset : len;
+    if(!(flags & flag_noVerify) && !cortexflash_verify(session, onProgress, NULL))
+      return false;
+  }
 
-        result = fileParser.parser->read(fileParser.storage, fileBuffer, offset, &len);
-        if(result != kParserError_none) {
-          cleanup();
-          return -1;
-        }
+  // Execute code
+  if(!(flags & flag_noRestart))
+    cortexflash_go(session);
 
-        // TODO: verify download?
-        result = stm32_write_memory(stm, addr, fileBuffer, len);
+  return true;
+}
 
-        if(!result) {
-          fprintf(stderr, "\nFailed to write memory at address 0x%08x\n", addr);
-          cleanup();
-          return -1;
-        }
+void *prepareFile(void *context) {
+  struct timeval start, end;
 
-        addr += len;
-        offset += len;
+  gettimeofday(&start, NULL);
 
-        // TODO: show progress
-      }
-    } else {
-      printf("\nFlashing Differences\n");
-      if(cacheSize > fileSize) {
-        minSize = fileSize;
-        maxSize = cacheSize;
-      } else {
-        minSize = cacheSize;
-        maxSize = fileSize;
-      }
+  prepare.ok = openFile(&prepare.fileData, &prepare.fileSize);
 
-      // The page size is 2k, so that is our minimum size to erase/write
-      difference = calloc(sizeof(diff_t) * maxSize / stm->dev->fl_ps + 1, 1);
-      printf("Elements Allocated: %i\n", maxSize / stm->dev->fl_ps + 1);
+  // Whatever the last device was flashed with is its most likely baseline, and tells if there's anything to flash at all
+  if(prepare.ok && strategy != kCortexflashStrategy_full && !(flags & flag_dryRun) && cortexflash_preload(session))
+    prepare.unchanged = !regionLen && slot < 0 && isUnchanged(prepare.fileData, prepare.fileSize);
 
-      // TODO: show progress
-      // TODO: time difference calculation
+  gettimeofday(&end, NULL);
+  prepare.time = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
 
-      // TODO: overhaul diff calculation because memory needs to be erased first
-      // Calculate differences
-      while(addr + offset < stm->dev->fl_end && offset < maxSize) {
-        // Deal with file size differences
-        if(offset >= fileSize) {
-          len = stm->dev->fl_ps > maxSize - offset ? maxSize - offset : stm->dev->fl_ps;
+  return NULL;
+}
 
-          // Because cache is larger, don't read input file
-          difference[i].clear = true;
-          difference[i].len = len;
-          difference[i].offset = offset;
+void startPrepare() {
+  prepare.running = true;
 
-          offset += len;
-          addr += len;
-          i++;
+  // Without a thread the work is just done up front
+  prepare.threaded = pthread_create(&prepare.thread, NULL, prepareFile, NULL) == 0;
+  if(!prepare.threaded)
+    prepareFile(NULL);
+}
 
-          continue;
-        } else if(offset > cacheSize) {
-          len = stm->dev->fl_ps > maxSize - offset ? maxSize - offset : stm->dev->fl_ps;
+bool finishPrepare(const uint8_t **fileData, size_t *fileSize) {
+  if(prepare.threaded)
+    pthread_join(prepare.thread, NULL);
 
-          difference[i].len = len;
-          difference[i].offset = offset;
+  prepare.running = prepare.threaded = false;
+  *fileData = prepare.fileData;
+  *fileSize = prepare.fileSize;
 
-          offset += len;
-          addr += len;
-          i++;
+  return prepare.ok;
+}
 
-          continue;
-        }
+bool openFile(const uint8_t **fileData, size_t *fileSize) {
+  parserError_t result;
 
-        different = false;
-        for(c = 0; c < stm->dev->fl_ps; c += 4) {
-          if(offset + c >= minSize)
-            break;
+  fileParser = initParser(kStorageType_auto, file, &parserOptions);
 
-          len = 4;
+  result = fileParser.parser->open(fileParser.storage, file);
+  if(result != kParserError_none) {
+    if(result == kParserError_unsupported)
+      progress_log(kCortexflashLog_error, "Provided file isn't built for the Cortex (a 32-bit little endian ARM)");
+    else
+      progress_log(kCortexflashLog_error, "Provided file is either nonexistant or corrupt (%i)", result);
+    return false;
+  }
 
-          result = fileParser.parser->read(fileParser.storage, fileBuffer + c, offset + c, &len);
-          if(result != kParserError_none) {
-            printf("Error reading file (%i, %i, %i, %i, %i)\n", result, addr, offset + c, minSize, maxSize);
-            cleanup();
-            return -1;
-          }
+  if(!placeFile(stm32_get_device(CORTEXFLASH_PID), fileData, fileSize))
+    return false;
 
-          // Make sure we don't compare buffers which are inherently different, if we are at end of file
-          if(len < 4) {
-            switch(len) {
-              case 1:
-                fileBuffer[1] = 0;
-              case 2:
-                fileBuffer[2] = 0;
-              case 3:
-                fileBuffer[3] = 0;
-            }
-          }
+  if(section) {
+    result = fileParser.parser->section(fileParser.storage, section, &regionAddress, &regionLen);
+    if(result != kParserError_none) {
+      if(result == kParserError_unsupported)
+        progress_log(kCortexflashLog_error, "Provided file has no sections, --section needs an ELF file");
+      else
+        progress_log(kCortexflashLog_error, "Provided file has no section or symbol %s loaded into flash", section);
+      return false;
+    }
+  }
 
-          len = 4;
+  return true;
+}
 
-          result = cacheParser.parser->read(cacheParser.storage, cacheBuffer + c, offset + c, &len);
-          if(result != kParserError_none) {
-            printf("Error reading cache (%i, %i, %i, %i, %i)\n", result, addr, offset + c, minSize, maxSize);
-            cleanup();
-            return -1;
-          }
+bool streamFile() {
+  cortexflashPlanInfo_t planInfo;
+  cortexflashInfo_t info;
+  bool ok;
 
-          // Make sure we don't compare buffers which are inherently different, if we are at end of file
-          if(len < 4) {
-            switch(len) {
-              case 1:
-                cacheBuffer[1] = 0;
-              case 2:
-                cacheBuffer[2] = 0;
-              case 3:
-                cacheBuffer[3] = 0;
-            }
-          }
+  cortexflash_info(session, &info);
+  if(!info.uid[0])
+    progress_log(kCortexflashLog_info, "Could not open a cache for this device - the flashed image won't be cached");
 
-          if(*(uint32_t*)(cacheBuffer + c) != *(uint32_t*)(fileBuffer + c))
-            different = true;
-        }
+  signal(SIGINT, onInterrupt);
+  ok = cortexflash_stream(session, onProgress, NULL);
+  signal(SIGINT, SIG_DFL);
 
-        if(different) {
-          difference[i].offset = offset;
+  if(!ok) {
+    if(interrupted && cortexflash_plan_info(session, &planInfo))
+      progress_log(kCortexflashLog_error, "\nInterrupted%s", planInfo.journaled ? " - run again to flash it all again" : "");
 
-          if(c != stm->dev->fl_ps)
-            difference[i].len = stm->dev->fl_ps > maxSize - offset ? maxSize - offset : stm->dev->fl_ps;
-          else
-            difference[i].len = c;
+    return false;
+  }
 
-          i++;
-        }
+  return (flags & flag_noVerify) || cortexflash_verify(session, onProgress, NULL);
+}
 
-        offset += c;
-        addr += c;
-      }
+// The file as the session flashes it: its segments, and the region or slot it goes into
+bool buildTarget(cortexflashTarget_t *target, const uint8_t *fileData, size_t fileSize) {
+  const parserSegment_t *segments;
+  size_t count, i;
+
+  memset(target, 0, sizeof(cortexflashTarget_t));
+  target->image = fileData;
+  target->len = fileSize;
+  target->strategy = strategy;
+  target->regionAddress = regionAddress;
+  target->regionLen = regionLen;
+
+  if(slot >= 0) {
+    target->slotCount = slotCount;
+    target->slot = slot;
+  }
 
-      diffLen = i;
-      printf("Elements Used: %i\n", diffLen);
-      addr = stm->dev->fl_start;
+  free(segmentList);
+  segmentList = NULL;
 
-      // Erase relevant pages in memory
-      result = stm32_send_command(stm, stm->cmd->er);
-      if(!result) {
-        printf("Failed to erase memory pages\n");
-        cleanup();
-        return -1;
-      }
+  if(!fileParser.storage || fileParser.parser->segments(fileParser.storage, &segments, &count) != kParserError_none)
+    return true;
 
-      // Make i represent the number of pages (cuz I'm lazy)
-      i -= 1;
-      cs = i;
+  segmentList = malloc(count ? count * sizeof(cortexflashSegment_t) : 1);
+  if(!segmentList)
+    return false;
 
-      // Send number of pages
-      stm32_send_byte(stm, i);
+  for(i = 0; i < count; i++) {
+    segmentList[i].address = segments[i].address;
+    segmentList[i].len = segments[i].len;
+  }
 
-      // Send page numbers to erase
-      for(c = 0; c <= i; c++) {
-        stm32_send_byte(stm, difference[c].offset / stm->dev->fl_ps);
-        cs ^= difference[c].offset / stm->dev->fl_ps;
+  target->segments = segmentList;
+  target->segmentCount = count;
 
-        printf("Erasing page %li\n", difference[c].offset / stm->dev->fl_ps);
-      }
+  return true;
+}
 
-      // Send checksum
-      stm32_send_byte(stm, cs);
+bool isUnchanged(const uint8_t *fileData, size_t fileSize) {
+  cortexflashTarget_t target;
 
-      result = stm32_read_byte(stm);
-      if(result != STM32_ACK) {
-        printf("Failed to erase memory pages\n");
-        cleanup();
-        return -1;
-      }
+  return buildTarget(&target, fileData, fileSize) && cortexflash_unchanged(session, &target);
+}
 
-      // Flash Differences
-      for(i = 0; i < diffLen; i++) {
-        len = difference[i].len;
-        offset = difference[i].offset;
+bool placeFile(const stm32_dev_t *dev, const uint8_t **fileData, size_t *fileSize) {
+  const parserSegment_t *segments;
+  const uint8_t *view;
+  size_t count, viewSize, end;
 
-        // Skip rewriting nothing
-        if(difference[i].clear)
-          continue;
+  // Formats without segments are already laid out from the start of flash
+  if(fileParser.parser->segments(fileParser.storage, &segments, &count) != kParserError_none || count == 0)
+    return fileParser.parser->view(fileParser.storage, fileData, fileSize) == kParserError_none;
 
-        printf("Writing %i bytes at %li (%li)...", len, difference[i].offset, addr + difference[i].offset);
+  end = segments[count - 1].address + segments[count - 1].len;
+  if(segments[0].address < dev->fl_start || end > dev->fl_end) {
+    progress_log(kCortexflashLog_error, "Provided file holds 0x%08x-0x%08lx, outside of flash", segments[0].address, end);
+    return false;
+  }
 
-        skip = 0;
+  if(fileParser.parser->view(fileParser.storage, &view, &viewSize) != kParserError_none)
+    return false;
 
-        for(c = 0; len > 0; c++) {
+  if(segments[0].address == dev->fl_start) {
+    *fileData = view;
+    *fileSize = viewSize;
+    return true;
+  }
 
-          flen = bytesFlashed = len >= 256 ? 256 : len;
+  // A file starting further into flash is lead by erased pages
+  *fileSize = end - dev->fl_start;
+  placedData = malloc(*fileSize);
+  if(!placedData)
+    return false;
 
-          memset(fileBuffer, 0xff, 256);
-          fileParser.parser->read(fileParser.storage, fileBuffer, offset, &bytesFlashed);
+  memset(placedData, 0xff, segments[0].address - dev->fl_start);
+  memcpy(placedData + (segments[0].address - dev->fl_start), view, viewSize);
+  *fileData = placedData;
 
-          // Trim beginning of 256 bytes
-          while(*(uint32_t*)(fileBuffer + skip) == 0xffffffff && bytesFlashed > 0) {
-            skip += 4;
-            bytesFlashed -= 4;
-          }
+  return true;
+}
 
-          // Trim end of 256 bytes
-          while(*(uint32_t*)(fileBuffer + skip + bytesFlashed - 4) == 0xffffffff && bytesFlashed > 0)
-            bytesFlashed -= 4;
+bool flashMany(const uint8_t **fileData, size_t *fileSize, int *exitCode) {
+  image_t images[MULTI_MAX];
+  size_t imageCount = 0, i, j;
+  char *commandFile = file;
+  struct timeval start, end;
+  int index;
 
-          // Make sure we don't try flashing if there are not bytes to flash
-          if(bytesFlashed > 0) {
-            result = stm32_write_memory(stm, addr + offset, fileBuffer + skip, bytesFlashed);
-            if(!result)
-              printf("Failed to write memory at address 0x%08x\n", addr + offset);
-          }
+  *exitCode = 1;
 
-          printf("%i,", bytesFlashed);
+  // Each file is parsed once, before forking, so every process shares it
+  for(i = 0; i < targetCount && !(flags & (flag_execute | flag_switch)); i++) {
+    if(!targets[i].file)
+      targets[i].file = commandFile;
 
-          len -= flen;
-          offset += flen;
-        }
+    if(!targets[i].file) {
+      progress_log(kCortexflashLog_error, "No file to flash to %s", targets[i].port);
+      goto eDone;
+    }
 
-        printf("done\n");
-      }
+    if(parser_is_stdin(targets[i].file)) {
+      progress_log(kCortexflashLog_error, "A piped file can't be flashed to several robots");
+      goto eDone;
+    }
 
-      // TODO: show progress
+    for(j = 0; j < imageCount && strcmp(images[j].file, targets[i].file) != 0; j++);
+    if(j < imageCount)
+      continue;
 
-      free(difference);
+    if(!parseImage(&images[j], targets[i].file)) {
+      progress_log(kCortexflashLog_error, "Could not flash %s to %s", targets[i].file, targets[i].port);
+      goto eDone;
     }
+
+    imageCount++;
   }
 
-  // Execute code
-  if(stm) {
-    if(!(flags & flag_quiet)) {
-      fprintf(stdout, "\nStarting execution at address 0x%08x... \n", stm->dev->fl_start);
-      fflush(stdout);
+  gettimeofday(&start, NULL);
+  index = multi_run(targets, targetCount, &flashed);
+
+  // This process flashes the one robot, using the parsed file which goes to it
+  if(index >= 0) {
+    port = targets[index].port;
+    file = targets[index].file;
+
+    for(j = 0; j < imageCount; j++)
+      if(strcmp(images[j].file, file) == 0)
+        useImage(&images[j], fileData, fileSize);
+
+    return false;
+  }
+
+  gettimeofday(&end, NULL);
+  multi_summary(targets, targetCount, (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0, stdout);
+
+  *exitCode = 0;
+  for(i = 0; i < targetCount; i++)
+    if(targets[i].status != 0)
+      *exitCode = 1;
+
+eDone:
+  for(j = 0; j < imageCount; j++)
+    freeImage(&images[j]);
+
+  return true;
+}
+
+int runDaemon() {
+  daemon_t daemon;
+  image_t last;
+  char defaultSocket[sizeof(daemon.socket)], status[DAEMON_LINE];
+  bool pending = true, settling = false;
+
+  if(flags & (flag_execute | flag_switch | flag_dryRun) || targetCount > 1 || manifest) {
+    progress_log(kCortexflashLog_error, "The daemon flashes one file to one robot");
+    return 1;
+  }
+
+  if(parser_is_stdin(file)) {
+    progress_log(kCortexflashLog_error, "The daemon needs a file to watch, not a pipe");
+    return 1;
+  }
+
+  if(!socketPath) {
+    daemon_default_socket(defaultSocket, sizeof(defaultSocket));
+    socketPath = defaultSocket;
+  }
+
+  if(!daemon_open(&daemon, file, socketPath))
+    return 1;
+
+  progress_log(kCortexflashLog_detail, "Watching %s for %s, listening on %s\n", file, port, socketPath);
+
+  // The cache is only loaded once, the session keeping what it holds up to date with every flash from then on
+  if(strategy != kCortexflashStrategy_full)
+    cortexflash_preload(session);
+
+  memset(&last, 0, sizeof(image_t));
+  daemonStatus(status, sizeof(status), "idle", "}");
+  signal(SIGINT, onInterrupt);
+  signal(SIGTERM, onInterrupt);
+
+  // The file is flashed as it starts, then whenever it's rebuilt or a client asks
+  while(!interrupted) {
+    if(pending && !settling) {
+      pending = false;
+      daemonFlash(&daemon, status, sizeof(status), &last);
     }
 
-    result = stm32_go(stm, stm->dev->fl_start);
-    if(!(flags & flag_quiet)) {
-      if(result)
-        fprintf(stdout, "done.\n");
-      else
-        fprintf(stdout, "failed.\n");
+    switch(daemon_wait(&daemon, settling ? DAEMON_SETTLE_MS : -1)) {
+      case kDaemonEvent_changed:
+        // A build writes the file more than once, so it's only flashed once it's been left alone a moment
+        settling = true;
+        break;
+      case kDaemonEvent_flash:
+        pending = true;
+        break;
+      case kDaemonEvent_status:
+        daemon_answer(&daemon, status);
+        break;
+      case kDaemonEvent_none:
+        if(settling)
+          pending = true;
+        settling = false;
+        break;
     }
   }
 
+  daemon_close(&daemon);
+
+  // Closing the session finishes the last flash, which may still need its image
   cleanup();
+  freeImage(&last);
 
-  printf("\n");
+  return 0;
+}
 
-  // Cache file
-  if(!(flags & flag_execute || flags & flag_help)) {
-    printf("Caching input file\n");
-    result = cp("cortex.cache", file);
-    if(result != 0)
-      printf("Copying failed\n");
-  }
+// A status line for the file and port, which are escaped as they can hold anything a path can
+void daemonStatus(char *status, size_t statusLen, const char *state, const char *tail) {
+  char fileJson[DAEMON_LINE / 2], portJson[DAEMON_LINE / 8];
 
-  return 0;
+  progress_json_string(fileJson, sizeof(fileJson), file, strlen(file));
+  progress_json_string(portJson, sizeof(portJson), port, strlen(port));
+  snprintf(status, statusLen, "{\"status\":\"%s\",\"file\":%s,\"port\":%s%s", state, fileJson, portJson, tail);
 }
 
-bool testBootloader() {
-  char buf[2] = {0x7f};
-  char rep[16] = {0};
-  int retry;
+void daemonFlash(daemon_t *daemon, char *status, size_t statusLen, image_t *last) {
+  image_t image;
+  const uint8_t *fileData;
+  size_t fileSize;
+  struct timeval start, end;
+  char tail[64];
+  bool unchanged, ok;
+
+  // A broken build doesn't even reach the robot
+  if(!parseImage(&image, file)) {
+    daemonStatus(status, statusLen, "invalid", "}");
+    goto eDone;
+  }
 
-  uSleep(100000);
+  useImage(&image, &fileData, &fileSize);
+  memset(&flashed, 0, sizeof(multiResult_t));
 
-  if(serial) {
-    // Setup serial port for bootloader
-    if(serial_setup(serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
-      perror(port);
-      cleanup();
-      return -1;
-    }
+  // Every flash keeps the session's images up to date, so whether this one's needed is known without touching the disk
+  unchanged = strategy != kCortexflashStrategy_full && !regionLen && slot < 0 && session && isUnchanged(fileData, fileSize);
 
-    uSleep(100000);
-
-    for(retry = 0; retry < 5; retry++) {
-      serial_write(serial, buf, 1);
-      if(serial_read(serial, rep, 1) == SERIAL_ERR_OK) {
-        // Let's see what we got
-        if(rep[0] == 0x79) {
-          // We are done, user must have pushed program button
-          fInit = false; // remove init flag
-          return 0;
-        } else if(rep[0] == 0x1f) {
-          // We are also done, see if we can get a status
-          buf[0] = 0x00;
-          buf[1] = 0xff;
-          serial_write(serial, buf, 2);
-          // check status is good
-          if(serial_read(serial, rep, 15) == SERIAL_ERR_OK && rep[0] == 0x79) {
-            fInit = false; // remove init flag
-            return 0;
-          }
-        }
-      }
+  gettimeofday(&start, NULL);
+  progress_start();
+
+  ok = session && cortexflash_connect(session, port);
+
+  // The robot may have been unplugged, leaving the port open to nothing, so it's tried again with a fresh session
+  if(!ok) {
+    cortexflash_close(session);
+
+    if(openSession()) {
+      if(strategy != kCortexflashStrategy_full)
+        cortexflash_preload(session);
+      ok = cortexflash_connect(session, port);
     }
   }
 
-  return fInit;
+  // Connecting finishes whatever was flashed last, which is all the last image was kept for
+  freeImage(last);
+  *last = image;
+
+  if(ok)
+    ok = flashConnected(fileData, fileSize, unchanged);
+
+  progress_stop();
+  signal(SIGINT, onInterrupt);
+  gettimeofday(&end, NULL);
+
+  // The image owns what it was parsed into, so nothing's left for cleanup to free twice
+  memset(&fileParser, 0, sizeof(parserPackage_t));
+  placedData = NULL;
+
+  snprintf(tail, sizeof(tail), ",\"time\":%.2f,\"bytes\":%lu,\"pages\":%lu}",
+    (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0, (unsigned long)flashed.bytes, (unsigned long)flashed.pages);
+  daemonStatus(status, statusLen, !ok ? "failed" : flashed.flashed ? "flashed" : "unchanged", tail);
+
+eDone:
+  progress_log(kCortexflashLog_detail, "%s", status);
+  fflush(stdout);
+
+  daemon_finish(daemon, status);
+}
+
+bool parseImage(image_t *image, char *path) {
+  bool ok;
+
+  file = path;
+  ok = openFile(&image->data, &image->size);
+
+  image->file = path;
+  image->parser = fileParser;
+  image->placed = placedData;
+  image->regionAddress = regionAddress;
+  image->regionLen = regionLen;
+
+  // The globals are left free for the next file
+  memset(&fileParser, 0, sizeof(parserPackage_t));
+  placedData = NULL;
+
+  if(!ok)
+    freeImage(image);
+
+  return ok;
+}
+
+void useImage(const image_t *image, const uint8_t **fileData, size_t *fileSize) {
+  fileParser = image->parser;
+  placedData = image->placed;
+  regionAddress = image->regionAddress;
+  regionLen = image->regionLen;
+  *fileData = image->data;
+  *fileSize = image->size;
+}
+
+void freeImage(image_t *image) {
+  if(image->parser.storage)
+    image->parser.parser->close(image->parser.storage);
+  free(image->placed);
+
+  image->parser.storage = NULL;
+  image->placed = NULL;
 }
 
 bool parseOptions(int argc, char *argv[]) {
@@ -590,30 +834,30 @@ bool parseOptions(int argc, char *argv[]) {
     optionType = 0;
 
     for(i = 0; ; i++) {
-      if(i == 0 && arg[i] == '-')
+      // A lone dash is the file, read from stdin
+      if(i == 0 && arg[i] == '-' && arg[1] != 0)
         optionType = 1;
-      else if(i == 1 && arg[i] == '-')
-        optionType = 2; // not used yet
-      else {
+      else if(i == 1 && arg[i] == '-' && optionType == 1) {
+        optionType = 2;
+
+        if(!parseWordOption(arg + 2, argc, argv, &iArg))
+          return false;
+        break;
+      } else {
         if(arg[i] == 0) {
           // End of string
 
           // Store ordinal and anonymous options
           if(optionType == 0) {
-            switch(iOpt) {
-              case 0:
-                if(flags & flag_execute)
-                  port = arg;
-                else
-                  file = arg;
-                break;
-
-              case 1:
-                if(flags & flag_execute)
-                  continue;
-
+            // Every argument after the file is another port
+            if(iOpt == 0 && !(flags & (flag_execute | flag_switch))) {
+              file = arg;
+            } else if(targetCount < MULTI_MAX) {
+              memset(&targets[targetCount], 0, sizeof(multiTarget_t));
+              targets[targetCount++].port = arg;
+
+              if(!port)
                 port = arg;
-                break;
             }
 
             iOpt++;
@@ -630,11 +874,17 @@ bool parseOptions(int argc, char *argv[]) {
               break;
 
             case 'f':
-              flags |= flag_force;
+              strategy = kCortexflashStrategy_full;
               break;
 
             case 'q':
-              flags |= flag_quiet;
+              if(verbosity > kCortexflashLog_error)
+                verbosity--;
+              break;
+
+            case 'v':
+              if(verbosity < kCortexflashLog_debug)
+                verbosity++;
               break;
 
             case 'h':
@@ -646,138 +896,179 @@ bool parseOptions(int argc, char *argv[]) {
     }
   }
 
-  return false;
+  return true;
 }
 
-int init() {
-  uSleep(100000);
-
-  if(serial) {
-    if(serial_setup(serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_NONE, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
-      perror(port);
-      cleanup();
-      return -1;
-    }
+// Word options take their value either after '=' or as the next argument
+static char *wordOptionValue(char *arg, int argc, char *argv[], int *iArg) {
+  char *value = strchr(arg, '=');
 
-    uSleep(100000);
+  if(value)
+    return value + 1;
 
-    // send some zeros, there are bugs in the serial driver
-    serial_write(serial, zero, 4);
+  if(*iArg + 1 < argc)
+    return argv[++*iArg];
 
-    uSleep(100000);
-
-    // check system status
-    if(!getSystemStatus()) {
-      uSleep(100000);
-
-      // Didn't work, so try again
-      if(!getSystemStatus()) {
-        fprintf(stderr, "Error: No VEX system detected\n");
-        return -1;
-      }
-    }
-
-    enterUserProgram();
-
-    return 1;
-  }
-  return 0;
+  fprintf(stderr, "Option --%s needs a value\n", arg);
+  return NULL;
 }
 
-bool getSystemStatus() {
-  unsigned char buf[5] = {0xc9, 0x36, 0xb8, 0x47, 0x21};
-  unsigned char rep[16];
-
-  if(serial) {
-    if(!(flags & flag_quiet))
-      printf("Send system status request\n");
-
-    // Stop the cortex from sending any data
-    serial_flush(serial);
-
-    // Try and get status
-    if(serial_write(serial, buf, 5) == SERIAL_ERR_OK) {
-      if(serial_read(serial, rep, 14) == SERIAL_ERR_OK) {
-        if(!(flags & flag_quiet)) {
-          // Double check reply
-          if(!(rep[0] == 0xaa && rep[1] == 0x55 && rep[2] == 0x21 && rep[3] == 0x0a))
-            return 0;
-
-          // Show reply
-          printf("Status ");
-          for(int i=0; i<14; i++)
-            printf("%02X ", rep[i]);
-          printf("\n");
-
-          // Decode some info
-          printf("Connection Type  : ");
-          switch(rep[11] & 0x34) {
-            case 0x10:
-            case 0x14:
-              printf("USB Tether\n");
-              break;
-
-            case 0x20:
-            case 0x24:
-              printf("USB Direct Connection\n");
-              break;
-
-            case 0x00:
-              printf("WiFi (VEXnet 1.0)\n");
-              break;
-
-            case 0x04:
-            case 0x34:
-              printf("WiFi (VEXnet 2.0)\n");
-              break;
-
-            default:
-              printf("Unknown (%02X)\n", rep[11]);
-              break;
-          }
-
-          if((rep[11] & 0x30) != 0x20)
-            printf("Joystick Firmware: %d.%02d\n", rep[4], rep[5]);
-          else
-            printf("Joystick Firmware: NA\n");
-
-          printf("Master firmware  : %d.%02d\n", rep[6], rep[7]);
-          printf("Joystick battery : %.2fV\n", (double)rep[8]  * 0.059);
-          printf("Cortex battery   : %.2fV\n", (double)rep[9]  * 0.059);
-          printf("Backup battery   : %.2fV\n", (double)rep[10] * 0.059);
-
-          printf("\n");
-        }
-      } else
-        return 0;
-    } else
-      return 0;
-  }
-
-  return 1;
+static bool isWordOption(const char *arg, const char *name) {
+  size_t len = strcspn(arg, "=");
+  return strlen(name) == len && strncmp(arg, name, len) == 0;
 }
 
-void enterUserProgram() {
-  char buf[5] = {0xc9, 0x36, 0xb8, 0x47, 0x25};
-
-  if(serial) {
-    if(!(flags & flag_quiet))
-      printf("Send bootloader start command\n");
-
-    for(char i=0; i<5; i++)
-      serial_write(serial, buf, 5);
+bool parseWordOption(char *arg, int argc, char *argv[], int *iArg) {
+  unsigned long fill;
+  char *value, *end;
+
+  if(isWordOption(arg, "dry-run")) {
+    flags |= flag_dryRun;
+  } else if(isWordOption(arg, "no-restart")) {
+    flags |= flag_noRestart;
+  } else if(isWordOption(arg, "no-verify")) {
+    flags |= flag_noVerify;
+  } else if(isWordOption(arg, "baud")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    baudRate = serial_get_baud(strtoul(value, NULL, 0));
+    if(baudRate == SERIAL_BAUD_INVALID) {
+      fprintf(stderr, "Unsupported baud rate %s\n", value);
+      return false;
+    }
+  } else if(isWordOption(arg, "strategy")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    if(strcmp(value, "auto") == 0)
+      strategy = kCortexflashStrategy_auto;
+    else if(strcmp(value, "full") == 0)
+      strategy = kCortexflashStrategy_full;
+    else if(strcmp(value, "diff") == 0)
+      strategy = kCortexflashStrategy_diff;
+    else if(strcmp(value, "readback") == 0)
+      strategy = kCortexflashStrategy_readback;
+    else {
+      fprintf(stderr, "Unknown strategy %s\n", value);
+      return false;
+    }
+  } else if(isWordOption(arg, "progress")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    if(strcmp(value, "auto") == 0)
+      progressMode = kProgressMode_auto;
+    else if(strcmp(value, "bar") == 0)
+      progressMode = kProgressMode_bar;
+    else if(strcmp(value, "json") == 0)
+      progressMode = kProgressMode_json;
+    else if(strcmp(value, "none") == 0)
+      progressMode = kProgressMode_none;
+    else {
+      fprintf(stderr, "Unknown progress %s\n", value);
+      return false;
+    }
+  } else if(isWordOption(arg, "region")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    regionAddress = strtoul(value, &value, 0);
+    if(*value != ':' || (regionLen = strtoul(value + 1, &value, 0)) == 0 || *value) {
+      fprintf(stderr, "Region needs to be given as start:length\n");
+      return false;
+    }
+  } else if(isWordOption(arg, "daemon")) {
+    flags |= flag_daemon;
+  } else if(isWordOption(arg, "socket")) {
+    if(!(socketPath = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+  } else if(isWordOption(arg, "manifest")) {
+    if(!(manifest = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+  } else if(isWordOption(arg, "base")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    parserOptions.base = strtoul(value, &value, 0);
+    baseGiven = true;
+    if(*value) {
+      fprintf(stderr, "Base needs to be an address\n");
+      return false;
+    }
+  } else if(isWordOption(arg, "fill")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    memset(parserOptions.fill, 0, sizeof(parserOptions.fill));
+    if(strcmp(value, "none") == 0)
+      return true;
+
+    do {
+      // An empty element would otherwise read as 0x00
+      fill = strtoul(value, &end, 0);
+      if(end == value || fill > 0xff || (*end && *end != ',')) {
+        fprintf(stderr, "Fill needs to be a list of bytes, such as 0xff,0x00\n");
+        return false;
+      }
 
-    uSleep(250000);
+      parserOptions.fill[fill] = 1;
+      value = end;
+    } while(*value++);
+  } else if(isWordOption(arg, "section")) {
+    if(!(section = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+  } else if(isWordOption(arg, "slot") || isWordOption(arg, "switch")) {
+    if(isWordOption(arg, "switch"))
+      flags |= flag_switch;
+
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    slot = strtoul(value, &value, 0);
+    if(*value) {
+      fprintf(stderr, "Slot needs to be a number\n");
+      return false;
+    }
+  } else if(isWordOption(arg, "slots")) {
+    if(!(value = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+
+    slotCount = strtoul(value, &value, 0);
+    if(*value || slotCount < 1 || slotCount > SLOT_MAX) {
+      fprintf(stderr, "Slot count needs to be between 1 and %i\n", SLOT_MAX);
+      return false;
+    }
+  } else if(isWordOption(arg, "cache-dir")) {
+    if(!(cacheRoot = wordOptionValue(arg, argc, argv, iArg)))
+      return false;
+  } else if(isWordOption(arg, "help")) {
+    flags |= flag_help;
+  } else {
+    fprintf(stderr, "Unknown option --%s\n", arg);
+    return false;
   }
+
+  return true;
 }
 
 void showHelp(char *programName) {
   fprintf(stderr,
     "Usage:\n"
 #ifdef __WIN32__
-    "  %s [-qf] filename COM1\n"
+    "  %s [-qvf] [--baud rate] filename COM1 [COM2 ...]\n"
+#else
+    "  %s [-qvf] [--baud rate] filename /dev/tty.usbserial [...]\n"
+#endif
+    "--or--\n"
+    "  %s [-qvf] --manifest robots.txt [filename]\n"
+    "--or--\n"
+    "  %s --dry-run [-f] [--baud rate] filename\n"
+    "--or--\n"
+#ifdef __WIN32__
+    "  %s [--slots n] --switch n COM1\n"
 #else
-    "  %s [-qf] filename /dev/tty.usbserial\n"
+    "  %s [--slots n] --switch n /dev/tty.usbserial\n"
 #endif
     "--or--\n"
     "  %s -h\n"
@@ -788,10 +1079,59 @@ void showHelp(char *programName) {
     "  %s -x /dev/tty/usbserial\n"
 #endif
     "\n"
-    "    -q        Quiet mode\n"
+    "    -q        Quiet mode, only what's always worth knowing (-qq for errors)\n"
+    "    -v        Verbose mode, each step of the handshake and its timings\n"
     "    -f        Force full flash\n"
     "    -x        Enter VEX user program mode (using C9 commands)\n"
     "    -h        Show this help\n"
+    "    -         Read the file from stdin once the robot is in the bootloader.\n"
+    "              With -f, Intel HEX is flashed as it arrives\n"
+    "    --dry-run Print the flash plan with its estimated cost, without a device\n"
+    "    --no-restart\n"
+    "              Leave the robot in the bootloader after flashing, and don't\n"
+    "              touch it at all if the file is what was last flashed\n"
+    "    --no-verify Skip reading back the pages erased and written\n"
+    "    --baud    Serial baud rate (default 115200)\n"
+    "    --progress auto|bar|json|none\n"
+    "              How progress is shown: a bar with the rate and time left,\n"
+    "              or a JSON object per line on stdout for tools, messages\n"
+    "              included (default auto, a bar on a terminal unless -q)\n"
+    "    --strategy auto|full|diff|readback\n"
+    "              Pick between a full and a differential flash by estimated\n"
+    "              time (default auto, -f is the same as full). Without a\n"
+    "              usable cache, auto reads the device back when that's\n"
+    "              cheaper and readback always does\n"
+    "    --region start:length\n"
+    "              Only flash the pages of this address range, leaving the\n"
+    "              rest of flash as it is\n"
+    "    --base address\n"
+    "              Where a binary file goes (default the start of flash)\n"
+    "    --fill bytes\n"
+    "              Byte values, such as 0xff,0x00, which only pad a binary\n"
+    "              file in runs of 1K or more, leaving the pages under them\n"
+    "              alone (default 0xff, or none)\n"
+    "    --section name\n"
+    "              Only flash the pages of this section or symbol (ELF files)\n"
+    "    --slot n  Flash the file, linked to run from slot n, into that slot\n"
+    "              and make it the one that boots\n"
+    "    --switch n\n"
+    "              Make slot n the one that boots, without flashing a file\n"
+    "    --slots n Number of slots flash is split into (default 3)\n"
+    "    --manifest file\n"
+    "              Robots to flash, a port on each line followed by the file\n"
+    "              flashed to it if it isn't the one given. Like several\n"
+    "              ports, they're all flashed at once\n"
+    "    --daemon  Keep running, flashing the file again whenever it's rebuilt\n"
+    "              or a client on the socket asks (Linux only)\n"
+    "    --socket path\n"
+    "              Where the daemon listens (default\n"
+    "              $XDG_RUNTIME_DIR/cortexflash.sock)\n"
+    "    --cache-dir Where images flashed to each device are kept (default\n"
+#ifdef __WIN32__
+    "              %%LOCALAPPDATA%%\\cortexflash)\n"
+#else
+    "              $XDG_CACHE_HOME/cortexflash or ~/.cache/cortexflash)\n"
+#endif
     "\n"
     "Examples:\n"
     "    Get device information:\n"
@@ -806,28 +1146,48 @@ void showHelp(char *programName) {
     "      %s filename COM1\n"
 #else
     "      %s filename /dev/tty.usbserial\n"
+#endif
+    "\n"
+    "    Flash a program while objcopy is still writing it:\n"
+#ifdef __WIN32__
+    "      arm-none-eabi-objcopy -O ihex main.elf - | %s -f - COM1\n"
+#else
+    "      arm-none-eabi-objcopy -O ihex main.elf /dev/stdout | %s -f - /dev/tty.usbserial\n"
 #endif
     "",
     programName,
     programName,
     programName,
     programName,
+    programName,
+    programName,
+    programName,
+    programName,
     programName
   );
 }
 
 void cleanup() {
-  uSleep(20000);
+  // The file may still be being parsed, and the cache preloaded, on failing to reach the robot
+  if(prepare.running) {
+    const uint8_t *fileData;
+    size_t fileSize;
 
-  if(cacheParser.storage)
-    cacheParser.parser->close(cacheParser.storage);
+    finishPrepare(&fileData, &fileSize);
+  }
 
-  if(fileParser.storage)
-    fileParser.parser->close(fileParser.storage);
+  // Closing finishes the flash, which may still need the image
+  cortexflash_close(session);
+  session = NULL;
+
+  progress_stop();
 
-  if(stm)
-    stm32_close(stm);
+  free(cacheData);
+  free(placedData);
+  free(segmentList);
+  cacheData = placedData = NULL;
+  segmentList = NULL;
 
-  if(serial)
-    serial_close(serial);
+  if(fileParser.storage)
+    fileParser.parser->close(fileParser.storage);
 }
@@ -6,30 +6,69 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 
+#include "cortexflash.h"
 #include "serial.h"
 #include "stm32.h"
+#include "cache.h"
 #include "parser.h"
+#include "slot.h"
+#include "multi.h"
+#include "daemon.h"
+#include "progress.h"
 
+// Work on the file which needs nothing from the device, run on a thread while the handshake is under way
+typedef struct {
+  pthread_t thread;
+  bool running, threaded;
+  // What the thread leaves behind: the file placed in flash and whether it's already on the last device
+  bool ok, unchanged;
+  const uint8_t *fileData;
+  size_t fileSize;
+  double time;
+} prepare_t;
+
+// A file parsed for some of the robots being flashed
+typedef struct {
+  const char *file;
+  parserPackage_t parser;
+  uint8_t *placed;
+  const uint8_t *data;
+  size_t size;
+  uint32_t regionAddress;
+  size_t regionLen;
+} image_t;
+
+
+void onInterrupt(int signal);
+bool onProgress(void *context, cortexflashStage_t stage, size_t done, size_t total);
+void onLog(void *context, cortexflashLog_t level, const char *message);
+void logPlan(cortexflashLog_t level);
 void beginTimer();
 double endTimer();
 int main(int argc, char* argv[]);
 bool parseOptions(int argc, char* argv[]);
+bool parseWordOption(char *arg, int argc, char *argv[], int *iArg);
 void showHelp(char *programName);
 void cleanup();
-bool testBootloader();
-int init();
-bool getSystemStatus();
-void enterUserProgram();
+void *prepareFile(void *context);
+void startPrepare();
+bool finishPrepare(const uint8_t **fileData, size_t *fileSize);
+bool flashMany(const uint8_t **fileData, size_t *fileSize, int *exitCode);
+int runDaemon();
+void daemonFlash(daemon_t *daemon, char *status, size_t statusLen, image_t *last);
+void daemonStatus(char *status, size_t statusLen, const char *state, const char *tail);
+bool parseImage(image_t *image, char *path);
+void useImage(const image_t *image, const uint8_t **fileData, size_t *fileSize);
+void freeImage(image_t *image);
+bool openFile(const uint8_t **fileData, size_t *fileSize);
+bool streamFile();
+bool openSession();
+bool flashConnected(const uint8_t *fileData, size_t fileSize, bool unchanged);
+bool buildTarget(cortexflashTarget_t *target, const uint8_t *fileData, size_t fileSize);
+bool isUnchanged(const uint8_t *fileData, size_t fileSize);
+bool placeFile(const stm32_dev_t *dev, const uint8_t **fileData, size_t *fileSize);
 
-struct timespec _time = {0};
 struct timeval startTime, endTime;
-
-#define nSleep(t) _time.tv_nsec = t; nanosleep(&_time, NULL)
-#define uSleep(t) nSleep(t * 1000)
-
-typedef struct {
-  off_t offset;
-  short len;
-  bool clear;
-} diff_t;
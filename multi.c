@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifndef __WIN32__
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
+#include "multi.h"
+
+// Where a child reports its result, and what it reports
+static int resultFd = -1;
+static const multiResult_t *reported;
+
+static char *copyWord(const char *start, size_t len) {
+  char *word = malloc(len + 1);
+
+  if(word) {
+    memcpy(word, start, len);
+    word[len] = 0;
+  }
+
+  return word;
+}
+
+bool multi_load_manifest(const char *path, multiTarget_t *targets, size_t *count) {
+  char line[1024], *at, *end;
+  FILE *in = fopen(path, "r");
+  multiTarget_t *target;
+
+  if(!in)
+    return false;
+
+  while(fgets(line, sizeof(line), in)) {
+    for(at = line; *at == ' ' || *at == '\t'; at++);
+    if(*at == '#' || *at == '\n' || *at == '\r' || *at == 0)
+      continue;
+
+    if(*count >= MULTI_MAX) {
+      fprintf(stderr, "Manifest %s lists more than %i robots\n", path, MULTI_MAX);
+      fclose(in);
+      return false;
+    }
+
+    target = &targets[(*count)++];
+    memset(target, 0, sizeof(multiTarget_t));
+
+    for(end = at; *end && !strchr(" \t\r\n", *end); end++);
+    target->port = copyWord(at, end - at);
+
+    for(at = end; *at == ' ' || *at == '\t'; at++);
+    for(end = at; *end && !strchr("\r\n", *end); end++);
+    while(end > at && (end[-1] == ' ' || end[-1] == '\t'))
+      end--;
+    if(end > at)
+      target->file = copyWord(at, end - at);
+  }
+
+  fclose(in);
+  return true;
+}
+
+static double now(void) {
+  struct timeval time;
+
+  gettimeofday(&time, NULL);
+  return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+#ifdef __WIN32__
+
+int multi_run(multiTarget_t *targets, size_t count, const multiResult_t *result) {
+  size_t i;
+
+  fprintf(stderr, "Flashing several robots at once needs fork, which Windows doesn't have\n");
+
+  for(i = 0; i < count; i++)
+    targets[i].status = -1;
+
+  return -1;
+}
+
+#else
+
+static void report(void) {
+  if(resultFd >= 0 && write(resultFd, reported, sizeof(multiResult_t)) != sizeof(multiResult_t))
+    resultFd = -1;
+}
+
+// Prints whole lines of a child's output behind its port, and the rest once it's finished
+static void printOutput(multiTarget_t *target, int width, bool flush) {
+  char *start = target->line, *end = target->line + target->lineLen, *newline;
+
+  while((newline = memchr(start, '\n', end - start)) || (flush && start < end)) {
+    if(!newline)
+      newline = end;
+
+    if(newline > start && !(newline - start == 1 && *start == '\r'))
+      printf("%-*s | %.*s\n", width, target->port, (int)(newline - start), start);
+    start = newline < end ? newline + 1 : end;
+  }
+
+  target->lineLen = end - start;
+  memmove(target->line, start, target->lineLen);
+}
+
+int multi_run(multiTarget_t *targets, size_t count, const multiResult_t *result) {
+  struct pollfd *polls;
+  multiTarget_t *target;
+  int output[2], results[2], width = 0, open = 0, status;
+  size_t i, j;
+  ssize_t got;
+  double start = now();
+
+  polls = calloc(count, sizeof(struct pollfd));
+  if(!polls)
+    return -1;
+
+  for(i = 0; i < count; i++)
+    if(strlen(targets[i].port) > width)
+      width = strlen(targets[i].port);
+
+  fflush(stdout);
+  fflush(stderr);
+
+  for(i = 0; i < count; i++) {
+    target = &targets[i];
+    target->pid = -1;
+    target->output = target->results = -1;
+    target->status = -1;
+    results[0] = results[1] = -1;
+
+    if(pipe(output) != 0)
+      output[0] = output[1] = -1;
+    else if(pipe(results) != 0)
+      results[0] = results[1] = -1;
+    else
+      target->pid = fork();
+
+    if(target->pid < 0) {
+      fprintf(stderr, "Could not start flashing %s: %s\n", target->port, strerror(errno));
+      for(j = 0; j < 2; j++) {
+        if(output[j] >= 0)
+          close(output[j]);
+        if(results[j] >= 0)
+          close(results[j]);
+      }
+      continue;
+    }
+
+    if(target->pid == 0) {
+      // The child's output all goes through the parent, which can only tell its lines apart once they're whole
+      dup2(output[1], STDOUT_FILENO);
+      dup2(output[1], STDERR_FILENO);
+      setvbuf(stdout, NULL, _IOLBF, 0);
+
+      for(j = 0; j < i; j++) {
+        close(targets[j].output);
+        close(targets[j].results);
+      }
+      close(output[0]);
+      close(output[1]);
+      close(results[0]);
+      free(polls);
+
+      resultFd = results[1];
+      reported = result;
+      atexit(report);
+
+      return i;
+    }
+
+    close(output[1]);
+    close(results[1]);
+    target->output = output[0];
+    target->results = results[0];
+    open++;
+  }
+
+  // ^C reaches every child, which finish their journals, so only they should act on it
+  signal(SIGINT, SIG_IGN);
+
+  while(open > 0) {
+    for(i = 0; i < count; i++) {
+      polls[i].fd = targets[i].output;
+      polls[i].events = POLLIN;
+    }
+
+    if(poll(polls, count, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+
+    for(i = 0; i < count; i++) {
+      target = &targets[i];
+      if(target->output < 0 || !(polls[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      got = read(target->output, target->line + target->lineLen, sizeof(target->line) - target->lineLen);
+      if(got > 0) {
+        target->lineLen += got;
+        printOutput(target, width, target->lineLen == sizeof(target->line));
+        continue;
+      }
+
+      // The child has exited, or at least closed its output
+      printOutput(target, width, true);
+      target->time = now() - start;
+      close(target->output);
+      target->output = -1;
+      open--;
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    target = &targets[i];
+    if(target->pid <= 0)
+      continue;
+
+    if(waitpid(target->pid, &status, 0) == target->pid)
+      target->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    if(read(target->results, &target->result, sizeof(multiResult_t)) != sizeof(multiResult_t))
+      memset(&target->result, 0, sizeof(multiResult_t));
+    close(target->results);
+  }
+
+  signal(SIGINT, SIG_DFL);
+  fflush(stdout);
+  free(polls);
+  return -1;
+}
+
+#endif
+
+void multi_summary(const multiTarget_t *targets, size_t count, double time, FILE *out) {
+  const multiTarget_t *target;
+  size_t i, ok = 0;
+  int width = 4;
+  double slowest = 0;
+
+  for(i = 0; i < count; i++)
+    if(strlen(targets[i].port) > width)
+      width = strlen(targets[i].port);
+
+  fprintf(out, "\n%-*s  %-8s %9s %10s %6s\n", width, "Port", "Result", "Time", "Written", "Pages");
+
+  for(i = 0; i < count; i++) {
+    target = &targets[i];
+
+    if(target->status == 0)
+      ok++;
+    if(target->time > slowest)
+      slowest = target->time;
+
+    fprintf(out, "%-*s  %-8s %8.1fs %10lu %6lu\n", width, target->port,
+      target->status != 0 ? "failed" : target->result.flashed ? "flashed" : "ok",
+      target->time, (unsigned long)target->result.bytes, (unsigned long)target->result.pages);
+  }
+
+  fprintf(out, "\n%lu of %lu robots done in %.1fs, the slowest taking %.1fs\n",
+    (unsigned long)ok, (unsigned long)count, time, slowest);
+}
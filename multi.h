@@ -0,0 +1,52 @@
+#ifndef _MULTI_H
+#define _MULTI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Robots flashed by one run at most
+#define MULTI_MAX 32
+// Longest line of a robot's output printed in one piece
+#define MULTI_LINE 512
+
+// What a robot's process flashed, sent back to the parent as it exits
+typedef struct {
+  bool flashed;
+  size_t bytes, frames, pages;
+} multiResult_t;
+
+typedef struct {
+  char *port;
+  // File flashed to the port, NULL for the one given on the command line
+  char *file;
+
+  // Filled in by multi_run
+  pid_t pid;
+  int output, results;
+  char line[MULTI_LINE];
+  size_t lineLen;
+  double time;
+  int status;
+  multiResult_t result;
+} multiTarget_t;
+
+/*
+  Reads a manifest of targets, a port on each line followed by the file
+  flashed to it if it isn't the one given on the command line. Blank lines
+  and lines starting with # are skipped.
+*/
+bool multi_load_manifest(const char *path, multiTarget_t *targets, size_t *count);
+
+/*
+  Forks a process for every target, which returns its index in the targets
+  and reports result to this one as it exits. Here each child's output is
+  printed a line at a time behind its port until every one has finished,
+  and -1 returned.
+*/
+int multi_run(multiTarget_t *targets, size_t count, const multiResult_t *result);
+
+void multi_summary(const multiTarget_t *targets, size_t count, double time, FILE *out);
+
+#endif
@@ -1,10 +1,60 @@
+#include <pthread.h>
+
 #include "parser.h"
 
-static parser_t hexParser = {hex_open, hex_close, hex_size, hex_read};
-static parser_t binParser = {bin_open, bin_close, bin_size, bin_read};
+static parser_t hexParser = {hex_open, hex_close, hex_size, hex_read, hex_view, hex_segments, hex_section};
+static parser_t binParser = {bin_open, bin_close, bin_size, bin_read, bin_view, bin_segments, bin_section};
+static parser_t elfParser = {elf_open, elf_close, elf_size, elf_read, elf_view, elf_segments, elf_section};
+
+void parser_default_options(parserOptions_t *options) {
+  memset(options, 0, sizeof(parserOptions_t));
+
+  // Erased flash reads as 0xff, so padding of it never needs to be flashed
+  options->fill[0xff] = 1;
+}
+
+static bool hasExtension(const char *filename, const char *extension) {
+  size_t len = strlen(filename), extensionLen = strlen(extension);
+
+  return len > extensionLen && strcasecmp(filename + len - extensionLen, extension) == 0;
+}
+
+parserType_t parser_detect(const char *filename) {
+  uint8_t start[4] = {0};
+  const uint8_t *data;
+  size_t len;
+  int fd;
+
+  if(hasExtension(filename, ".hex") || hasExtension(filename, ".ihex") || hasExtension(filename, ".ihx"))
+    return kStorageType_hex;
+  if(hasExtension(filename, ".bin"))
+    return kStorageType_bin;
+  if(hasExtension(filename, ".elf") || hasExtension(filename, ".axf"))
+    return kStorageType_elf;
+
+  // Every Intel HEX record starts with a colon and ELF files with their magic, neither of which a vector table does
+  if(parser_is_stdin(filename)) {
+    for(data = parser_stdin_data(&len); len < sizeof(start) && parser_stdin_fill(); data = parser_stdin_data(&len));
+
+    memcpy(start, data, len < sizeof(start) ? len : sizeof(start));
+  } else if((fd = open(filename, O_RDONLY | O_BINARY)) >= 0) {
+    if(read(fd, start, sizeof(start)) != sizeof(start))
+      memset(start, 0, sizeof(start));
+    close(fd);
+  }
 
-parserPackage_t initParser(parserType_t parserType) {
+  if(memcmp(start, "\x7f" "ELF", 4) == 0)
+    return kStorageType_elf;
+
+  return start[0] == ':' ? kStorageType_hex : kStorageType_bin;
+}
+
+parserPackage_t initParser(parserType_t parserType, const char *filename, const parserOptions_t *options) {
   parserPackage_t ret = {0};
+  binStorage_t *bin;
+
+  if(parserType == kStorageType_auto)
+    parserType = parser_detect(filename);
 
   switch(parserType) {
     case kStorageType_hex:
@@ -13,190 +63,868 @@ parserPackage_t initParser(parserType_t parserType) {
       return ret;
     case kStorageType_bin:
       ret.parser = &binParser;
-      ret.storage = calloc(sizeof(binStorage_t), 1);
+      ret.storage = bin = calloc(sizeof(binStorage_t), 1);
+      if(bin) {
+        if(options)
+          bin->options = *options;
+        else
+          parser_default_options(&bin->options);
+      }
+      return ret;
+    case kStorageType_elf:
+      ret.parser = &elfParser;
+      ret.storage = calloc(sizeof(elfStorage_t), 1);
       return ret;
+    case kStorageType_auto:
+      break;
   }
 
   return ret;
 }
 
-parserError_t hex_open(void *storage, const char *filename) {
-  hexStorage_t *st = storage;
-  char mark, buffer[9];
-  int i, fd, e;
-  uint8_t checksum;
-  uint32_t base = 0;
-  unsigned int c, last_address = 0x0;
+// Makes room for count items of size, doubling the buffer as it fills
+static bool reserve(void **buffer, size_t *capacity, size_t count, size_t size) {
+  void *grown;
+  size_t items = *capacity ? *capacity : 4096 / size;
 
-  unsigned int reclen, address, type;
-  uint8_t *record;
+  if(count <= *capacity)
+    return true;
+
+  while(items < count)
+    items *= 2;
+
+  grown = realloc(*buffer, items * size);
+  if(!grown)
+    return false;
+
+  *buffer = grown;
+  *capacity = items;
+  return true;
+}
+
+// What has been read of stdin and not consumed yet, from pos to len
+static struct {
+  uint8_t *data;
+  size_t pos, len, capacity;
+  bool ended;
+} input;
+
+// All of stdin, once it's been opened as a file
+static uint8_t *inputFile;
+
+bool parser_is_stdin(const char *filename) {
+  return strcmp(filename, "-") == 0;
+}
+
+bool parser_stdin_fill(void) {
+  ssize_t got;
+
+  if(input.ended)
+    return false;
+
+#ifdef __WIN32__
+  setmode(0, O_BINARY);
+#endif
+
+  // Consumed input makes room for the next chunk, so the buffer only grows to hold what's unused
+  if(input.pos > 0) {
+    memmove(input.data, input.data + input.pos, input.len - input.pos);
+    input.len -= input.pos;
+    input.pos = 0;
+  }
+
+  if(!reserve((void **)&input.data, &input.capacity, input.len + PARSER_STDIN_CHUNK, 1))
+    return false;
+
+  got = read(0, input.data + input.len, PARSER_STDIN_CHUNK);
+  if(got <= 0) {
+    input.ended = true;
+    return false;
+  }
 
-  fd = open(filename, O_RDONLY);
+  input.len += got;
+  return true;
+}
+
+const uint8_t *parser_stdin_data(size_t *len) {
+  *len = input.len - input.pos;
+  return input.data + input.pos;
+}
+
+void parser_stdin_consume(size_t len) {
+  input.pos += len;
+}
+
+// Reads the rest of stdin and hands its buffer over as the file
+static bool readStdin(const uint8_t **data, size_t *len) {
+  while(parser_stdin_fill());
+
+  if(input.pos > 0)
+    memmove(input.data, input.data + input.pos, input.len - input.pos);
+  *len = input.len - input.pos;
+  *data = inputFile = *len ? input.data : NULL;
+
+  if(!inputFile)
+    free(input.data);
+
+  memset(&input, 0, sizeof(input));
+  input.ended = true;
+  return true;
+}
+
+// Maps a whole file read-only, falling back to reading it where there's no mmap
+static bool mapFile(const char *filename, const uint8_t **data, size_t *len) {
+  struct stat info;
+  uint8_t *buffer;
+  int fd;
+
+  if(parser_is_stdin(filename))
+    return readStdin(data, len);
+
+  fd = open(filename, O_RDONLY | O_BINARY);
   if(fd < 0)
+    return false;
+
+  if(fstat(fd, &info) != 0)
+    goto eFail;
+
+  *len = info.st_size;
+  // An empty file maps to nothing, which callers treat as any other short file
+  if(*len == 0) {
+    *data = NULL;
+    close(fd);
+    return true;
+  }
+
+#ifdef __WIN32__
+  buffer = malloc(*len);
+  if(!buffer || read(fd, buffer, *len) != *len) {
+    free(buffer);
+    goto eFail;
+  }
+#else
+  buffer = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(buffer == MAP_FAILED)
+    goto eFail;
+  madvise(buffer, *len, MADV_SEQUENTIAL);
+#endif
+
+  close(fd);
+  *data = buffer;
+  return true;
+
+eFail:
+  close(fd);
+  return false;
+}
+
+static void unmapFile(const uint8_t *data, size_t len) {
+  if(!data)
+    return;
+
+  if(data == inputFile) {
+    free(inputFile);
+    inputFile = NULL;
+    return;
+  }
+
+#ifdef __WIN32__
+  free((void *)data);
+#else
+  munmap((void *)data, len);
+#endif
+}
+
+/*
+  Builds the view from the first segment to the end of the last. When the
+  segments lie in memory as they do in flash, with only erased bytes between
+  them, that's where the view points, otherwise they're copied.
+*/
+static bool flattenSegments(parserView_t *view, const parserSegment_t *segments, size_t count) {
+  const parserSegment_t *first = segments, *last = segments + count - 1;
+  const uint8_t *at, *end;
+  size_t i;
+
+  if(view->built)
+    return true;
+
+  if(count == 0) {
+    view->built = true;
+    return true;
+  }
+
+  view->len = last->address + last->len - first->address;
+
+  for(i = 0; i + 1 < count; i++) {
+    if(segments[i + 1].data - first->data != segments[i + 1].address - first->address)
+      break;
+
+    end = segments[i + 1].data;
+    for(at = segments[i].data + segments[i].len; at < end && *at == 0xff; at++);
+    if(at < end)
+      break;
+  }
+
+  if(i + 1 >= count) {
+    view->data = first->data;
+    view->built = true;
+    return true;
+  }
+
+  view->copy = malloc(view->len);
+  if(!view->copy)
+    return false;
+
+  memset(view->copy, 0xff, view->len);
+  for(i = 0; i < count; i++)
+    memcpy(view->copy + (segments[i].address - first->address), segments[i].data, segments[i].len);
+
+  view->data = view->copy;
+  view->built = true;
+  return true;
+}
+
+static parserError_t viewSize(parserView_t *view, const parserSegment_t *segments, size_t count) {
+  if(!flattenSegments(view, segments, count))
+    return 0;
+
+  return view->len;
+}
+
+static parserError_t viewRead(parserView_t *view, const parserSegment_t *segments, size_t count, void *data, size_t offset, size_t *len) {
+  size_t get;
+
+  if(!flattenSegments(view, segments, count) || offset > view->len)
     return kParserError_system;
 
-  // Read in the file
-  while(read(fd, &mark, 1) != 0) {
-    // Skip newline characters
-    if(mark == '\n' || mark == '\r')
-      continue;
+  get = view->len - offset;
+  get = get > *len ? *len : get;
+
+  memcpy(data, view->data + offset, get);
+  *len = get;
+
+  return kParserError_none;
+}
+
+static parserError_t viewGet(parserView_t *view, const parserSegment_t *segments, size_t count, const uint8_t **data, size_t *len) {
+  if(!flattenSegments(view, segments, count))
+    return kParserError_system;
+
+  *data = view->data;
+  *len = view->len;
+
+  return kParserError_none;
+}
 
-    // Make sure line starts with ':'
-    if(mark != ':')
-      goto eBadFile;
-
-    // Get the reclen, address, and type
-    buffer[8] = 0;
-    e = read(fd, &buffer, 8);
-    // Make sure 8 bytes are read
-    if(e != 8)
-      goto eBadFile;
-    e = sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type);
-    // Make sure 3 variables were read
-    if(e != 3)
-      goto eBadFile;
-
-    // Setup the checksum
-    checksum = reclen + ((address & 0xff00) >> 8) + ((address & 0x00ff) >> 0) + type;
-
-    switch(type) {
-      // Data record
-      case 0:
-        c = address - last_address;
-        st->data = realloc(st->data, st->data_len + c + reclen);
-
-        // If there is a gap, set it to 0xff and increment the length
-        if(c > 0) {
-          memset(&st->data[st->data_len], 0xff, c);
-          st->data_len += c;
-        }
-
-        last_address = address + reclen;
-        record = &st->data[st->data_len];
-        st->data_len += reclen;
-        break;
-
-      // Extended segment address record
-      case 2:
-        base = 0;
-        break;
-
-      // Extended linear address recorc
-      case 4:
-        base = address;
-        break;
+/*
+  Byte value of every pair of characters, read as a native 16-bit word, with
+  HEX_BAD set for pairs which aren't two hex digits
+*/
+#define HEX_BAD 0x100
+static uint16_t hexPairs[0x10000];
+// Built once, whichever thread parses first
+static pthread_once_t hexPairsOnce = PTHREAD_ONCE_INIT;
+
+static void buildHexPairs(void) {
+  uint8_t digits[256], pair[2];
+  uint16_t word;
+  int hi, lo;
+
+  memset(digits, 0xff, sizeof(digits));
+  for(hi = 0; hi < 10; hi++)
+    digits['0' + hi] = hi;
+  for(hi = 0; hi < 6; hi++)
+    digits['a' + hi] = digits['A' + hi] = 10 + hi;
+
+  for(hi = 0; hi < 256; hi++) {
+    for(lo = 0; lo < 256; lo++) {
+      pair[0] = hi;
+      pair[1] = lo;
+      memcpy(&word, pair, 2);
+      hexPairs[word] = digits[hi] > 0xf || digits[lo] > 0xf ? HEX_BAD : (digits[hi] << 4) | digits[lo];
     }
+  }
+}
 
-    // Force end of string
-    buffer[2] = 0;
+/*
+  Decodes count bytes of hex text into out, returning their sum. Bad digits
+  are collected in bad rather than checked byte by byte, so a record is
+  validated once it's decoded.
+*/
+static uint8_t decodeHex(const uint8_t *text, uint8_t *out, size_t count, uint16_t *bad) {
+  uint16_t word, value, errors = 0;
+  uint8_t sum = 0;
+  size_t i;
+
+  for(i = 0; i < count; i++) {
+    memcpy(&word, text + i * 2, 2);
+    value = hexPairs[word];
+    errors |= value;
+    out[i] = value;
+    sum += value;
+  }
 
-    for(i=0; i<reclen; i++) {
-      e = read(fd, &buffer, 2);
-      if(e != 2)
-        goto eBadFile;
+  *bad |= errors;
+  return sum;
+}
 
-      e = sscanf(buffer, "%2x", &c);
-      if(e != 1)
-        goto eBadFile;
+// A data record, its bytes at offset in the decoded data
+typedef struct {
+  uint32_t address;
+  size_t offset, len;
+} hexRecord_t;
 
-      // Add the byte to the checksum
-      checksum += c;
+static int compareRecords(const void *a, const void *b) {
+  const hexRecord_t *x = a, *y = b;
 
-      switch(type) {
-        case 0:
-          record[i] = c;
-        break;
+  return x->address < y->address ? -1 : x->address > y->address;
+}
 
-        case 2:
-        case 4:
-          base = (base << 8) | c;
-        break;
-      }
+/*
+  Joins records following each other into segments. Records out of order
+  are sorted and their data gathered into address order first, and records
+  which overlap can't both be flashed, so make the file invalid.
+*/
+static parserError_t buildSegments(hexStorage_t *st, hexRecord_t *records, size_t count, bool sorted) {
+  parserSegment_t *segment = NULL;
+  uint8_t *gathered;
+  size_t i, offset;
+
+  if(!sorted) {
+    qsort(records, count, sizeof(hexRecord_t), compareRecords);
+
+    gathered = malloc(st->raw_len ? st->raw_len : 1);
+    if(!gathered)
+      return kParserError_system;
+
+    for(offset = 0, i = 0; i < count; offset += records[i].len, i++) {
+      memcpy(gathered + offset, st->raw + records[i].offset, records[i].len);
+      records[i].offset = offset;
     }
 
-    e = read(fd, &buffer, 2);
-    if(e != 2)
-      goto eBadFile;
-    e = sscanf(buffer, "%2x", &c);
-    if(e != 1)
-      goto eBadFile;
-    if((uint8_t)(checksum + c) != 0x00)
-      goto eBadFile;
-
-    switch(type) {
-      // End of File
-      case 1:
-        close(fd);
-        return kParserError_none;
-
-      case 2:
-        base = base << 4;
-      case 4:
-        base = be_u32(base);
-        // Reset last_address since our base changed
-        last_address = 0;
-
-        if(st->base == 0) {
-          st->base = base;
-          break;
-        }
-
-        // We can't cope with files out of order
-        if(base < st->base)
-          goto eBadFile;
-
-        // if there is a gap, enlarge and fill with zeros
-        unsigned int len = base - st->base;
-        if(len > st->data_len) {
-          st->data = realloc(st->data, len);
-          memset(&st->data[st->data_len], 0, len - st->data_len);
-          st->data_len = len;
-        }
-        break;
+    free(st->raw);
+    st->raw = gathered;
+  }
+
+  st->segments = malloc(sizeof(parserSegment_t) * (count ? count : 1));
+  if(!st->segments)
+    return kParserError_system;
+
+  for(i = 0; i < count; i++) {
+    if(segment && records[i].address < segment->address + segment->len)
+      return kParserError_invalidFile;
+
+    if(segment && records[i].address == segment->address + segment->len) {
+      segment->len += records[i].len;
+      continue;
     }
+
+    segment = &st->segments[st->segment_count++];
+    segment->address = records[i].address;
+    segment->len = records[i].len;
+    segment->data = st->raw + records[i].offset;
   }
 
-  close(fd);
   return kParserError_none;
+}
 
-eBadFile:
-  close(fd);
-  return kParserError_invalidFile;
+long hex_decode(hexDecoder_t *decoder, const uint8_t *text, size_t textLen, uint8_t *data, uint32_t *address, size_t *len) {
+  const uint8_t *at = text, *end = text + textLen;
+  uint8_t header[4], trailer, checksum;
+  uint16_t bad = 0;
+  unsigned int reclen, type;
+
+  *len = 0;
+
+  // Skip newline characters
+  while(at < end && (*at == '\n' || *at == '\r'))
+    at++;
+  if(at == end)
+    return at - text;
+
+  // Make sure line starts with ':' and holds at least the reclen, address and type
+  if(*at != ':')
+    return -1;
+  if(end - at < 11)
+    return 0;
+
+  pthread_once(&hexPairsOnce, buildHexPairs);
+
+  checksum = decodeHex(at + 1, header, 4, &bad);
+  reclen = header[0];
+  type = header[3];
+
+  if(end - at < 11 + reclen * 2)
+    return 0;
+
+  checksum += decodeHex(at + 9, data, reclen, &bad);
+  checksum += decodeHex(at + 9 + reclen * 2, &trailer, 1, &bad);
+  if(bad & HEX_BAD || checksum != 0x00)
+    return -1;
+
+  switch(type) {
+    // Data record
+    case 0:
+      *address = decoder->base + ((header[1] << 8) | header[2]);
+      *len = reclen;
+      break;
+
+    // End of File
+    case 1:
+      decoder->done = true;
+      break;
+
+    // Extended segment address record
+    case 2:
+    // Extended linear address record
+    case 4:
+      if(reclen != 2)
+        return -1;
+
+      decoder->base = ((data[0] << 8) | data[1]) << (type == 2 ? 4 : 16);
+      break;
+
+    // Other records only need their checksum
+  }
+
+  return at + 11 + reclen * 2 - text;
+}
+
+parserError_t hex_open(void *storage, const char *filename) {
+  hexStorage_t *st = storage;
+  const uint8_t *file, *at, *end;
+  hexDecoder_t decoder = {0};
+  hexRecord_t *records = NULL;
+  size_t fileLen, rawCapacity = 0, recordCapacity = 0, count = 0, reclen;
+  uint32_t address, next = 0;
+  long used;
+  bool sorted = true;
+  parserError_t result = kParserError_invalidFile;
+
+  if(!mapFile(filename, &file, &fileLen))
+    return kParserError_system;
+
+  // Every data byte takes two characters, so half the file holds every record
+  if(!reserve((void **)&st->raw, &rawCapacity, fileLen / 2 + 1, 1)) {
+    result = kParserError_system;
+    goto eDone;
+  }
+
+  at = file;
+  end = file + fileLen;
+
+  // Records decode straight into the raw data, which only keeps them if they're data records
+  while(at < end && !decoder.done) {
+    used = hex_decode(&decoder, at, end - at, st->raw + st->raw_len, &address, &reclen);
+    if(used <= 0)
+      goto eDone;
+
+    at += used;
+    if(reclen == 0)
+      continue;
+
+    // A record carrying on from the last one just extends it
+    if(count > 0 && address == next) {
+      records[count - 1].len += reclen;
+    } else {
+      if(count > 0 && address < next)
+        sorted = false;
+
+      if(!reserve((void **)&records, &recordCapacity, count + 1, sizeof(hexRecord_t))) {
+        result = kParserError_system;
+        goto eDone;
+      }
+
+      records[count].address = address;
+      records[count].offset = st->raw_len;
+      records[count].len = reclen;
+      count++;
+    }
+
+    st->raw_len += reclen;
+    next = address + reclen;
+  }
+
+  result = buildSegments(st, records, count, sorted);
+
+eDone:
+  free(records);
+  unmapFile(file, fileLen);
+  return result;
 }
 parserError_t hex_close(void *storage) {
   hexStorage_t *st = storage;
-  if(st)
-    free(st->data);
+  if(st) {
+    free(st->raw);
+    free(st->segments);
+    free(st->view.copy);
+  }
   free(st);
   return kParserError_none;
 }
 parserError_t hex_size(void *storage) {
   hexStorage_t *st = storage;
-  return st->data_len;
+  return viewSize(&st->view, st->segments, st->segment_count);
 }
 parserError_t hex_read(void *storage, void *data, size_t offset, size_t *len) {
   hexStorage_t *st = storage;
-  size_t get = st->data_len - st->offset;
-  get = get > *len ? *len : get;
+  return viewRead(&st->view, st->segments, st->segment_count, data, offset, len);
+}
+parserError_t hex_view(void *storage, const uint8_t **data, size_t *len) {
+  hexStorage_t *st = storage;
+  return viewGet(&st->view, st->segments, st->segment_count, data, len);
+}
+parserError_t hex_segments(void *storage, const parserSegment_t **segments, size_t *count) {
+  hexStorage_t *st = storage;
 
-  if(offset > st->data_len)
-    return kParserError_system;
-
-  memcpy(data, &st->data[offset], get);
-  *len = get;
+  *segments = st->segments;
+  *count = st->segment_count;
 
   return kParserError_none;
 }
+// Intel HEX records carry no section names
+parserError_t hex_section(void *storage, const char *name, uint32_t *address, size_t *len) {
+  return kParserError_unsupported;
+}
+
+static void addSegment(binStorage_t *st, size_t start, size_t end) {
+  parserSegment_t *segment;
+
+  if(end <= start)
+    return;
+
+  segment = &st->segments[st->segment_count++];
+  segment->address = st->options.base + start;
+  segment->len = end - start;
+  segment->data = st->map + start;
+}
 
 parserError_t bin_open(void *storage, const char *filename) {
-  return kParserError_system;
+  binStorage_t *st = storage;
+  const uint8_t *fill = st->options.fill;
+  size_t i, end, dataStart = 0;
+
+  if(!mapFile(filename, &st->map, &st->map_len))
+    return kParserError_system;
+
+  if(st->map_len > 0xffffffff - st->options.base)
+    return kParserError_invalidFile;
+
+  // Every segment but the last is followed by a run of fill
+  st->segments = malloc(sizeof(parserSegment_t) * (st->map_len / BIN_FILL_RUN + 1));
+  if(!st->segments)
+    return kParserError_system;
+
+  // Long runs of fill split the file into segments, leaving the pages under them alone
+  for(i = 0; i < st->map_len; i = end) {
+    if(!fill[st->map[i]]) {
+      end = i + 1;
+      continue;
+    }
+
+    for(end = i; end < st->map_len && fill[st->map[end]]; end++);
+
+    if(end - i >= BIN_FILL_RUN) {
+      addSegment(st, dataStart, i);
+      dataStart = end;
+    }
+  }
+
+  addSegment(st, dataStart, st->map_len);
+
+  return kParserError_none;
 }
+
 parserError_t bin_close(void *storage) {
-  return kParserError_system;
+  binStorage_t *st = storage;
+  if(st) {
+    unmapFile(st->map, st->map_len);
+    free(st->segments);
+    free(st->view.copy);
+  }
+  free(st);
+  return kParserError_none;
 }
 parserError_t bin_size(void *storage) {
-  return kParserError_system;
+  binStorage_t *st = storage;
+  return viewSize(&st->view, st->segments, st->segment_count);
 }
 parserError_t bin_read(void *storage, void *data, size_t offset, size_t *len) {
-  return kParserError_system;
+  binStorage_t *st = storage;
+  return viewRead(&st->view, st->segments, st->segment_count, data, offset, len);
+}
+parserError_t bin_view(void *storage, const uint8_t **data, size_t *len) {
+  binStorage_t *st = storage;
+  return viewGet(&st->view, st->segments, st->segment_count, data, len);
+}
+parserError_t bin_segments(void *storage, const parserSegment_t **segments, size_t *count) {
+  binStorage_t *st = storage;
+
+  *segments = st->segments;
+  *count = st->segment_count;
+
+  return kParserError_none;
+}
+// Binary files carry no section names
+parserError_t bin_section(void *storage, const char *name, uint32_t *address, size_t *len) {
+  return kParserError_unsupported;
+}
+
+#define ELF_HEADER_LEN 52
+#define ELF_PROGRAM_HEADER_LEN 32
+#define ELF_SECTION_HEADER_LEN 40
+#define ELF_SYMBOL_LEN 16
+
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_MACHINE_ARM 40
+#define ELF_SEGMENT_LOAD 1
+#define ELF_SECTION_SYMBOLS 2
+#define ELF_SECTION_NOBITS 8
+#define ELF_SECTION_ALLOC 0x2
+#define ELF_SYMBOL_FUNC 2
+
+// ELF files for the Cortex are little endian, whatever the host is
+static uint16_t elf16(const uint8_t *at) {
+  return at[0] | (at[1] << 8);
+}
+
+static uint32_t elf32(const uint8_t *at) {
+  return at[0] | (at[1] << 8) | (at[2] << 16) | ((uint32_t)at[3] << 24);
+}
+
+// Whether a table of count entries of len bytes at offset lies within the file
+static bool elfFits(const elfStorage_t *st, uint32_t offset, uint32_t count, uint32_t len) {
+  return offset <= st->map_len && count <= (st->map_len - offset) / (len ? len : 1);
+}
+
+// A name from the string table at the given section header, or NULL if it isn't one
+static const char *elfString(const elfStorage_t *st, const uint8_t *table, uint32_t index) {
+  uint32_t offset = elf32(table + 16), size = elf32(table + 20);
+
+  if(!elfFits(st, offset, size, 1) || index >= size || !memchr(st->map + offset + index, 0, size - index))
+    return NULL;
+
+  return (const char *)st->map + offset + index;
+}
+
+static int compareSegments(const void *a, const void *b) {
+  const parserSegment_t *x = a, *y = b;
+
+  return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static parserError_t elfSegments(elfStorage_t *st, uint32_t offset, uint32_t count, uint32_t len) {
+  const uint8_t *header;
+  parserSegment_t *segment;
+  uint32_t i, fileOffset, fileLen;
+
+  if(!elfFits(st, offset, count, len) || (count && len < ELF_PROGRAM_HEADER_LEN))
+    return kParserError_invalidFile;
+
+  st->segments = malloc(sizeof(parserSegment_t) * (count ? count : 1));
+  if(!st->segments)
+    return kParserError_system;
+
+  // Only the part of a segment the file holds is flashed, the rest is zeroed at startup
+  for(i = 0; i < count; i++) {
+    header = st->map + offset + i * len;
+    fileOffset = elf32(header + 4);
+    fileLen = elf32(header + 16);
+
+    if(elf32(header) != ELF_SEGMENT_LOAD || fileLen == 0)
+      continue;
+    if(!elfFits(st, fileOffset, fileLen, 1))
+      return kParserError_invalidFile;
+
+    segment = &st->segments[st->segment_count++];
+    segment->address = elf32(header + 12);
+    segment->len = fileLen;
+    segment->data = st->map + fileOffset;
+  }
+
+  qsort(st->segments, st->segment_count, sizeof(parserSegment_t), compareSegments);
+
+  for(i = 0; i + 1 < st->segment_count; i++)
+    if(st->segments[i].address + st->segments[i].len > st->segments[i + 1].address)
+      return kParserError_invalidFile;
+
+  return kParserError_none;
+}
+
+// Where a part of the file lies in flash, if a PT_LOAD segment covers it
+static bool elfLoadOffset(const elfStorage_t *st, const uint8_t *data, size_t len, uint32_t *load) {
+  size_t i;
+
+  for(i = 0; i < st->segment_count; i++) {
+    if(data >= st->segments[i].data && data + len <= st->segments[i].data + st->segments[i].len) {
+      *load = st->segments[i].address + (data - st->segments[i].data);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static parserError_t elfSections(elfStorage_t *st, uint32_t offset, uint32_t count, uint32_t len, uint32_t names) {
+  const uint8_t *header, *symbol, *strings;
+  elfSection_t *section;
+  elfSymbol_t *found;
+  uint32_t i, j, type, symbolOffset, symbolLen, link, symbolCount = 0;
+
+  if(count == 0)
+    return kParserError_none;
+
+  if(!elfFits(st, offset, count, len) || len < ELF_SECTION_HEADER_LEN || names >= count)
+    return kParserError_invalidFile;
+
+  st->sections = calloc(count, sizeof(elfSection_t));
+  if(!st->sections)
+    return kParserError_system;
+
+  for(i = 0; i < count; i++) {
+    header = st->map + offset + i * len;
+    type = elf32(header + 4);
+
+    section = &st->sections[st->section_count++];
+    section->name = elfString(st, st->map + offset + names * len, elf32(header));
+    section->address = elf32(header + 12);
+    section->len = elf32(header + 20);
+
+    if(type != ELF_SECTION_NOBITS && elf32(header + 8) & ELF_SECTION_ALLOC && elfFits(st, elf32(header + 16), section->len, 1))
+      section->loaded = elfLoadOffset(st, st->map + elf32(header + 16), section->len, &section->load);
+
+    if(type == ELF_SECTION_SYMBOLS && elf32(header + 36) >= ELF_SYMBOL_LEN)
+      symbolCount += section->len / elf32(header + 36);
+  }
+
+  st->symbols = malloc(sizeof(elfSymbol_t) * (symbolCount ? symbolCount : 1));
+  if(!st->symbols)
+    return kParserError_system;
+
+  for(i = 0; i < count; i++) {
+    header = st->map + offset + i * len;
+    symbolOffset = elf32(header + 16);
+    symbolLen = elf32(header + 36);
+    link = elf32(header + 24);
+
+    if(elf32(header + 4) != ELF_SECTION_SYMBOLS || symbolLen < ELF_SYMBOL_LEN || link >= count)
+      continue;
+    if(!elfFits(st, symbolOffset, elf32(header + 20) / symbolLen, symbolLen))
+      return kParserError_invalidFile;
+
+    strings = st->map + offset + link * len;
+
+    for(j = 0; j < elf32(header + 20) / symbolLen; j++) {
+      symbol = st->map + symbolOffset + j * symbolLen;
+      if(elf32(symbol + 8) == 0)
+        continue;
+
+      found = &st->symbols[st->symbol_count];
+      found->name = elfString(st, strings, elf32(symbol));
+      found->address = elf32(symbol + 4);
+      found->len = elf32(symbol + 8);
+
+      // Thumb functions have the low bit of their address set
+      if((symbol[12] & 0xf) == ELF_SYMBOL_FUNC)
+        found->address &= ~1;
+
+      if(found->name && found->name[0])
+        st->symbol_count++;
+    }
+  }
+
+  return kParserError_none;
+}
+
+parserError_t elf_open(void *storage, const char *filename) {
+  elfStorage_t *st = storage;
+  const uint8_t *header;
+  parserError_t result;
+
+  if(!mapFile(filename, &st->map, &st->map_len))
+    return kParserError_system;
+
+  header = st->map;
+  if(st->map_len < ELF_HEADER_LEN || memcmp(header, "\x7f" "ELF", 4) != 0)
+    return kParserError_invalidFile;
+
+  // The Cortex is a little endian 32-bit ARM
+  if(header[4] != ELF_CLASS_32 || header[5] != ELF_DATA_LSB || elf16(header + 18) != ELF_MACHINE_ARM)
+    return kParserError_unsupported;
+
+  result = elfSegments(st, elf32(header + 28), elf16(header + 44), elf16(header + 42));
+  if(result != kParserError_none)
+    return result;
+
+  return elfSections(st, elf32(header + 32), elf16(header + 48), elf16(header + 46), elf16(header + 50));
+}
+parserError_t elf_close(void *storage) {
+  elfStorage_t *st = storage;
+  if(st) {
+    unmapFile(st->map, st->map_len);
+    free(st->segments);
+    free(st->view.copy);
+    free(st->sections);
+    free(st->symbols);
+  }
+  free(st);
+  return kParserError_none;
+}
+parserError_t elf_size(void *storage) {
+  elfStorage_t *st = storage;
+  return viewSize(&st->view, st->segments, st->segment_count);
+}
+parserError_t elf_read(void *storage, void *data, size_t offset, size_t *len) {
+  elfStorage_t *st = storage;
+  return viewRead(&st->view, st->segments, st->segment_count, data, offset, len);
+}
+parserError_t elf_view(void *storage, const uint8_t **data, size_t *len) {
+  elfStorage_t *st = storage;
+  return viewGet(&st->view, st->segments, st->segment_count, data, len);
+}
+parserError_t elf_segments(void *storage, const parserSegment_t **segments, size_t *count) {
+  elfStorage_t *st = storage;
+
+  *segments = st->segments;
+  *count = st->segment_count;
+
+  return kParserError_none;
+}
+bool elf_load_address(const elfStorage_t *st, uint32_t address, size_t len, uint32_t *load) {
+  const elfSection_t *section;
+  size_t i;
+
+  // Initialised data runs from RAM but is loaded from flash, which only the sections tell apart
+  for(i = 0; i < st->section_count; i++) {
+    section = &st->sections[i];
+    if(section->loaded && address >= section->address && address + len <= section->address + section->len) {
+      *load = section->load + (address - section->address);
+      return true;
+    }
+  }
+
+  return false;
+}
+// Sections by name first, then symbols, both where they're loaded into flash
+parserError_t elf_section(void *storage, const char *name, uint32_t *address, size_t *len) {
+  elfStorage_t *st = storage;
+  size_t i;
+
+  for(i = 0; i < st->section_count; i++) {
+    if(st->sections[i].loaded && st->sections[i].name && strcmp(st->sections[i].name, name) == 0) {
+      *address = st->sections[i].load;
+      *len = st->sections[i].len;
+      return kParserError_none;
+    }
+  }
+
+  for(i = 0; i < st->symbol_count; i++) {
+    if(strcmp(st->symbols[i].name, name) == 0 && elf_load_address(st, st->symbols[i].address, st->symbols[i].len, address)) {
+      *len = st->symbols[i].len;
+      return kParserError_none;
+    }
+  }
+
+  return kParserError_invalidFile;
 }
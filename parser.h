@@ -1,23 +1,48 @@
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#ifdef __WIN32__
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include "utils.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 typedef enum {
   kParserError_none,
   kParserError_system,
   kParserError_invalidFile,
+  kParserError_unsupported,
 } parserError_t;
 
+// A run of bytes the file gives at an absolute address
+typedef struct {
+  uint32_t address;
+  size_t len;
+  const uint8_t *data;
+} parserSegment_t;
+
 typedef struct {
   parserError_t (*open)(void *storage, const char *filename);
   parserError_t (*close)(void *storage);
   parserError_t (*size)(void *storage);
   parserError_t (*read)(void *storage, void *data, size_t offset, size_t *len);
+  // Read-only view of the whole parsed image from its first segment, gaps erased, valid until close
+  parserError_t (*view)(void *storage, const uint8_t **data, size_t *len);
+  // The segments of the image, sorted by address and valid until close
+  parserError_t (*segments)(void *storage, const parserSegment_t **segments, size_t *count);
+  // Address and length of a named section, for formats which keep them
+  parserError_t (*section)(void *storage, const char *name, uint32_t *address, size_t *len);
 } parser_t;
 typedef struct {
   parser_t *parser;
@@ -25,26 +50,133 @@ typedef struct {
 } parserPackage_t;
 typedef enum {
   kStorageType_hex,
-  kStorageType_bin
+  kStorageType_bin,
+  kStorageType_elf,
+  // Picked from the file's name, or failing that its contents
+  kStorageType_auto
 } parserType_t;
 
+// Only runs of fill bytes at least this long are taken for padding, shorter ones are as likely to be data
+#define BIN_FILL_RUN 1024
+
+// Settings for formats which don't carry them themselves
+typedef struct {
+  // Address the first byte of a binary file goes to
+  uint32_t base;
+  // Non-zero for the byte values which, in long enough runs, only pad a binary file
+  uint8_t fill[256];
+} parserOptions_t;
+
+// The image flattened from its first segment with the gaps erased, only built when asked for
+typedef struct {
+  const uint8_t *data;
+  size_t len;
+  // Only set if the segments couldn't be viewed where they are
+  uint8_t *copy;
+  bool built;
+} parserView_t;
+
 typedef struct {
-  size_t data_len, offset;
-  uint8_t *data, base;
+  // Record data as decoded, in file order
+  uint8_t *raw;
+  size_t raw_len;
+  parserSegment_t *segments;
+  size_t segment_count;
+  parserView_t view;
 } hexStorage_t;
 typedef struct {
-  int fd;
-  char write;
-  struct stat stat;
+  parserOptions_t options;
+  // The mapped file, which segments and usually the view point into
+  const uint8_t *map;
+  size_t map_len;
+  parserSegment_t *segments;
+  size_t segment_count;
+  parserView_t view;
 } binStorage_t;
 
-parserPackage_t initParser(parserType_t parserType);
+// A section of an ELF file, at the address it runs from (VMA) and the one it's loaded to (LMA)
+typedef struct {
+  const char *name;
+  uint32_t address, load;
+  size_t len;
+  // Whether the file holds the section's contents in a loadable segment
+  bool loaded;
+} elfSection_t;
+
+typedef struct {
+  const char *name;
+  uint32_t address;
+  size_t len;
+} elfSymbol_t;
+
+typedef struct {
+  const uint8_t *map;
+  size_t map_len;
+  // The contents of the file's PT_LOAD segments, at their load addresses
+  parserSegment_t *segments;
+  size_t segment_count;
+  parserView_t view;
+  // Kept for picking regions by name and for diagnostics, names pointing into the file
+  elfSection_t *sections;
+  size_t section_count;
+  elfSymbol_t *symbols;
+  size_t symbol_count;
+} elfStorage_t;
+
+// Reads Intel HEX a record at a time, for text which doesn't arrive all at once
+typedef struct {
+  // Address the current extended address record puts records at
+  uint32_t base;
+  // Set once the end of file record has been read
+  bool done;
+} hexDecoder_t;
+
+// Bytes of stdin read at once, when a file is named "-"
+#define PARSER_STDIN_CHUNK 65536
+
+void parser_default_options(parserOptions_t *options);
+parserType_t parser_detect(const char *filename);
+parserPackage_t initParser(parserType_t parserType, const char *filename, const parserOptions_t *options);
+
+/*
+  A file named "-" is read from stdin, which is kept in a buffer until it's
+  consumed. Opening it reads the rest, or it can be taken a piece at a time:
+  fill reads another chunk (returning false at its end or on an error) and
+  consume drops what has been dealt with, so only the unused part is held.
+*/
+bool parser_is_stdin(const char *filename);
+bool parser_stdin_fill(void);
+const uint8_t *parser_stdin_data(size_t *len);
+void parser_stdin_consume(size_t len);
+
+/*
+  Decodes the record at the start of text, and any line breaks before it.
+  Returns the characters used, 0 if text ends before the record does or -1
+  if the record is invalid. Data records leave their bytes in data (room for
+  255) and where they go in address and len, other records set len to 0.
+*/
+long hex_decode(hexDecoder_t *decoder, const uint8_t *text, size_t textLen, uint8_t *data, uint32_t *address, size_t *len);
 
 parserError_t hex_open(void *storage, const char *filename);
 parserError_t hex_close(void *storage);
 parserError_t hex_size(void *storage);
 parserError_t hex_read(void *storage, void *data, size_t offset, size_t *len);
+parserError_t hex_view(void *storage, const uint8_t **data, size_t *len);
+parserError_t hex_segments(void *storage, const parserSegment_t **segments, size_t *count);
+parserError_t hex_section(void *storage, const char *name, uint32_t *address, size_t *len);
+parserError_t elf_open(void *storage, const char *filename);
+parserError_t elf_close(void *storage);
+parserError_t elf_size(void *storage);
+parserError_t elf_read(void *storage, void *data, size_t offset, size_t *len);
+parserError_t elf_view(void *storage, const uint8_t **data, size_t *len);
+parserError_t elf_segments(void *storage, const parserSegment_t **segments, size_t *count);
+parserError_t elf_section(void *storage, const char *name, uint32_t *address, size_t *len);
+// Where a loaded address the program runs from was loaded from
+bool elf_load_address(const elfStorage_t *st, uint32_t address, size_t len, uint32_t *load);
 parserError_t bin_open(void *storage, const char *filename);
 parserError_t bin_close(void *storage);
 parserError_t bin_size(void *storage);
 parserError_t bin_read(void *storage, void *data, size_t offset, size_t *len);
+parserError_t bin_view(void *storage, const uint8_t **data, size_t *len);
+parserError_t bin_segments(void *storage, const parserSegment_t **segments, size_t *count);
+parserError_t bin_section(void *storage, const char *name, uint32_t *address, size_t *len);
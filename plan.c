@@ -0,0 +1,392 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "plan.h"
+#include "diff.h"
+
+// Bytes on the wire and ACK round trips of the erase commands
+#define MASS_ERASE_BYTES 6
+#define PAGE_ERASE_BYTES 6
+#define ERASE_ROUND_TRIPS 2
+#define FRAME_ROUND_TRIPS 3
+
+// A read frame costs the same command, address and length bytes as a write
+#define READ_FRAME_BYTES CHUNK_FRAME_OVERHEAD
+#define READ_FRAME_LEN CHUNK_MAX_LEN
+
+// 8 data bits, even parity and a stop bit
+#define BITS_PER_BYTE 11
+
+// Calibrated values move towards new measurements by at least this much
+#define CALIBRATION_MIN_WEIGHT 0.25
+
+static bool addFrames(flashPlan_t *plan, const uint8_t *target, size_t offset, size_t len) {
+  chunkPlanner_t planner;
+  chunk_t chunk;
+  planExtent_t *frame;
+
+  plan->extent[plan->extentCount].address = plan->dev->fl_start + offset;
+  plan->extent[plan->extentCount].offset = offset;
+  plan->extent[plan->extentCount].len = len;
+  plan->extentCount++;
+
+  chunk_begin(&planner, target + offset, len, CHUNK_FRAME_OVERHEAD);
+
+  while(chunk_next(&planner, &chunk)) {
+    if(plan->frameCount == plan->frameAllocated) {
+      plan->frameAllocated = plan->frameAllocated ? plan->frameAllocated * 2 : 64;
+      frame = realloc(plan->frame, sizeof(planExtent_t) * plan->frameAllocated);
+      if(!frame)
+        return false;
+      plan->frame = frame;
+    }
+
+    frame = &plan->frame[plan->frameCount++];
+    frame->address = plan->dev->fl_start + offset + chunk.offset;
+    frame->offset = offset + chunk.offset;
+    frame->len = chunk.len;
+
+    chunk_count(&plan->stats, &chunk);
+  }
+
+  return true;
+}
+
+bool plan_build(flashPlan_t *plan, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen, const uint8_t *baseline, size_t baselineLen) {
+  size_t pages = (dev->fl_end - dev->fl_start) / dev->fl_ps;
+  size_t offset, len, maxLen, minLen, runStart = 0, runLen = 0;
+  bool different;
+
+  memset(plan, 0, sizeof(flashPlan_t));
+  plan->dev = dev;
+
+  maxLen = targetLen > baselineLen ? targetLen : baselineLen;
+  minLen = targetLen > baselineLen ? baselineLen : targetLen;
+
+  if(targetLen > dev->fl_end - dev->fl_start)
+    return false;
+
+  plan->erase = malloc(pages);
+  plan->extent = malloc(sizeof(planExtent_t) * (pages / 2 + 1));
+  if(!plan->erase || !plan->extent)
+    goto eFail;
+
+  if(!baseline) {
+    plan->massErase = true;
+
+    if(targetLen > 0 && !addFrames(plan, target, 0, targetLen))
+      goto eFail;
+
+    return true;
+  }
+
+  for(offset = 0; offset < maxLen && offset < dev->fl_end - dev->fl_start; offset += dev->fl_ps) {
+    // Pages only the baseline has just need to be erased
+    if(offset >= targetLen) {
+      plan->erase[plan->eraseCount++] = offset / dev->fl_ps;
+      continue;
+    }
+
+    len = dev->fl_ps > targetLen - offset ? targetLen - offset : dev->fl_ps;
+
+    // A page which only one of the images fully covers is always different
+    if(offset >= baselineLen)
+      different = true;
+    else if(dev->fl_ps > minLen - offset && baselineLen != targetLen)
+      different = true;
+    else
+      different = diff_range(target + offset, baseline + offset, len, NULL, NULL);
+
+    if(different) {
+      plan->erase[plan->eraseCount++] = offset / dev->fl_ps;
+
+      // Consecutive pages are written as one stream so frames can cross them
+      if(runLen > 0 && runStart + runLen == offset) {
+        runLen += len;
+        continue;
+      }
+    }
+
+    if(runLen > 0 && !addFrames(plan, target, runStart, runLen))
+      goto eFail;
+
+    runStart = offset;
+    runLen = different ? len : 0;
+  }
+
+  if(runLen > 0 && !addFrames(plan, target, runStart, runLen))
+    goto eFail;
+
+  return true;
+
+eFail:
+  plan_free(plan);
+  return false;
+}
+
+bool plan_build_pages(flashPlan_t *plan, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen, const uint8_t *pages, size_t count) {
+  size_t i, offset, len, runStart = 0, runLen = 0;
+
+  memset(plan, 0, sizeof(flashPlan_t));
+  plan->dev = dev;
+
+  plan->erase = malloc(count + 1);
+  plan->extent = malloc(sizeof(planExtent_t) * (count + 1));
+  if(!plan->erase || !plan->extent)
+    goto eFail;
+
+  memcpy(plan->erase, pages, count);
+  plan->eraseCount = count;
+
+  for(i = 0; i < count; i++) {
+    offset = pages[i] * dev->fl_ps;
+
+    // Pages past the end of the target are only erased
+    if(offset >= targetLen)
+      break;
+
+    len = dev->fl_ps > targetLen - offset ? targetLen - offset : dev->fl_ps;
+
+    if(runLen > 0 && runStart + runLen == offset) {
+      runLen += len;
+      continue;
+    }
+
+    if(runLen > 0 && !addFrames(plan, target, runStart, runLen))
+      goto eFail;
+
+    runStart = offset;
+    runLen = len;
+  }
+
+  if(runLen > 0 && !addFrames(plan, target, runStart, runLen))
+    goto eFail;
+
+  return true;
+
+eFail:
+  plan_free(plan);
+  return false;
+}
+
+void plan_free(flashPlan_t *plan) {
+  free(plan->erase);
+  free(plan->extent);
+  free(plan->frame);
+  memset(plan, 0, sizeof(flashPlan_t));
+}
+
+bool plan_overlay(uint8_t **image, size_t *len, const uint8_t *baseline, size_t baselineLen, const uint8_t *target, size_t targetLen, size_t start, size_t end) {
+  size_t have = end < targetLen ? end : targetLen;
+
+  *len = baselineLen > end ? baselineLen : end;
+  *image = malloc(*len ? *len : 1);
+  if(!*image)
+    return false;
+
+  memset(*image, 0xff, *len);
+  if(baseline)
+    memcpy(*image, baseline, baselineLen);
+
+  // Whatever of the span lies past the end of target is left erased
+  if(start < have)
+    memcpy(*image + start, target + start, have - start);
+  if(end > have && end > start)
+    memset(*image + (start > have ? start : have), 0xff, end - (start > have ? start : have));
+
+  return true;
+}
+
+bool plan_overlay_pages(uint8_t **image, size_t *len, const stm32_dev_t *dev, const uint8_t *baseline, size_t baselineLen,
+  const uint8_t *target, size_t targetLen, const uint8_t *pages, size_t count) {
+  size_t i, start, end;
+
+  *len = baselineLen > targetLen ? baselineLen : targetLen;
+  *image = malloc(*len ? *len : 1);
+  if(!*image)
+    return false;
+
+  memset(*image, 0xff, *len);
+  if(baseline)
+    memcpy(*image, baseline, baselineLen);
+
+  for(i = 0; i < count; i++) {
+    start = pages[i] * dev->fl_ps;
+    end = start + dev->fl_ps > *len ? *len : start + dev->fl_ps;
+    if(start >= *len)
+      break;
+
+    memset(*image + start, 0xff, end - start);
+    if(start < targetLen)
+      memcpy(*image + start, target + start, (end < targetLen ? end : targetLen) - start);
+  }
+
+  return true;
+}
+
+void plan_default_cost(planCost_t *cost) {
+  memset(cost, 0, sizeof(planCost_t));
+
+  // Typical STM32F10x datasheet figures and a USB serial adapter's latency
+  cost->pageErase = 0.020;
+  cost->massErase = 0.040;
+  cost->ackLatency = 0.001;
+  cost->halfwordProgram = 0.000052;
+}
+
+bool plan_load_cost(planCost_t *cost, const char *filename) {
+  FILE *in = fopen(filename, "r");
+  int read;
+
+  if(!in)
+    return false;
+
+  read = fscanf(in, "pageErase %lf %u\nmassErase %lf %u\nackLatency %lf %u\nhalfwordProgram %lf\n",
+    &cost->pageErase, &cost->pageEraseSamples, &cost->massErase, &cost->massEraseSamples,
+    &cost->ackLatency, &cost->ackLatencySamples, &cost->halfwordProgram);
+  fclose(in);
+
+  if(read != 7) {
+    plan_default_cost(cost);
+    return false;
+  }
+
+  return true;
+}
+
+bool plan_save_cost(const planCost_t *cost, const char *filename) {
+  char temp[1024];
+  FILE *out;
+  bool ok;
+
+  // Robots flashed at once all calibrate the station, so each writes its own file and renames it into place
+  if(snprintf(temp, sizeof(temp), "%s.%i", filename, (int)getpid()) >= sizeof(temp) || !(out = fopen(temp, "w")))
+    return false;
+
+  fprintf(out, "pageErase %.6f %u\nmassErase %.6f %u\nackLatency %.6f %u\nhalfwordProgram %.6f\n",
+    cost->pageErase, cost->pageEraseSamples, cost->massErase, cost->massEraseSamples,
+    cost->ackLatency, cost->ackLatencySamples, cost->halfwordProgram);
+
+  ok = fclose(out) == 0;
+#ifdef __WIN32__
+  remove(filename);
+#endif
+  if(!ok || rename(temp, filename) != 0) {
+    remove(temp);
+    return false;
+  }
+
+  return true;
+}
+
+// Running average which settles into a moving one once it has a few samples
+static void calibrate(double *value, unsigned int *samples, double measured) {
+  double weight = 1.0 / (*samples + 1);
+
+  if(measured < 0)
+    measured = 0;
+
+  if(weight < CALIBRATION_MIN_WEIGHT)
+    weight = CALIBRATION_MIN_WEIGHT;
+
+  // Samples start from the datasheet figures rather than replacing them
+  if(*samples == 0)
+    weight = 0.5;
+
+  *value += (measured - *value) * weight;
+  (*samples)++;
+}
+
+void plan_calibrate(planCost_t *cost, const flashPlan_t *plan, double eraseTime, double writeTime, unsigned int baud) {
+  double byteTime = (double)BITS_PER_BYTE / baud;
+  double remaining;
+
+  if(plan->massErase) {
+    remaining = eraseTime - MASS_ERASE_BYTES * byteTime - ERASE_ROUND_TRIPS * cost->ackLatency;
+    calibrate(&cost->massErase, &cost->massEraseSamples, remaining);
+  } else if(plan->eraseCount > 0) {
+    remaining = eraseTime - plan_erase_commands(plan) * (PAGE_ERASE_BYTES * byteTime + ERASE_ROUND_TRIPS * cost->ackLatency) -
+      plan->eraseCount * byteTime;
+    calibrate(&cost->pageErase, &cost->pageEraseSamples, remaining / plan->eraseCount);
+  }
+
+  // Whatever the wire and programming don't explain is spent waiting on ACKs
+  if(plan->stats.frames > 0) {
+    remaining = writeTime - chunk_wire_bytes(&plan->stats) * byteTime - (plan->stats.bytes / 2) * cost->halfwordProgram;
+    calibrate(&cost->ackLatency, &cost->ackLatencySamples, remaining / (plan->stats.frames * FRAME_ROUND_TRIPS));
+  }
+}
+
+size_t plan_erase_commands(const flashPlan_t *plan) {
+  if(plan->massErase)
+    return 1;
+
+  return (plan->eraseCount + PLAN_ERASE_BATCH - 1) / PLAN_ERASE_BATCH;
+}
+
+size_t plan_wire_bytes(const flashPlan_t *plan) {
+  size_t bytes = chunk_wire_bytes(&plan->stats);
+
+  if(plan->massErase)
+    bytes += MASS_ERASE_BYTES;
+  else if(plan->eraseCount > 0)
+    bytes += plan_erase_commands(plan) * PAGE_ERASE_BYTES + plan->eraseCount;
+
+  return bytes;
+}
+
+double plan_estimate(const flashPlan_t *plan, const planCost_t *cost, unsigned int baud) {
+  double time = (double)plan_wire_bytes(plan) * BITS_PER_BYTE / baud;
+
+  if(plan->massErase)
+    time += cost->massErase + ERASE_ROUND_TRIPS * cost->ackLatency;
+  else if(plan->eraseCount > 0)
+    time += plan->eraseCount * cost->pageErase + plan_erase_commands(plan) * ERASE_ROUND_TRIPS * cost->ackLatency;
+
+  time += plan->stats.frames * FRAME_ROUND_TRIPS * cost->ackLatency;
+  time += (plan->stats.bytes / 2) * cost->halfwordProgram;
+
+  return time;
+}
+
+size_t plan_readback_wire_bytes(size_t len) {
+  return len + (len + READ_FRAME_LEN - 1) / READ_FRAME_LEN * READ_FRAME_BYTES;
+}
+
+double plan_readback_estimate(const planCost_t *cost, size_t len, unsigned int baud) {
+  size_t frames = (len + READ_FRAME_LEN - 1) / READ_FRAME_LEN;
+
+  return (double)plan_readback_wire_bytes(len) * BITS_PER_BYTE / baud + frames * FRAME_ROUND_TRIPS * cost->ackLatency;
+}
+
+void plan_calibrate_readback(planCost_t *cost, size_t len, double readTime, unsigned int baud) {
+  size_t frames = (len + READ_FRAME_LEN - 1) / READ_FRAME_LEN;
+  double remaining = readTime - (double)plan_readback_wire_bytes(len) * BITS_PER_BYTE / baud;
+
+  if(frames > 0)
+    calibrate(&cost->ackLatency, &cost->ackLatencySamples, remaining / (frames * FRAME_ROUND_TRIPS));
+}
+
+void plan_print(const flashPlan_t *plan, FILE *out) {
+  size_t i, frames = 0, bytes;
+
+  if(plan->massErase) {
+    fprintf(out, "Erase : all %i pages (mass erase)\n", (plan->dev->fl_end - plan->dev->fl_start) / plan->dev->fl_ps);
+  } else {
+    fprintf(out, "Erase : %li pages", plan->eraseCount);
+    for(i = 0; i < plan->eraseCount; i++)
+      fprintf(out, "%s%i", i == 0 ? " (" : ", ", plan->erase[i]);
+    fprintf(out, "%s\n", plan->eraseCount > 0 ? ")" : "");
+  }
+
+  for(i = 0; i < plan->extentCount; i++) {
+    for(bytes = 0; frames < plan->frameCount && plan->frame[frames].offset < plan->extent[i].offset + plan->extent[i].len; frames++)
+      bytes += plan->frame[frames].len;
+
+    fprintf(out, "Write : 0x%08x-0x%08lx (%li bytes, %li sent)\n", plan->extent[i].address,
+      plan->extent[i].address + plan->extent[i].len, plan->extent[i].len, bytes);
+  }
+
+  fprintf(out, "Frames: %li (%li bytes of data, %li bytes on the wire)\n", plan->stats.frames, plan->stats.bytes, plan_wire_bytes(plan));
+}
@@ -0,0 +1,83 @@
+#ifndef _PLAN_H
+#define _PLAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stm32.h"
+#include "chunk.h"
+
+// Pages erased per command, so even slow pages are done within the serial read timeout
+#define PLAN_ERASE_BATCH 8
+
+// A span of flash at address, taken from offset in the target image
+typedef struct {
+  uint32_t address;
+  size_t offset, len;
+} planExtent_t;
+
+typedef struct {
+  const stm32_dev_t *dev;
+
+  // Either a mass erase or a list of pages to erase
+  bool massErase;
+  uint8_t *erase;
+  size_t eraseCount;
+
+  // Runs of pages being rewritten, and the write frames covering them
+  planExtent_t *extent, *frame;
+  size_t extentCount, frameCount, frameAllocated;
+  chunkStats_t stats;
+} flashPlan_t;
+
+// Timings (in seconds) of the parts of a flash which don't depend on the baud,
+// along with how many measurements each calibrated value is built from
+typedef struct {
+  double pageErase, massErase, ackLatency, halfwordProgram;
+  unsigned int pageEraseSamples, massEraseSamples, ackLatencySamples;
+} planCost_t;
+
+/*
+  Builds the plan to turn the device from baseline into target, both images
+  starting at the beginning of flash. Without a baseline the whole chip is
+  mass erased and target written in full.
+*/
+bool plan_build(flashPlan_t *plan, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen, const uint8_t *baseline, size_t baselineLen);
+// Builds the plan to erase and rewrite just the given pages (in ascending order) from target
+bool plan_build_pages(flashPlan_t *plan, const stm32_dev_t *dev, const uint8_t *target, size_t targetLen, const uint8_t *pages, size_t count);
+void plan_free(flashPlan_t *plan);
+
+/*
+  Builds the image the device ends up holding when only the span from start
+  to end of target is flashed over baseline, all offsets from the beginning
+  of flash. Planning it against baseline touches just the pages of the span.
+*/
+bool plan_overlay(uint8_t **image, size_t *len, const uint8_t *baseline, size_t baselineLen, const uint8_t *target, size_t targetLen, size_t start, size_t end);
+
+/*
+  Builds the image the device ends up holding when only the given pages (in
+  ascending order) are flashed from target over baseline. Whatever of those
+  pages lies past the end of target is left erased.
+*/
+bool plan_overlay_pages(uint8_t **image, size_t *len, const stm32_dev_t *dev, const uint8_t *baseline, size_t baselineLen,
+  const uint8_t *target, size_t targetLen, const uint8_t *pages, size_t count);
+
+void plan_default_cost(planCost_t *cost);
+bool plan_load_cost(planCost_t *cost, const char *filename);
+bool plan_save_cost(const planCost_t *cost, const char *filename);
+// Fold the measured erase and write times of a carried out plan into cost
+void plan_calibrate(planCost_t *cost, const flashPlan_t *plan, double eraseTime, double writeTime, unsigned int baud);
+size_t plan_erase_commands(const flashPlan_t *plan);
+size_t plan_wire_bytes(const flashPlan_t *plan);
+double plan_estimate(const flashPlan_t *plan, const planCost_t *cost, unsigned int baud);
+
+// Reading len bytes of flash back, which needs no erase or programming
+size_t plan_readback_wire_bytes(size_t len);
+double plan_readback_estimate(const planCost_t *cost, size_t len, unsigned int baud);
+void plan_calibrate_readback(planCost_t *cost, size_t len, double readTime, unsigned int baud);
+
+void plan_print(const flashPlan_t *plan, FILE *out);
+
+#endif
@@ -0,0 +1,368 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "progress.h"
+
+// Width of the bar itself, between its brackets
+#define BAR_WIDTH 24
+// How long the renderer sleeps once it's caught up
+#define IDLE_US 10000
+
+typedef enum {
+  kEvent_log,
+  kEvent_progress,
+} eventType_t;
+
+typedef struct {
+  eventType_t type;
+  double time;
+  cortexflashLog_t level;
+  cortexflashStage_t stage;
+  size_t done, total;
+  char text[PROGRESS_LINE];
+} progressEvent_t;
+
+/*
+  Events on their way from the thread flashing to the renderer. As with the
+  frame ring in flash.c, one thread moves head and the other tail, so the
+  store past a slot is all it takes to hand it over.
+*/
+typedef struct {
+  progressEvent_t event[PROGRESS_SLOTS];
+  atomic_size_t head, tail;
+  atomic_bool stop;
+} eventRing_t;
+
+// Where the stage being shown has got to
+typedef struct {
+  bool active, drawn;
+  cortexflashStage_t stage;
+  size_t done, total;
+  double start, updated, rendered;
+} stageState_t;
+
+static const char *stageNames[] = {"erase", "write", "verify", "read"};
+static const char *levelNames[] = {"error", "info", "detail", "debug"};
+
+static progressMode_t mode = kProgressMode_none;
+static cortexflashLog_t verbosity = kCortexflashLog_detail;
+static double origin;
+
+static eventRing_t ring;
+static pthread_t thread;
+static bool running;
+static stageState_t state;
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void sleepUs(long us) {
+  struct timespec time = {us / 1000000, (us % 1000000) * 1000};
+
+  nanosleep(&time, NULL);
+}
+
+static void printJsonString(FILE *out, const char *text, size_t len) {
+  // Every byte escaped to \u00xx at worst, between quotes
+  char json[PROGRESS_LINE * 6 + 3];
+
+  progress_json_string(json, sizeof(json), text, len);
+  fputs(json, out);
+}
+
+static void printSize(char *out, size_t len, double bytes) {
+  if(bytes >= 1024 * 1024)
+    snprintf(out, len, "%.1fMiB", bytes / (1024 * 1024));
+  else if(bytes >= 1024)
+    snprintf(out, len, "%.1fKiB", bytes / 1024);
+  else
+    snprintf(out, len, "%.0fB", bytes);
+}
+
+static double rate(const stageState_t *stage) {
+  double elapsed = stage->updated - stage->start;
+
+  return elapsed > 0 ? stage->done / elapsed : 0;
+}
+
+static void clearBar(void) {
+  if(!state.drawn)
+    return;
+
+  fputs("\r\033[K", stderr);
+  fflush(stderr);
+  state.drawn = false;
+}
+
+static void drawBar(double time) {
+  char line[160], done[16], speed[16];
+  size_t filled = state.total ? state.done * BAR_WIDTH / state.total : BAR_WIDTH, at, i;
+  double bytesPerSecond = rate(&state);
+
+  at = snprintf(line, sizeof(line), "\r\033[K%-6s [", stageNames[state.stage]);
+  for(i = 0; i < BAR_WIDTH; i++)
+    line[at++] = i < filled ? '#' : '.';
+  at += snprintf(line + at, sizeof(line) - at, "] %3i%%", state.total ? (int)(state.done * 100 / state.total) : 100);
+
+  // Erasing is counted in pages, which go by too unevenly for a rate to mean much
+  if(state.stage == kCortexflashStage_erase) {
+    snprintf(line + at, sizeof(line) - at, "  %lu/%lu pages", (unsigned long)state.done, (unsigned long)state.total);
+  } else {
+    printSize(done, sizeof(done), state.done);
+    printSize(speed, sizeof(speed), bytesPerSecond);
+    at += snprintf(line + at, sizeof(line) - at, "  %s  %s/s", done, speed);
+
+    if(bytesPerSecond > 0 && state.done < state.total)
+      snprintf(line + at, sizeof(line) - at, "  ETA %.1fs", (state.total - state.done) / bytesPerSecond);
+  }
+
+  fputs(line, stderr);
+  fflush(stderr);
+
+  state.drawn = true;
+  state.rendered = time;
+}
+
+static void writeProgressLine(void) {
+  double bytesPerSecond = rate(&state);
+
+  printf("{\"event\":\"progress\",\"time\":%.3f,\"stage\":\"%s\",\"done\":%lu,\"total\":%lu", state.updated - origin,
+    stageNames[state.stage], (unsigned long)state.done, (unsigned long)state.total);
+
+  if(state.stage != kCortexflashStage_erase) {
+    printf(",\"rate\":%.0f", bytesPerSecond);
+    if(bytesPerSecond > 0)
+      printf(",\"eta\":%.3f", (state.total - state.done) / bytesPerSecond);
+  }
+
+  printf("}\n");
+  fflush(stdout);
+
+  state.rendered = state.updated;
+}
+
+static void renderLog(const progressEvent_t *event) {
+  const char *text = event->text;
+  size_t len;
+
+  if(event->level > verbosity)
+    return;
+
+  if(mode == kProgressMode_json) {
+    // Blank lines only space out what's printed for people
+    while(*text == '\n')
+      text++;
+    for(len = strlen(text); len > 0 && text[len - 1] == '\n'; len--);
+    if(len == 0)
+      return;
+
+    printf("{\"event\":\"log\",\"time\":%.3f,\"level\":\"%s\",\"message\":", event->time - origin, levelNames[event->level]);
+    printJsonString(stdout, text, len);
+    printf("}\n");
+    fflush(stdout);
+    return;
+  }
+
+  clearBar();
+
+  if(event->level == kCortexflashLog_error) {
+    fprintf(stderr, "%s\n", text);
+  } else {
+    printf("%s\n", text);
+    fflush(stdout);
+  }
+}
+
+static void renderProgress(const progressEvent_t *event) {
+  bool finished = event->done >= event->total, starting = !state.active || state.stage != event->stage || event->done == 0;
+
+  // The last of a stage can be reported twice, once by what finishes it and once by the stage itself
+  if(!starting && event->done == state.done && event->total == state.total)
+    return;
+
+  if(starting) {
+    state.active = true;
+    state.stage = event->stage;
+    state.start = event->time;
+    state.rendered = 0;
+  }
+
+  state.done = event->done;
+  state.total = event->total;
+  state.updated = event->time;
+
+  // The first and last of a stage are always shown, anything in between only so often
+  if(!starting && !finished && event->time - state.rendered < 1.0 / PROGRESS_RATE)
+    return;
+
+  if(mode == kProgressMode_json)
+    writeProgressLine();
+  else if(mode == kProgressMode_bar)
+    drawBar(event->time);
+}
+
+static void render(const progressEvent_t *event) {
+  if(event->type == kEvent_log)
+    renderLog(event);
+  else
+    renderProgress(event);
+}
+
+static void *renderEvents(void *context) {
+  size_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  bool stop;
+
+  for(;;) {
+    // Taken before looking at the ring, so nothing pushed before stopping is missed
+    stop = atomic_load_explicit(&ring.stop, memory_order_acquire);
+
+    if(tail == atomic_load_explicit(&ring.head, memory_order_acquire)) {
+      if(stop)
+        break;
+
+      sleepUs(IDLE_US);
+      continue;
+    }
+
+    render(&ring.event[tail % PROGRESS_SLOTS]);
+    atomic_store_explicit(&ring.tail, ++tail, memory_order_release);
+  }
+
+  return NULL;
+}
+
+// Only ever called from the thread flashing, which is the ring's only producer
+static bool push(const progressEvent_t *event, bool wait) {
+  size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+  while(head - atomic_load_explicit(&ring.tail, memory_order_acquire) >= PROGRESS_SLOTS) {
+    if(!wait)
+      return false;
+    sleepUs(IDLE_US / 10);
+  }
+
+  ring.event[head % PROGRESS_SLOTS] = *event;
+  atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+  return true;
+}
+
+void progress_init(progressMode_t newMode, cortexflashLog_t newVerbosity) {
+  verbosity = newVerbosity;
+  mode = newMode;
+  origin = now();
+
+  if(mode == kProgressMode_auto)
+    mode = verbosity >= kCortexflashLog_detail && isatty(STDERR_FILENO) ? kProgressMode_bar : kProgressMode_none;
+}
+
+progressMode_t progress_mode(void) {
+  return mode;
+}
+
+bool progress_start(void) {
+  if(running || mode == kProgressMode_none)
+    return running;
+
+  memset(&state, 0, sizeof(state));
+  atomic_store(&ring.head, 0);
+  atomic_store(&ring.tail, 0);
+  atomic_store(&ring.stop, false);
+
+  running = pthread_create(&thread, NULL, renderEvents, NULL) == 0;
+  return running;
+}
+
+void progress_stop(void) {
+  if(!running)
+    return;
+
+  atomic_store_explicit(&ring.stop, true, memory_order_release);
+  pthread_join(thread, NULL);
+  running = false;
+
+  clearBar();
+}
+
+void progress_log(cortexflashLog_t level, const char *format, ...) {
+  progressEvent_t event;
+  va_list args;
+
+  if(level > verbosity)
+    return;
+
+  event.type = kEvent_log;
+  event.time = now();
+  event.level = level;
+
+  va_start(args, format);
+  vsnprintf(event.text, sizeof(event.text), format, args);
+  va_end(args);
+
+  // Messages are never dropped, so one waits for the renderer to make room
+  if(running)
+    push(&event, true);
+  else
+    render(&event);
+}
+
+size_t progress_json_string(char *out, size_t outLen, const char *text, size_t len) {
+  const char *end = text + len;
+  char escaped[8];
+  size_t at = 0, size;
+
+  if(outLen < 3) {
+    if(outLen > 0)
+      *out = 0;
+    return 0;
+  }
+
+  out[at++] = '"';
+
+  for(; text < end; text++) {
+    if(*text == '"' || *text == '\\')
+      size = snprintf(escaped, sizeof(escaped), "\\%c", *text);
+    else if(*text == '\n')
+      size = snprintf(escaped, sizeof(escaped), "\\n");
+    else if((unsigned char)*text < 0x20)
+      size = snprintf(escaped, sizeof(escaped), "\\u%04x", *text);
+    else
+      size = snprintf(escaped, sizeof(escaped), "%c", *text);
+
+    // Room is always left for the closing quote
+    if(at + size + 2 > outLen)
+      break;
+
+    memcpy(out + at, escaped, size);
+    at += size;
+  }
+
+  out[at++] = '"';
+  out[at] = 0;
+
+  return at;
+}
+
+void progress_update(cortexflashStage_t stage, size_t done, size_t total) {
+  progressEvent_t event;
+
+  if(!running)
+    return;
+
+  event.type = kEvent_progress;
+  event.time = now();
+  event.stage = stage;
+  event.done = done;
+  event.total = total;
+
+  push(&event, false);
+}
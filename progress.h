@@ -0,0 +1,50 @@
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cortexflash.h"
+
+// Events waiting to be rendered, a power of two
+#define PROGRESS_SLOTS 64
+// Longest message passed on in one piece
+#define PROGRESS_LINE 512
+// Times a second the bar is redrawn, or a progress line written, at most
+#define PROGRESS_RATE 10
+
+typedef enum {
+  // A bar if stderr is a terminal and nothing's been quietened, otherwise none
+  kProgressMode_auto,
+  kProgressMode_none,
+  kProgressMode_bar,
+  // A JSON object per line on stdout for tools to follow, messages included
+  kProgressMode_json,
+} progressMode_t;
+
+// Messages more detailed than verbosity are dropped
+void progress_init(progressMode_t mode, cortexflashLog_t verbosity);
+progressMode_t progress_mode(void);
+
+/*
+  Starts a thread which renders whatever's logged or updated until
+  progress_stop, so flashing only ever copies an event into a ring instead
+  of waiting on the terminal. Before it's started, and once it's stopped,
+  messages are printed as they come and progress isn't shown.
+*/
+bool progress_start(void);
+// Renders everything left and clears the bar
+void progress_stop(void);
+
+void progress_log(cortexflashLog_t level, const char *format, ...);
+
+/*
+  Writes len bytes of text to out as a quoted JSON string, escaped. What
+  doesn't fit in outLen is cut off before an escape is split, so out is
+  always a whole string. Returns its length.
+*/
+size_t progress_json_string(char *out, size_t outLen, const char *text, size_t len);
+// Dropped rather than waited on if the renderer is behind, as a later update says more
+void progress_update(cortexflashStage_t stage, size_t done, size_t total);
+
+#endif
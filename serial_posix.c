@@ -19,6 +19,7 @@
 
 
 #include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
@@ -153,12 +154,23 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
     h->newtio.c_cc[VTIME] = 5;
 
 	/* set the settings */
+	struct termios settings;
 	serial_flush(h);
-	if (tcsetattr(h->fd, TCSANOW, &h->newtio) != 0)
-		return SERIAL_ERR_SYSTEM;
+	if (tcsetattr(h->fd, TCSANOW, &h->newtio) != 0) {
+		/*
+		  a pseudo-terminal (such as the emulator's) has no parity bit, which
+		  glibc reports as EINVAL after everything else has been set
+		*/
+		if (
+			errno != EINVAL                         ||
+			!(port_parity & PARENB)                 ||
+			tcgetattr(h->fd, &settings) != 0        ||
+			(settings.c_cflag & (CSIZE | CSTOPB | CREAD)) != (h->newtio.c_cflag & (CSIZE | CSTOPB | CREAD)) ||
+			cfgetospeed(&settings) != port_baud
+		)	return SERIAL_ERR_SYSTEM;
+	}
 
 	/* confirm they were set */
-	struct termios settings;
 	tcgetattr(h->fd, &settings);
 	if (
 		settings.c_iflag != h->newtio.c_iflag ||
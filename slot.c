@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slot.h"
+#include "plan.h"
+#include "utils.h"
+
+#define SLOT_MAP_FILE "slots"
+
+void slot_range(const stm32_dev_t *dev, unsigned int count, unsigned int slot, size_t *start, size_t *end) {
+  size_t pages = (dev->fl_end - dev->fl_start) / dev->fl_ps;
+  size_t perSlot = (pages - 1) / count;
+
+  *start = (1 + slot * perSlot) * dev->fl_ps;
+  *end = *start + perSlot * dev->fl_ps;
+}
+
+bool slot_check(const stm32_dev_t *dev, unsigned int count, unsigned int slot, const uint8_t *image, size_t len) {
+  size_t start, end, i;
+  uint32_t reset;
+
+  slot_range(dev, count, slot, &start, &end);
+
+  if(len < start + 8)
+    return false;
+
+  for(i = 0; i < len; i++) {
+    if(i == start)
+      i = end;
+    if(i < len && image[i] != 0xff)
+      return false;
+  }
+
+  reset = (image[start + 4] | (image[start + 5] << 8) | (image[start + 6] << 16) | ((uint32_t)image[start + 7] << 24)) & ~1;
+  return reset >= dev->fl_start + start && reset < dev->fl_start + end;
+}
+
+bool slot_compose(uint8_t **image, size_t *len, const stm32_dev_t *dev, unsigned int count, unsigned int slot,
+  const uint8_t *baseline, size_t baselineLen, const uint8_t *target, size_t targetLen) {
+  uint8_t *slotted, *vectors;
+  size_t slottedLen, start, end, have;
+  bool ok;
+
+  slot_range(dev, count, slot, &start, &end);
+
+  if(target)
+    ok = plan_overlay(&slotted, &slottedLen, baseline, baselineLen, target, targetLen, start, end);
+  else
+    ok = plan_overlay(&slotted, &slottedLen, baseline, baselineLen, NULL, 0, 0, 0);
+  if(!ok)
+    return false;
+
+  // The boot page holds a copy of the slot's vector table and nothing else
+  vectors = malloc(dev->fl_ps);
+  if(!vectors) {
+    free(slotted);
+    return false;
+  }
+
+  memset(vectors, 0xff, dev->fl_ps);
+  have = slottedLen > start ? slottedLen - start : 0;
+  memcpy(vectors, slotted + start, have > SLOT_VECTOR_LEN ? SLOT_VECTOR_LEN : have);
+
+  ok = plan_overlay(image, len, slotted, slottedLen, vectors, dev->fl_ps, 0, dev->fl_ps);
+
+  free(vectors);
+  free(slotted);
+  return ok;
+}
+
+uint32_t slot_hash(const stm32_dev_t *dev, unsigned int count, unsigned int slot, const uint8_t *image, size_t len, size_t *used) {
+  size_t start, end;
+
+  slot_range(dev, count, slot, &start, &end);
+
+  // Trailing erased bytes aren't part of the program
+  if(end > len)
+    end = len;
+  while(end > start && image[end - 1] == 0xff)
+    end--;
+
+  *used = end > start ? end - start : 0;
+  return crc32(0, image + start, *used);
+}
+
+bool slot_load_map(slotMap_t *map, const cacheStore_t *store) {
+  char path[CACHE_PATH_MAX];
+  unsigned int slot, hash;
+  unsigned long len;
+  FILE *in;
+  bool ok;
+
+  memset(map, 0, sizeof(slotMap_t));
+  map->active = -1;
+
+  if(!cache_root_file(store->dir, SLOT_MAP_FILE, path, sizeof(path)) || !(in = fopen(path, "r")))
+    return false;
+
+  ok = fscanf(in, "slots %u\nactive %i\n", &map->count, &map->active) == 2 && map->count > 0 && map->count <= SLOT_MAX;
+
+  while(ok && fscanf(in, "%u %x %lu\n", &slot, &hash, &len) == 3) {
+    if(slot >= map->count)
+      break;
+
+    map->hash[slot] = hash;
+    map->len[slot] = len;
+  }
+
+  fclose(in);
+
+  if(!ok) {
+    memset(map, 0, sizeof(slotMap_t));
+    map->active = -1;
+  }
+
+  return ok;
+}
+
+bool slot_save_map(const slotMap_t *map, const cacheStore_t *store) {
+  char path[CACHE_PATH_MAX];
+  unsigned int slot;
+  FILE *out;
+
+  if(!cache_root_file(store->dir, SLOT_MAP_FILE, path, sizeof(path)) || !(out = fopen(path, "w")))
+    return false;
+
+  fprintf(out, "slots %u\nactive %i\n", map->count, map->active);
+  for(slot = 0; slot < map->count; slot++)
+    if(map->len[slot])
+      fprintf(out, "%u %08x %lu\n", slot, map->hash[slot], (unsigned long)map->len[slot]);
+
+  return fclose(out) == 0;
+}
+
+void slot_clear_map(const cacheStore_t *store) {
+  char path[CACHE_PATH_MAX];
+
+  if(cache_root_file(store->dir, SLOT_MAP_FILE, path, sizeof(path)))
+    remove(path);
+}
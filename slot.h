@@ -0,0 +1,52 @@
+#ifndef _SLOT_H
+#define _SLOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "cache.h"
+
+/*
+  In slot mode flash is split into a boot vector page (page 0) followed by
+  equally sized slots, each holding a program linked to run from its slot.
+  The core always boots through page 0, so making a slot active only means
+  copying its vector table there.
+*/
+#define SLOT_MAX 8
+#define SLOT_DEFAULT_COUNT 3
+// Enough for the largest STM32F1 vector table, rounded up
+#define SLOT_VECTOR_LEN 512
+
+typedef struct {
+  unsigned int count;
+  int active;
+  // CRC-32 and length of the image each slot holds, a length of 0 being unknown
+  uint32_t hash[SLOT_MAX];
+  size_t len[SLOT_MAX];
+} slotMap_t;
+
+// Offsets from the start of flash of the given slot
+void slot_range(const stm32_dev_t *dev, unsigned int count, unsigned int slot, size_t *start, size_t *end);
+
+// Checks image was linked for the slot: nothing outside of it and a reset vector inside it
+bool slot_check(const stm32_dev_t *dev, unsigned int count, unsigned int slot, const uint8_t *image, size_t len);
+
+/*
+  Builds the image the device ends up holding when target is put in the
+  slot (or with no target, the slot's current contents kept) and the slot
+  made active
+*/
+bool slot_compose(uint8_t **image, size_t *len, const stm32_dev_t *dev, unsigned int count, unsigned int slot,
+  const uint8_t *baseline, size_t baselineLen, const uint8_t *target, size_t targetLen);
+
+// Hash of what the slot holds in image
+uint32_t slot_hash(const stm32_dev_t *dev, unsigned int count, unsigned int slot, const uint8_t *image, size_t len, size_t *used);
+
+bool slot_load_map(slotMap_t *map, const cacheStore_t *store);
+bool slot_save_map(const slotMap_t *map, const cacheStore_t *store);
+// Forget the slots, once something other than a slot has been flashed over them
+void slot_clear_map(const cacheStore_t *store);
+
+#endif
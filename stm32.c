@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "stm32.h"
 #include "utils.h"
@@ -170,13 +171,18 @@ stm32_t* stm32_init(const serial_t *serial, const char init) {
 		return NULL;
 	}
 
-	stm->dev = devices;
-	while(stm->dev->id != 0x00 && stm->dev->id != stm->pid)
-		++stm->dev;
-
+	stm->dev = stm32_get_device(stm->pid);
 	return stm;
 }
 
+const stm32_dev_t* stm32_get_device(uint16_t pid) {
+	const stm32_dev_t *dev = devices;
+	while(dev->id != 0x00 && dev->id != pid)
+		++dev;
+
+	return dev;
+}
+
 void stm32_close(stm32_t *stm) {
 	if (stm) free(stm->cmd);
 	free(stm);
@@ -207,7 +213,18 @@ char stm32_read_memory(const stm32_t *stm, uint32_t address, uint8_t data[], uns
 	return 1;
 }
 
+char stm32_read_uid(const stm32_t *stm, uint8_t uid[STM32_UID_LEN]) {
+	return stm32_read_memory(stm, STM32_UID_ADDRESS, uid, STM32_UID_LEN);
+}
+
 char stm32_write_memory(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
+	stm32_frame_t frame;
+
+	stm32_prepare_write(&frame, address, data, len);
+	return stm32_send_write(stm, &frame);
+}
+
+void stm32_prepare_write(stm32_frame_t *frame, uint32_t address, const uint8_t data[], unsigned int len) {
 	uint8_t cs;
 	unsigned int i;
 	int c, extra;
@@ -216,34 +233,41 @@ char stm32_write_memory(const stm32_t *stm, uint32_t address, uint8_t data[], un
 	/* must be 32bit aligned */
 	assert(address % 4 == 0);
 
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
+	frame->address   = address;
+	frame->header[0] = address >> 24;
+	frame->header[1] = address >> 16;
+	frame->header[2] = address >> 8;
+	frame->header[3] = address;
+	frame->header[4] = stm32_gen_cs(address);
 
-	/* send the address and checksum */
-	if (!stm32_send_command(stm, stm->cmd->wm)) return 0;
-	assert(serial_write(stm->serial, &address, 4) == SERIAL_ERR_OK);
-	stm32_send_byte(stm, cs);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
-
-	/* setup the cs and send the length */
+	/* setup the cs and the length */
 	extra = len % 4;
 	cs = len - 1 + extra;
-	stm32_send_byte(stm, cs);
+	frame->body[0] = cs;
 
-	/* write the data and build the checksum */
+	/* copy the data and build the checksum */
+	memcpy(frame->body + 1, data, len);
 	for(i = 0; i < len; ++i)
 		cs ^= data[i];
 
-	assert(serial_write(stm->serial, data, len) == SERIAL_ERR_OK);
-
-	/* write the alignment padding */
+	/* the alignment padding */
 	for(c = 0; c < extra; ++c) {
-		stm32_send_byte(stm, 0xFF);
+		frame->body[1 + len + c] = 0xFF;
 		cs ^= 0xFF;
 	}
 
-	/* send the checksum */
-	stm32_send_byte(stm, cs);
+	frame->body[1 + len + extra] = cs;
+	frame->body_len = len + extra + 2;
+}
+
+char stm32_send_write(const stm32_t *stm, const stm32_frame_t *frame) {
+	/* send the address and checksum */
+	if (!stm32_send_command(stm, stm->cmd->wm)) return 0;
+	if (serial_write(stm->serial, frame->header, sizeof(frame->header)) != SERIAL_ERR_OK) return 0;
+	if (stm32_read_byte(stm) != STM32_ACK) return 0;
+
+	/* the length, data and checksum go in one write */
+	if (serial_write(stm->serial, frame->body, frame->body_len) != SERIAL_ERR_OK) return 0;
 	return stm32_read_byte(stm) == STM32_ACK;
 }
 
@@ -271,6 +295,24 @@ char stm32_erase_memory(const stm32_t *stm, uint8_t pages) {
 	}
 }
 
+char stm32_erase_pages(const stm32_t *stm, const uint8_t pages[], unsigned int count) {
+	uint8_t cs;
+	unsigned int i;
+	assert(count > 0 && count < 256);
+
+	if (!stm32_send_command(stm, stm->cmd->er)) return 0;
+
+	/* a count of 0xFF would be a mass erase */
+	cs = count - 1;
+	stm32_send_byte(stm, cs);
+	for (i = 0; i < count; i++) {
+		stm32_send_byte(stm, pages[i]);
+		cs ^= pages[i];
+	}
+	stm32_send_byte(stm, cs);
+	return stm32_read_byte(stm) == STM32_ACK;
+}
+
 char stm32_go(const stm32_t *stm, uint32_t address) {
 	uint8_t cs;
 
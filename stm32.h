@@ -28,6 +28,8 @@
 #define STM32_NACK	0x1F
 #define STM32_CMD_INIT	0x7F
 #define STM32_CMD_GET	0x00	/* get the version and command supported */
+#define STM32_UID_ADDRESS	0x1FFFF7E8	/* 96-bit unique device ID */
+#define STM32_UID_LEN	12
 
 typedef struct stm32		stm32_t;
 typedef struct stm32_cmd	stm32_cmd_t;
@@ -54,6 +56,14 @@ struct stm32_dev {
 	uint32_t	mem_start, mem_end;
 };
 
+/* a write memory frame, built ahead of sending it */
+typedef struct {
+	uint32_t	address;
+	uint8_t		header[5];	/* big endian address and its checksum */
+	uint8_t		body[261];	/* length - 1, the data, its padding and checksum */
+	unsigned int	body_len;
+} stm32_frame_t;
+
 struct stm32_cmd {
 	uint8_t get;
 	uint8_t gvr;
@@ -70,11 +80,16 @@ struct stm32_cmd {
 };
 
 stm32_t* stm32_init      (const serial_t *serial, const char init);
+const stm32_dev_t* stm32_get_device(uint16_t pid);
 void stm32_close         (stm32_t *stm);
 char stm32_read_memory   (const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
 char stm32_write_memory  (const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+void stm32_prepare_write (stm32_frame_t *frame, uint32_t address, const uint8_t data[], unsigned int len);
+char stm32_send_write    (const stm32_t *stm, const stm32_frame_t *frame);
 char stm32_wunprot_memory(const stm32_t *stm);
 char stm32_erase_memory  (const stm32_t *stm, uint8_t pages);
+char stm32_erase_pages   (const stm32_t *stm, const uint8_t pages[], unsigned int count);
+char stm32_read_uid      (const stm32_t *stm, uint8_t uid[STM32_UID_LEN]);
 char stm32_go            (const stm32_t *stm, uint32_t address);
 char stm32_reset_device  (const stm32_t *stm);
 uint8_t stm32_gen_cs(const uint32_t v);
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+#include "parser.h"
+#include "plan.h"
+#include "flash.h"
+
+typedef struct {
+  const stm32_t *stm;
+  uint8_t *image;
+  // End of the data received so far, and of what has been written
+  size_t len, written;
+  chunkStats_t *stats;
+  flashProgress_t progress;
+  void *context;
+  flashError_t *error;
+} stream_t;
+
+// Writes the image from where the last write stopped up to end
+static bool writeUpTo(stream_t *stream, size_t end) {
+  chunkPlanner_t planner;
+  chunk_t chunk;
+  planExtent_t extent;
+  uint32_t address;
+
+  if(end <= stream->written)
+    return true;
+
+  chunk_begin(&planner, stream->image + stream->written, end - stream->written, CHUNK_FRAME_OVERHEAD);
+
+  while(chunk_next(&planner, &chunk)) {
+    address = stream->stm->dev->fl_start + stream->written + chunk.offset;
+    if(!stm32_write_memory(stream->stm, address, stream->image + stream->written + chunk.offset, chunk.len)) {
+      flash_error(stream->error, "Failed to write memory at address 0x%08x", address);
+      return false;
+    }
+
+    chunk_count(stream->stats, &chunk);
+
+    extent.address = address;
+    extent.offset = stream->written + chunk.offset;
+    extent.len = chunk.len;
+    if(stream->progress && !stream->progress(stream->context, &extent))
+      return false;
+  }
+
+  stream->written = end;
+  return true;
+}
+
+bool stream_flash(const stm32_t *stm, uint8_t **image, size_t *len, chunkStats_t *stats, flashProgress_t progress, void *context, flashError_t *error) {
+  const stm32_dev_t *dev = stm->dev;
+  size_t size = dev->fl_end - dev->fl_start, ps = dev->fl_ps, pages = size / ps;
+  stream_t stream = {stm, NULL, 0, 0, stats, progress, context, error};
+  hexDecoder_t decoder = {0};
+  uint8_t data[255], *late;
+  const uint8_t *text;
+  size_t textLen, dataLen, offset, lateCount = 0, i;
+  uint32_t address;
+  flashPlan_t plan;
+  long used;
+  bool ok = false;
+
+  memset(stats, 0, sizeof(chunkStats_t));
+
+  // The image can never outgrow flash, however much is piped in
+  stream.image = malloc(size);
+  late = calloc(pages, 1);
+  if(!stream.image || !late) {
+    flash_error(error, "Out of memory");
+    goto eDone;
+  }
+
+  memset(stream.image, 0xff, size);
+
+  while(!decoder.done) {
+    text = parser_stdin_data(&textLen);
+    used = hex_decode(&decoder, text, textLen, data, &address, &dataLen);
+
+    // Wait for the rest of a record which hasn't all arrived yet
+    if(used == 0) {
+      if(parser_stdin_fill())
+        continue;
+      if(textLen == 0)
+        break;
+    }
+
+    if(used <= 0) {
+      flash_error(error, "Piped file is corrupt");
+      goto eDone;
+    }
+
+    parser_stdin_consume(used);
+    if(dataLen == 0)
+      continue;
+
+    if(address < dev->fl_start || address + dataLen > dev->fl_end) {
+      flash_error(error, "Piped file holds 0x%08x-0x%08lx, outside of flash", address, (unsigned long)address + dataLen);
+      goto eDone;
+    }
+
+    offset = address - dev->fl_start;
+    memcpy(stream.image + offset, data, dataLen);
+    if(offset + dataLen > stream.len)
+      stream.len = offset + dataLen;
+
+    // Files are normally written in address order, so whatever comes before this record is complete
+    if(offset < stream.written) {
+      for(i = offset / ps; i * ps < stream.written && i * ps < offset + dataLen; i++)
+        late[i] = 1;
+    } else if(!writeUpTo(&stream, offset & ~(CHUNK_MAX_LEN - 1))) {
+      goto eDone;
+    }
+  }
+
+  // A pipe which ends before the end of file record was cut short
+  if(!decoder.done) {
+    flash_error(error, "Piped file is corrupt");
+    goto eDone;
+  }
+
+  if(!writeUpTo(&stream, stream.len))
+    goto eDone;
+
+  for(i = 0; i < pages; i++)
+    if(late[i])
+      late[lateCount++] = i;
+
+  // Pages written before all of their data had arrived
+  if(lateCount > 0) {
+    if(!plan_build_pages(&plan, dev, stream.image, stream.len, late, lateCount)) {
+      flash_error(error, "Could not plan the pages piped in late");
+      goto eDone;
+    }
+
+    ok = flash_erase(stm, &plan, error) && flash_write(stm, &plan, stream.image, stream.len, NULL, NULL, error);
+    stats->frames += plan.stats.frames;
+    stats->bytes += plan.stats.bytes;
+    plan_free(&plan);
+
+    if(!ok)
+      goto eDone;
+  }
+
+  *image = stream.image;
+  *len = stream.len;
+  stream.image = NULL;
+  ok = true;
+
+eDone:
+  free(stream.image);
+  free(late);
+  return ok;
+}
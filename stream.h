@@ -0,0 +1,24 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32.h"
+#include "chunk.h"
+#include "flash.h"
+
+/*
+  Writes the Intel HEX piped into stdin to a device whose flash has just
+  been erased, while the file is still arriving. Records are gathered into
+  an image the size of flash, and as each one is read everything before the
+  frame it starts in is written out. Records reaching back into what has
+  been written have their pages erased and written again at the end.
+  Progress is called for each frame written, and returning false stops the
+  write. Returns the image flashed, from the start of flash, or false on an
+  error, which is described in error, or once stopped.
+*/
+bool stream_flash(const stm32_t *stm, uint8_t **image, size_t *len, chunkStats_t *stats, flashProgress_t progress, void *context, flashError_t *error);
+
+#endif
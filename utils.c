@@ -17,6 +17,7 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <pthread.h>
 
 #include "utils.h"
 
@@ -35,3 +36,29 @@ uint32_t be_u32(const uint32_t v) {
 	return v;
 }
 
+/* built once, whichever of the sessions' threads gets to it first */
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable(void) {
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+/* IEEE 802.3 CRC-32, pass 0 to start and the previous result to continue */
+uint32_t crc32(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	pthread_once(&crcTableOnce, buildCrcTable);
+
+	crc = ~crc;
+	while (len--)
+		crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
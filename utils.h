@@ -21,9 +21,11 @@
 #ifndef _H_UTILS
 #define _H_UTILS
 
+#include <stddef.h>
 #include <stdint.h>
 
 char     cpu_le();
 uint32_t be_u32(const uint32_t v);
+uint32_t crc32 (uint32_t crc, const void *data, size_t len);
 
 #endif